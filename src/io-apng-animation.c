@@ -1,7 +1,9 @@
 #include "io-apng-animation.h"
+#include "io-apng-argb32.h"
 
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
 
 static void gdk_pixbuf_apng_anim_finalize(GObject* object);
 static gboolean
@@ -17,12 +19,111 @@ gdk_pixbuf_apng_anim_get_iter(GdkPixbufAnimation* animation,
 G_DEFINE_TYPE(GdkPixbufApngAnim, gdk_pixbuf_apng_anim,
               GDK_TYPE_PIXBUF_ANIMATION);
 
-static void gdk_pixbuf_apng_anim_init(GdkPixbufApngAnim* anim) {}
+gint64 gdk_pixbuf_apng_fctl_get_delay_us(const ApngChunk_fcTL* fctl) {
+  gint64 delay_us = fctl->delay_num * G_GINT64_CONSTANT(1000000);
+
+  if (fctl->delay_den == 0)
+    return delay_us / 100;
+  else
+    return delay_us / fctl->delay_den;
+}
+
+gint64 gdk_pixbuf_apng_frame_get_delay_us(const GdkPixbufApngFrame* frame) {
+  return gdk_pixbuf_apng_fctl_get_delay_us(&frame->fctl);
+}
+
+/* Frame of the iterator, or the last loaded one if the iterator is ahead of
+ * the loader.
+ */
+static GdkPixbufApngFrame* apng_iter_frame(GdkPixbufApngAnimIter* iter) {
+  GdkPixbufApngAnim*  anim  = iter->anim;
+  GdkPixbufApngFrame* frame = NULL;
+
+  g_mutex_lock(&anim->lock);
+  if (anim->frames->len > 0)
+    frame = g_ptr_array_index(anim->frames,
+                              MIN(iter->current_frame, anim->frames->len - 1));
+  g_mutex_unlock(&anim->lock);
+
+  return frame;
+}
+
+GdkPixbufApngFrame* gdk_pixbuf_apng_anim_get_frame(GdkPixbufApngAnim* anim,
+                                                   guint              index) {
+  GdkPixbufApngFrame* frame = NULL;
+
+  g_mutex_lock(&anim->lock);
+  if (index < anim->frames->len)
+    frame = g_ptr_array_index(anim->frames, index);
+  g_mutex_unlock(&anim->lock);
+
+  return frame;
+}
+
+/* Frames loaded so far, the loader may be adding more. */
+static guint apng_anim_get_n_loaded(GdkPixbufApngAnim* anim) {
+  guint n_loaded;
+
+  g_mutex_lock(&anim->lock);
+  n_loaded = anim->frames->len;
+  g_mutex_unlock(&anim->lock);
+
+  return n_loaded;
+}
+
+enum { PROP_0, PROP_PREMULTIPLIED };
+
+static void gdk_pixbuf_apng_anim_set_property(GObject* object, guint prop_id,
+                                              const GValue* value,
+                                              GParamSpec*   pspec) {
+  GdkPixbufApngAnim* anim = GDK_PIXBUF_APNG_ANIM(object);
+
+  switch (prop_id) {
+  case PROP_PREMULTIPLIED:
+    gdk_pixbuf_apng_anim_set_premultiplied(anim, g_value_get_boolean(value));
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+    break;
+  }
+}
+
+static void gdk_pixbuf_apng_anim_get_property(GObject* object, guint prop_id,
+                                              GValue*     value,
+                                              GParamSpec* pspec) {
+  GdkPixbufApngAnim* anim = GDK_PIXBUF_APNG_ANIM(object);
+
+  switch (prop_id) {
+  case PROP_PREMULTIPLIED:
+    g_value_set_boolean(value, gdk_pixbuf_apng_anim_get_premultiplied(anim));
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+    break;
+  }
+}
+
+static void gdk_pixbuf_apng_anim_init(GdkPixbufApngAnim* anim) {
+  g_mutex_init(&anim->lock);
+  anim->frames = g_ptr_array_new_with_free_func(
+      (GDestroyNotify)gdk_pixbuf_apng_frame_unref);
+  anim->pool = gdk_pixbuf_apng_pool_new();
+}
 static void gdk_pixbuf_apng_anim_class_init(GdkPixbufApngAnimClass* klass) {
   GObjectClass*            object_class = G_OBJECT_CLASS(klass);
   GdkPixbufAnimationClass* anim_class   = GDK_PIXBUF_ANIMATION_CLASS(klass);
 
-  object_class->finalize = gdk_pixbuf_apng_anim_finalize;
+  object_class->finalize     = gdk_pixbuf_apng_anim_finalize;
+  object_class->set_property = gdk_pixbuf_apng_anim_set_property;
+  object_class->get_property = gdk_pixbuf_apng_anim_get_property;
+
+  g_object_class_install_property(
+      object_class, PROP_PREMULTIPLIED,
+      g_param_spec_boolean("premultiplied", "Premultiplied",
+                           "Composite frames into premultiplied ARGB32 "
+                           "canvases",
+                           FALSE,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
   anim_class->is_static_image  = gdk_pixbuf_apng_anim_is_static_image;
   anim_class->get_static_image = gdk_pixbuf_apng_anim_get_static_image;
@@ -33,38 +134,79 @@ static void gdk_pixbuf_apng_anim_class_init(GdkPixbufApngAnimClass* klass) {
 static void gdk_pixbuf_apng_anim_finalize(GObject* object) {
   GdkPixbufApngAnim* anim = GDK_PIXBUF_APNG_ANIM(object);
 
-  for (GList* l = anim->frames; l; l = l->next) {
-    GdkPixbufApngFrame* frame = l->data;
-    g_clear_object(&frame->pixbuf);
-    g_clear_object(&frame->composited);
-    g_clear_object(&frame->revert);
-    g_free(frame);
-  }
-  g_list_free(anim->frames);
+  g_clear_object(&anim->static_image);
+  g_clear_pointer(&anim->pending, gdk_pixbuf_apng_frame_unref);
+  gdk_pixbuf_apng_compositor_clear(&anim->merge);
+  g_ptr_array_free(anim->frames, TRUE);
+  gdk_pixbuf_apng_pool_unref(anim->pool);
+  g_mutex_clear(&anim->lock);
 
   G_OBJECT_CLASS(gdk_pixbuf_apng_anim_parent_class)->finalize(object);
 }
 
+void gdk_pixbuf_apng_anim_set_premultiplied(GdkPixbufApngAnim* anim,
+                                            gboolean           premultiplied) {
+  /* Iterators composite again from their next keyframe on the next
+   * access.
+   */
+  g_atomic_int_set(&anim->premultiplied, !!premultiplied);
+}
+
+gboolean gdk_pixbuf_apng_anim_get_premultiplied(GdkPixbufApngAnim* anim) {
+  return g_atomic_int_get(&anim->premultiplied);
+}
+
 static gboolean
 gdk_pixbuf_apng_anim_is_static_image(GdkPixbufAnimation* animation) {
   // printf("%s:%d (%s)\n", __FILE__, __LINE__, __func__);
   GdkPixbufApngAnim* anim;
+  gboolean           is_static;
 
   anim = GDK_PIXBUF_APNG_ANIM(animation);
 
-  return anim->actl.num_frames == 1;
+  /* Zero delay frames merged, a single frame may be left. */
+  g_mutex_lock(&anim->lock);
+  is_static = anim->actl.num_frames == 1 ||
+              (anim->n_decoded >= anim->actl.num_frames && anim->n_frames == 1);
+  g_mutex_unlock(&anim->lock);
+
+  return is_static;
 }
 
 static GdkPixbuf*
 gdk_pixbuf_apng_anim_get_static_image(GdkPixbufAnimation* animation) {
   // printf("%s:%d (%s)\n", __FILE__, __LINE__, __func__);
-  GdkPixbufApngAnim* anim;
+  GdkPixbufApngAnim*      anim;
+  GdkPixbufApngFrame*     frame;
+  GdkPixbufApngCompositor compositor = {NULL};
+  GdkPixbuf*              image;
 
   anim = GDK_PIXBUF_APNG_ANIM(animation);
-  if (anim->frames == NULL)
+
+  image = g_atomic_pointer_get(&anim->static_image);
+  if (image != NULL)
+    return image;
+
+  frame = gdk_pixbuf_apng_anim_get_frame(anim, 0);
+  if (frame == NULL)
     return NULL;
 
-  return GDK_PIXBUF(((GdkPixbufApngFrame*)anim->frames->data)->pixbuf);
+  /* The static image is a plain pixbuf, whatever the canvas format. */
+  image = gdk_pixbuf_apng_compositor_seek(&compositor, anim, frame);
+  if (image != NULL)
+    g_object_ref(image);
+  gdk_pixbuf_apng_compositor_clear(&compositor);
+  if (image == NULL)
+    return NULL;
+
+  /* Another thread may have been faster, keep the first one published. */
+  if (!g_atomic_pointer_compare_and_exchange(&anim->static_image, NULL,
+                                             image)) {
+    g_object_unref(image);
+    image = g_atomic_pointer_get(&anim->static_image);
+  }
+
+  return image;
 }
 
 static void gdk_pixbuf_apng_anim_get_size(GdkPixbufAnimation* animation,
@@ -91,7 +233,7 @@ gdk_pixbuf_apng_anim_get_iter(GdkPixbufAnimation* animation,
   iter->anim = GDK_PIXBUF_APNG_ANIM(animation);
   g_object_ref(iter->anim);
 
-  iter->current_frame = iter->anim->frames;
+  iter->current_frame = 0;
   iter->start_time    = *start_time;
   iter->current_time  = *start_time;
 
@@ -113,6 +255,7 @@ G_DEFINE_TYPE(GdkPixbufApngAnimIter, gdk_pixbuf_apng_anim_iter,
 
 static void gdk_pixbuf_apng_anim_iter_init(GdkPixbufApngAnimIter* anim_iter) {
   // printf("%s:%d (%s)\n", __FILE__, __LINE__, __func__);
+  anim_iter->damage_frame = G_MAXUINT;
 }
 
 static void
@@ -136,7 +279,8 @@ static void gdk_pixbuf_apng_anim_iter_finalize(GObject* object) {
   // printf("%s:%d (%s)\n", __FILE__, __LINE__, __func__);
   GdkPixbufApngAnimIter* iter = GDK_PIXBUF_APNG_ANIM_ITER(object);
 
-  iter->current_frame = NULL;
+  gdk_pixbuf_apng_compositor_clear(&iter->compositor);
+  g_clear_object(&iter->pixbuf);
   g_object_unref(iter->anim);
 
   G_OBJECT_CLASS(gdk_pixbuf_apng_anim_iter_parent_class)->finalize(object);
@@ -148,17 +292,34 @@ gdk_pixbuf_apng_anim_iter_get_delay_time(GdkPixbufAnimationIter* anim_iter) {
 
   GdkPixbufApngAnimIter* iter;
   GdkPixbufApngFrame*    frame;
-  gint64                 delay_us;
 
   iter = GDK_PIXBUF_APNG_ANIM_ITER(anim_iter);
 
-  frame = iter->current_frame->data;
-  if (frame->fctl.delay_den == 0)
-    delay_us = frame->fctl.delay_num * 1000000 / 100;
-  else
-    delay_us = frame->fctl.delay_num * 1000000 / frame->fctl.delay_den;
+  frame = apng_iter_frame(iter);
+  if (frame == NULL)
+    return -1;
 
-  return delay_us / 1000;
+  return gdk_pixbuf_apng_frame_get_delay_us(frame) / 1000;
+}
+
+static GdkPixbuf* apng_iter_canvas(GdkPixbufApngAnimIter* iter,
+                                   GdkPixbufApngFrame*    frame) {
+  GdkPixbufApngCompositor* compositor = &iter->compositor;
+  gboolean                 premultiplied;
+
+  /* Read once, the canvas returned is in the mode the compositor is in. */
+  premultiplied = gdk_pixbuf_apng_anim_get_premultiplied(iter->anim);
+  if (compositor->premultiplied != premultiplied) {
+    gdk_pixbuf_apng_compositor_clear(compositor);
+    compositor->premultiplied = premultiplied;
+  }
+
+  if (compositor->frame != frame || compositor->canvas == NULL) {
+    iter->pixbuf_frame = NULL;
+    return gdk_pixbuf_apng_compositor_seek(compositor, iter->anim, frame);
+  }
+
+  return compositor->canvas;
 }
 
 static GdkPixbuf*
@@ -167,17 +328,67 @@ gdk_pixbuf_apng_anim_iter_get_pixbuf(GdkPixbufAnimationIter* anim_iter) {
 
   GdkPixbufApngAnimIter* iter;
   GdkPixbufApngFrame*    frame;
+  GdkPixbuf*             canvas;
 
   iter = GDK_PIXBUF_APNG_ANIM_ITER(anim_iter);
 
-  frame = iter->current_frame ? iter->current_frame->data
-                              : g_list_last(iter->anim->frames)->data;
+  frame = apng_iter_frame(iter);
   if (frame == NULL)
     return NULL;
 
-  gdk_pixbuf_apng_anim_frame_composite(iter->anim, frame);
+  canvas = apng_iter_canvas(iter, frame);
+  if (canvas == NULL)
+    return NULL;
+  if (!iter->compositor.premultiplied) {
+    iter->compositor.shared = TRUE;
+    return canvas;
+  }
 
-  return frame->composited;
+  /* Callers that opted into premultiplied canvases but still ask for a
+   * pixbuf get a converted copy. The caller may have kept the previous one,
+   * each frame gets its own.
+   */
+  if (iter->pixbuf_frame != frame) {
+    gint width  = gdk_pixbuf_get_width(canvas);
+    gint height = gdk_pixbuf_get_height(canvas);
+
+    g_clear_object(&iter->pixbuf);
+    iter->pixbuf_frame = NULL;
+    iter->pixbuf = gdk_pixbuf_apng_pool_new_pixbuf(iter->anim->pool, TRUE,
+                                                   width, height);
+    if (iter->pixbuf == NULL)
+      return NULL;
+
+    gdk_pixbuf_apng_unpremultiply(canvas, iter->pixbuf);
+    iter->pixbuf_frame = frame;
+  }
+
+  return iter->pixbuf;
+}
+
+const guchar* gdk_pixbuf_apng_anim_iter_get_argb32(GdkPixbufApngAnimIter* iter,
+                                                   gint* width, gint* height,
+                                                   gint* stride) {
+  GdkPixbufApngFrame* frame;
+
+  GdkPixbuf*          canvas;
+
+  frame = apng_iter_frame(iter);
+  if (frame == NULL)
+    return NULL;
+
+  canvas = apng_iter_canvas(iter, frame);
+  if (canvas == NULL || !iter->compositor.premultiplied)
+    return NULL;
+
+  if (width)
+    *width = gdk_pixbuf_get_width(canvas);
+  if (height)
+    *height = gdk_pixbuf_get_height(canvas);
+  if (stride)
+    *stride = gdk_pixbuf_get_rowstride(canvas);
+
+  return gdk_pixbuf_get_pixels(canvas);
 }
 
 static gboolean gdk_pixbuf_apng_anim_iter_on_currently_loading_frame(
@@ -187,7 +398,7 @@ static gboolean gdk_pixbuf_apng_anim_iter_on_currently_loading_frame(
 
   iter = GDK_PIXBUF_APNG_ANIM_ITER(anim_iter);
 
-  return iter->current_frame == NULL || iter->current_frame->next == NULL;
+  return iter->current_frame + 1 >= apng_anim_get_n_loaded(iter->anim);
 }
 
 static gboolean
@@ -212,168 +423,692 @@ gdk_pixbuf_apng_anim_iter_advance(GdkPixbufAnimationIter* anim_iter,
     elapsed_us       = 0;
   }
 
-  frame = iter->current_frame->data;
-  if (frame->fctl.delay_den == 0)
-    delay_us = frame->fctl.delay_num * 1000000 / 100;
-  else
-    delay_us = frame->fctl.delay_num * 1000000 / frame->fctl.delay_den;
+  frame = apng_iter_frame(iter);
+  if (frame == NULL)
+    return FALSE;
+  delay_us = gdk_pixbuf_apng_frame_get_delay_us(frame);
 
   // printf("%ld %ld\n", delay_us, elapsed_us);
 
   if (elapsed_us >= delay_us) {
     iter->start_time    = iter->current_time;
-    iter->current_frame = iter->current_frame->next;
-    if (iter->current_frame == NULL)
-      iter->current_frame = iter->anim->frames;
+    iter->current_frame = frame->index + 1;
+    if (iter->current_frame >= apng_anim_get_n_loaded(iter->anim))
+      iter->current_frame = 0;
   }
 
   return TRUE;
 }
 
-void gdk_pixbuf_apng_anim_frame_composite(GdkPixbufApngAnim*  anim,
-                                          GdkPixbufApngFrame* frame) {
-  // printf("%s:%d (%s)\n", __FILE__, __LINE__, __func__);
-  GList* link;
-  GList* tmp;
+gboolean gdk_pixbuf_apng_anim_iter_seek_frame(GdkPixbufApngAnimIter* iter,
+                                              guint                  index) {
+  if (index >= apng_anim_get_n_loaded(iter->anim))
+    return FALSE;
+
+  iter->current_frame = index;
+  iter->start_time    = iter->current_time;
 
-  link = g_list_find(anim->frames, frame);
+  return TRUE;
+}
+
+gboolean gdk_pixbuf_apng_anim_iter_seek_time(GdkPixbufApngAnimIter* iter,
+                                             gint64                 time) {
+  GdkPixbufApngAnim*  anim   = iter->anim;
+  GPtrArray*          frames = anim->frames;
+  GdkPixbufApngFrame* frame;
+  gint64              time_us = time * 1000;
+  guint               lo      = 0;
+  guint               hi;
+
+  if (time < 0)
+    return FALSE;
+
+  /* Frames and duration as loaded so far. */
+  g_mutex_lock(&anim->lock);
+  hi = frames->len;
+  if (hi == 0) {
+    g_mutex_unlock(&anim->lock);
+    return FALSE;
+  }
+
+  /* Past the last play the animation stays on its last frame. */
+  if (anim->duration_us == 0 ||
+      (anim->actl.num_plays > 0 &&
+       time_us >= anim->duration_us * anim->actl.num_plays))
+    time_us = anim->duration_us;
+  else
+    time_us %= anim->duration_us;
+
+  /* Last frame starting at or before time_us, zero delay frames are
+   * skipped over.
+   */
+  while (hi - lo > 1) {
+    guint mid = lo + (hi - lo) / 2;
+
+    frame = g_ptr_array_index(frames, mid);
+    if (frame->start_us <= time_us)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  frame = g_ptr_array_index(frames, lo);
+  g_mutex_unlock(&anim->lock);
+
+  iter->current_frame = lo;
+  iter->start_time    = iter->current_time;
+  g_time_val_add(&iter->start_time,
+                 -MIN(time_us - frame->start_us,
+                      gdk_pixbuf_apng_frame_get_delay_us(frame)));
+
+  return TRUE;
+}
+
+gboolean gdk_pixbuf_apng_anim_get_frame_info(GdkPixbufApngAnim*      anim,
+                                             guint                   index,
+                                             GdkPixbufApngFrameInfo* info) {
+  GdkPixbufApngFrame* frame;
+
+  frame = gdk_pixbuf_apng_anim_get_frame(anim, index);
+  if (frame == NULL)
+    return FALSE;
+
+  info->area.x      = frame->fctl.x_offset;
+  info->area.y      = frame->fctl.y_offset;
+  info->area.width  = frame->fctl.width;
+  info->area.height = frame->fctl.height;
+  info->dispose_op  = frame->fctl.dispose_op;
+  info->blend_op    = frame->fctl.blend_op;
+  info->start       = frame->start_us / 1000;
+  info->delay       = gdk_pixbuf_apng_frame_get_delay_us(frame) / 1000;
+  info->keyframe    = frame->keyframe;
+  info->fctl_offset = frame->fctl_offset;
+  info->data_offset = frame->data_offset;
+
+  return TRUE;
+}
+
+gboolean gdk_pixbuf_apng_anim_iter_get_damage(GdkPixbufApngAnimIter* iter,
+                                              GdkPixbufApngRect*     damage) {
+  GdkPixbufApngFrame* frame;
+
+  frame = apng_iter_frame(iter);
+  if (frame == NULL)
+    return FALSE;
+
+  /* The damage of a frame is relative to the canvas of the one before, it
+   * only applies when that is the canvas reported last.
+   */
+  if (frame->index == iter->damage_frame)
+    *damage = iter->damage;
+  else if (frame->index > 0 && frame->index - 1 == iter->damage_frame)
+    *damage = frame->damage;
+  else {
+    g_mutex_lock(&iter->anim->lock);
+    *damage = iter->anim->bounds;
+    g_mutex_unlock(&iter->anim->lock);
+  }
+
+  iter->damage_frame = frame->index;
+  iter->damage       = *damage;
+
+  return TRUE;
+}
 
-  if (frame->composited == NULL) {
-    /* For now, to composite we start with the last
-     * composited frame and composite everything up to
-     * here.
+static void apng_rect_union(GdkPixbufApngRect*       dest,
+                            const GdkPixbufApngRect* src) {
+  gint x1, y1, x2, y2;
+
+  if (src->width <= 0 || src->height <= 0)
+    return;
+  if (dest->width <= 0 || dest->height <= 0) {
+    *dest = *src;
+    return;
+  }
+
+  x1 = MIN(dest->x, src->x);
+  y1 = MIN(dest->y, src->y);
+  x2 = MAX(dest->x + dest->width, src->x + src->width);
+  y2 = MAX(dest->y + dest->height, src->y + src->height);
+
+  dest->x      = x1;
+  dest->y      = y1;
+  dest->width  = x2 - x1;
+  dest->height = y2 - y1;
+}
+
+static gboolean apng_frame_covers(GdkPixbufApngAnim*        anim,
+                                  const GdkPixbufApngFrame* frame) {
+  return frame->fctl.x_offset == 0 && frame->fctl.y_offset == 0 &&
+         frame->fctl.width == anim->ihdr.width &&
+         frame->fctl.height == anim->ihdr.height;
+}
+
+/* Fills in the frame position, damage and keyframe flag, prev is the frame
+ * right before it or NULL. The animation lock is held.
+ */
+static void apng_anim_link_frame(GdkPixbufApngAnim*        anim,
+                                 const GdkPixbufApngFrame* prev,
+                                 GdkPixbufApngFrame*       frame) {
+  GdkPixbufApngRect area = {frame->fctl.x_offset, frame->fctl.y_offset,
+                            frame->fctl.width, frame->fctl.height};
+
+  frame->damage   = area;
+  frame->keyframe = prev == NULL;
+  if (prev != NULL) {
+    if (prev->fctl.dispose_op != APNG_DISPOSE_OP_NONE) {
+      GdkPixbufApngRect disposed = {prev->fctl.x_offset, prev->fctl.y_offset,
+                                    prev->fctl.width, prev->fctl.height};
+      apng_rect_union(&frame->damage, &disposed);
+    }
+
+    /* Restarting from a frame that has to save the canvas for its own
+     * disposal would need that canvas, those never are keyframes.
      */
+    if (frame->fctl.dispose_op != APNG_DISPOSE_OP_PREVIOUS) {
+      if (prev->fctl.dispose_op == APNG_DISPOSE_OP_BACKGROUND &&
+          apng_frame_covers(anim, prev))
+        frame->keyframe = TRUE;
+      if (apng_frame_covers(anim, frame) &&
+          (frame->fctl.blend_op == APNG_BLEND_OP_SOURCE || frame->opaque))
+        frame->keyframe = TRUE;
+    }
+  }
+  apng_rect_union(&anim->bounds, &area);
+
+  frame->index    = anim->n_frames;
+  frame->start_us = anim->duration_us;
+  anim->duration_us += gdk_pixbuf_apng_frame_get_delay_us(frame);
+}
+
+/* Publishes frame along with the count of frames decoded, so that readers
+ * never see every frame decoded with the last one missing.
+ */
+static void apng_anim_append_frame(GdkPixbufApngAnim*  anim,
+                                   GdkPixbufApngFrame* frame,
+                                   gsize               n_decoded) {
+  GdkPixbufApngFrame* prev = NULL;
+
+  g_mutex_lock(&anim->lock);
+  if (anim->frames->len > 0)
+    prev = g_ptr_array_index(anim->frames, anim->frames->len - 1);
+  apng_anim_link_frame(anim, prev, frame);
+  anim->n_frames++;
+  anim->n_decoded = n_decoded;
+  g_ptr_array_add(anim->frames, frame);
+  g_mutex_unlock(&anim->lock);
+}
+
+static gboolean apng_rect_contains(const GdkPixbufApngRect* rect,
+                                   const GdkPixbufApngRect* inner) {
+  return inner->x >= rect->x && inner->y >= rect->y &&
+         inner->x + inner->width <= rect->x + rect->width &&
+         inner->y + inner->height <= rect->y + rect->height;
+}
+
+/* Whether the zero delay frame z can be merged into the frame f following
+ * it. The canvas left once f is disposed of has to stay the same.
+ */
+static gboolean apng_frames_mergeable(GdkPixbufApngAnim*        anim,
+                                      const GdkPixbufApngFrame* z,
+                                      const GdkPixbufApngFrame* f) {
+  GdkPixbufApngRect z_area = {z->fctl.x_offset, z->fctl.y_offset,
+                              z->fctl.width, z->fctl.height};
+  GdkPixbufApngRect f_area = {f->fctl.x_offset, f->fctl.y_offset,
+                              f->fctl.width, f->fctl.height};
+
+  if (apng_anim_get_n_loaded(anim) == 0 &&
+      z->fctl.dispose_op == APNG_DISPOSE_OP_PREVIOUS)
+    return FALSE;
+
+  switch (f->fctl.dispose_op) {
+  case APNG_DISPOSE_OP_NONE:
+    return TRUE;
+  case APNG_DISPOSE_OP_BACKGROUND:
+    /* Both areas get cleared, their union has to be a rectangle. */
+    return apng_rect_contains(&f_area, &z_area) ||
+           (z->fctl.dispose_op == APNG_DISPOSE_OP_BACKGROUND &&
+            apng_rect_contains(&z_area, &f_area));
+  case APNG_DISPOSE_OP_PREVIOUS:
+    return z->fctl.dispose_op == APNG_DISPOSE_OP_PREVIOUS;
+  default:
+    return FALSE;
+  }
+}
+
+static void     apng_copy_area(GdkPixbuf* src, gint src_x, gint src_y,
+                               gint width, gint height, GdkPixbuf* dest,
+                               gint dest_x, gint dest_y);
+static gboolean apng_compositor_step(GdkPixbufApngCompositor* comp,
+                                     GdkPixbufApngAnim*       anim,
+                                     GdkPixbufApngFrame*      f);
+
+/* Composites z then f onto the canvas of the last frame, and returns a
+ * single frame replacing both: the area they change, blended with SOURCE,
+ * with the delay and disposal of f. Returns NULL when out of memory.
+ */
+static GdkPixbufApngFrame* apng_frames_merge(GdkPixbufApngAnim*  anim,
+                                             GdkPixbufApngFrame* z,
+                                             GdkPixbufApngFrame* f) {
+  GdkPixbufApngCompositor* comp   = &anim->merge;
+  GdkPixbufApngFrame*      last   = NULL;
+  GdkPixbufApngFrame*      merged = NULL;
+  GdkPixbufApngRect        area   = {z->fctl.x_offset, z->fctl.y_offset,
+                                     z->fctl.width, z->fctl.height};
+  GdkPixbufApngRect        f_area = {f->fctl.x_offset, f->fctl.y_offset,
+                                     f->fctl.width, f->fctl.height};
+
+  apng_rect_union(&area, &f_area);
+
+  /* A run of zero delay frames keeps compositing onto the same canvas. */
+  if (comp->frame != z || comp->canvas == NULL) {
+    guint n_loaded = apng_anim_get_n_loaded(anim);
+
+    if (n_loaded > 0) {
+      last = gdk_pixbuf_apng_anim_get_frame(anim, n_loaded - 1);
+      if (gdk_pixbuf_apng_compositor_seek(comp, anim, last) == NULL)
+        goto error;
+    } else {
+      gdk_pixbuf_apng_compositor_clear(comp);
+    }
+
+    z->index    = anim->n_frames;
+    z->keyframe = last == NULL;
+    if (!apng_compositor_step(comp, anim, z))
+      goto error;
+    g_clear_pointer(&comp->frame, gdk_pixbuf_apng_frame_unref);
+    comp->frame = gdk_pixbuf_apng_frame_ref(z);
+  }
+
+  f->index = z->index + 1;
+  if (!apng_compositor_step(comp, anim, f))
+    goto error;
+
+  merged = gdk_pixbuf_apng_frame_new();
+  if (merged == NULL)
+    goto error;
+
+  /* Decoding again from the offsets of z gives the same canvas. */
+  merged->fctl          = f->fctl;
+  merged->fctl.x_offset = area.x;
+  merged->fctl.y_offset = area.y;
+  merged->fctl.width    = area.width;
+  merged->fctl.height   = area.height;
+  merged->fctl.blend_op = APNG_BLEND_OP_SOURCE;
+  merged->index         = z->index;
+  merged->fctl_offset   = z->fctl_offset;
+  merged->data_offset   = z->data_offset;
+  merged->opaque        = !gdk_pixbuf_get_has_alpha(comp->canvas);
+  merged->pixbuf        = gdk_pixbuf_apng_pool_new_pixbuf(
+      anim->pool, !merged->opaque, area.width, area.height);
+  if (merged->pixbuf == NULL)
+    goto error;
+
+  apng_copy_area(comp->canvas, area.x, area.y, area.width, area.height,
+                 merged->pixbuf, 0, 0);
+
+  /* The canvas is now the one of the merged frame, at the index of z,
+   * unless its disposal needs the larger area saved before z.
+   */
+  g_clear_pointer(&comp->frame, gdk_pixbuf_apng_frame_unref);
+  if (merged->fctl.dispose_op == APNG_DISPOSE_OP_PREVIOUS)
+    gdk_pixbuf_apng_compositor_clear(comp);
+  else
+    comp->frame = gdk_pixbuf_apng_frame_ref(merged);
+
+  return merged;
+
+error:
+  g_clear_pointer(&merged, gdk_pixbuf_apng_frame_unref);
+  gdk_pixbuf_apng_compositor_clear(comp);
+
+  return NULL;
+}
+
+void gdk_pixbuf_apng_anim_add_frame(GdkPixbufApngAnim*  anim,
+                                    GdkPixbufApngFrame* frame) {
+  gsize n_decoded = anim->n_decoded + 1;
+
+  if (anim->pending != NULL) {
+    GdkPixbufApngFrame* pending = anim->pending;
+    GdkPixbufApngFrame* merged  = NULL;
+
+    anim->pending = NULL;
+    if (apng_frames_mergeable(anim, pending, frame))
+      merged = apng_frames_merge(anim, pending, frame);
+
+    if (merged != NULL) {
+      gdk_pixbuf_apng_frame_unref(pending);
+      gdk_pixbuf_apng_frame_unref(frame);
+      frame = merged;
+    } else {
+      apng_anim_append_frame(anim, pending, anim->n_decoded);
+    }
+  }
+
+  /* Held back until the next frame, the last one is kept whatever its
+   * delay.
+   */
+  if (gdk_pixbuf_apng_frame_get_delay_us(frame) == 0 &&
+      n_decoded < anim->actl.num_frames) {
+    anim->pending = frame;
+    g_mutex_lock(&anim->lock);
+    anim->n_decoded = n_decoded;
+    g_mutex_unlock(&anim->lock);
+    return;
+  }
+
+  apng_anim_append_frame(anim, frame, n_decoded);
+
+  if (n_decoded >= anim->actl.num_frames)
+    gdk_pixbuf_apng_compositor_clear(&anim->merge);
+}
+
+GdkPixbufApngFrame* gdk_pixbuf_apng_frame_new(void) {
+  GdkPixbufApngFrame* frame;
+
+  frame = g_try_new0(GdkPixbufApngFrame, 1);
+  if (frame != NULL)
+    frame->ref_count = 1;
+
+  return frame;
+}
+
+GdkPixbufApngFrame* gdk_pixbuf_apng_frame_ref(GdkPixbufApngFrame* frame) {
+  g_atomic_int_inc(&frame->ref_count);
+  return frame;
+}
+
+void gdk_pixbuf_apng_frame_unref(GdkPixbufApngFrame* frame) {
+  if (!g_atomic_int_dec_and_test(&frame->ref_count))
+    return;
 
-    /* Rewind to last composited frame. */
-    tmp = link;
-    while (tmp != NULL) {
-      GdkPixbufApngFrame* f = tmp->data;
-      if (f->composited != NULL)
-        break;
-      tmp = tmp->prev;
+  g_clear_object(&frame->pixbuf);
+  g_free(frame);
+}
+
+static void apng_clear_area(GdkPixbuf* pixbuf, gint x, gint y, gint width,
+                            gint height) {
+  gint    rowstride  = gdk_pixbuf_get_rowstride(pixbuf);
+  gint    n_channels = gdk_pixbuf_get_n_channels(pixbuf);
+  guchar* pixels     = gdk_pixbuf_get_pixels(pixbuf);
+
+  pixels += y * rowstride + x * n_channels;
+  for (gint j = 0; j < height; ++j)
+    memset(pixels + j * rowstride, 0, width * n_channels);
+}
+
+static void apng_copy_area(GdkPixbuf* src, gint src_x, gint src_y,
+                           gint width, gint height, GdkPixbuf* dest,
+                           gint dest_x, gint dest_y) {
+  gint          src_rowstride   = gdk_pixbuf_get_rowstride(src);
+  gint          dest_rowstride  = gdk_pixbuf_get_rowstride(dest);
+  gint          src_n_channels  = gdk_pixbuf_get_n_channels(src);
+  gint          dest_n_channels = gdk_pixbuf_get_n_channels(dest);
+  const guchar* src_pixels      = gdk_pixbuf_get_pixels(src);
+  guchar*       dest_pixels     = gdk_pixbuf_get_pixels(dest);
+
+  /* An opaque source may be copied into a canvas with alpha, never the
+   * other way around.
+   */
+  g_assert(src_n_channels <= dest_n_channels);
+
+  src_pixels += src_y * src_rowstride + src_x * src_n_channels;
+  dest_pixels += dest_y * dest_rowstride + dest_x * dest_n_channels;
+  for (gint j = 0; j < height; ++j) {
+    const guchar* s = src_pixels + j * src_rowstride;
+    guchar*       d = dest_pixels + j * dest_rowstride;
+
+    if (src_n_channels == dest_n_channels) {
+      memcpy(d, s, width * dest_n_channels);
+      continue;
     }
 
-    /* Go forward, compositing all frames up to the current frame */
-    if (tmp == NULL)
-      tmp = anim->frames;
-
-    while (tmp != NULL) {
-      GdkPixbufApngFrame* f = tmp->data;
-
-      if (f->pixbuf == NULL)
-        return;
-      g_assert(f->fctl.x_offset >= 0);
-      g_assert(f->fctl.y_offset >= 0);
-      g_assert(f->fctl.width > 0);
-      g_assert(f->fctl.height > 0);
-      g_assert(f->fctl.x_offset + f->fctl.width <= anim->ihdr.width);
-      g_assert(f->fctl.y_offset + f->fctl.height <= anim->ihdr.height);
-
-      if (f->composited != NULL)
-        goto next;
-
-      if (tmp->prev == NULL) {
-        /* First frame may be smaller than the whole image;
-         * if so, we make the area outside it full alpha if the
-         * image has alpha, and background color otherwise.
-         * GIF spec doesn't actually say what to do about this.
-         */
-        f->composited = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8,
-                                       anim->ihdr.width, anim->ihdr.height);
-        if (f->composited == NULL)
-          return;
-
-        /* alpha gets dumped if f->composited has no alpha */
-        gdk_pixbuf_fill(f->composited, 0);
-
-        if (f->fctl.dispose_op == APNG_DISPOSE_OP_PREVIOUS)
-          g_warning("First frame of APNG has bad dispose mode, APNG loader "
-                    "should not have loaded this image");
-      } else {
-        GdkPixbufApngFrame* prev = tmp->prev->data;
-        /* Init f->composited with what we should have after the previous
-         * frame
-         */
-
-        f->composited    = prev->composited;
-        prev->composited = NULL;
-        if (f->composited == NULL)
-          return;
-
-        switch (prev->fctl.dispose_op) {
-        case APNG_DISPOSE_OP_NONE:
-          break;
-        case APNG_DISPOSE_OP_BACKGROUND: {
-
-          /* Clear area of previous frame to background */
-          GdkPixbuf* area;
-          area = gdk_pixbuf_new_subpixbuf(f->composited, prev->fctl.x_offset,
-                                          prev->fctl.y_offset, prev->fctl.width,
-                                          prev->fctl.height);
-          if (area == NULL)
-            return;
-
-          gdk_pixbuf_fill(area, 0);
-          g_object_unref(area);
-          break;
-        }
-        case APNG_DISPOSE_OP_PREVIOUS:
-          if (prev->revert != NULL) {
-            /* Copy in the revert frame */
-            gdk_pixbuf_copy_area(
-                prev->revert, 0, 0, gdk_pixbuf_get_width(prev->revert),
-                gdk_pixbuf_get_height(prev->revert), f->composited,
-                prev->fctl.x_offset, prev->fctl.y_offset);
-          }
-          break;
-        default:
-          g_assert(FALSE);
-          break;
-        }
-
-        if (f->revert == NULL &&
-            f->fctl.dispose_op == APNG_DISPOSE_OP_PREVIOUS) {
-          /* We need to save the contents before compositing */
-          GdkPixbuf* area;
-          area = gdk_pixbuf_new_subpixbuf(f->composited, f->fctl.x_offset,
-                                          f->fctl.y_offset, f->fctl.width,
-                                          f->fctl.height);
-          if (area == NULL)
-            return;
-
-          f->revert = gdk_pixbuf_copy(area);
-          g_object_unref(area);
-          if (f->revert == NULL)
-            return;
-        }
-      }
-
-      g_assert(f->pixbuf != NULL);
-      g_assert(f->composited != NULL);
-
-      switch (f->fctl.blend_op) {
-      case APNG_BLEND_OP_SOURCE:
-        gdk_pixbuf_scale(f->pixbuf, f->composited, f->fctl.x_offset,
-                         f->fctl.y_offset, f->fctl.width, f->fctl.height,
-                         f->fctl.x_offset, f->fctl.y_offset, 1.0, 1.0,
-                         GDK_INTERP_BILINEAR);
-        break;
-      case APNG_BLEND_OP_OVER:
-        gdk_pixbuf_composite(f->pixbuf, f->composited, f->fctl.x_offset,
-                             f->fctl.y_offset, f->fctl.width, f->fctl.height,
-                             f->fctl.x_offset, f->fctl.y_offset, 1.0, 1.0,
-                             GDK_INTERP_BILINEAR, 255);
-        break;
-      default:
-        g_assert(FALSE);
-        break;
-      }
-
-    next:
-      if (tmp == link)
-        break;
-
-      tmp = tmp->next;
+    for (gint i = 0; i < width; ++i, s += 3, d += 4) {
+      d[0] = s[0];
+      d[1] = s[1];
+      d[2] = s[2];
+      d[3] = 0xff;
     }
   }
-}
\ No newline at end of file
+}
+
+/* Opaque canvases are stored without alpha, until some frame makes part of
+ * the canvas transparent.
+ */
+static void apng_canvas_add_alpha(GdkPixbufApngAnim*       anim,
+                                  GdkPixbufApngCompositor* comp) {
+  GdkPixbuf* canvas = comp->canvas;
+
+  if (gdk_pixbuf_get_has_alpha(canvas))
+    return;
+
+  comp->canvas = gdk_pixbuf_apng_pool_new_pixbuf(
+      anim->pool, TRUE, gdk_pixbuf_get_width(canvas),
+      gdk_pixbuf_get_height(canvas));
+  comp->shared = FALSE;
+  if (comp->canvas != NULL)
+    apng_copy_area(canvas, 0, 0, gdk_pixbuf_get_width(canvas),
+                   gdk_pixbuf_get_height(canvas), comp->canvas, 0, 0);
+
+  g_object_unref(canvas);
+}
+
+/* A canvas handed out to a caller may still be referenced after the
+ * iterator moved on, it is copied instead of being modified behind its
+ * back.
+ */
+static gboolean apng_compositor_own_canvas(GdkPixbufApngAnim*       anim,
+                                           GdkPixbufApngCompositor* comp) {
+  GdkPixbuf* canvas = comp->canvas;
+
+  if (!comp->shared)
+    return TRUE;
+
+  comp->shared = FALSE;
+
+  comp->canvas = gdk_pixbuf_apng_pool_new_pixbuf(
+      anim->pool, gdk_pixbuf_get_has_alpha(canvas),
+      gdk_pixbuf_get_width(canvas), gdk_pixbuf_get_height(canvas));
+  if (comp->canvas != NULL)
+    apng_copy_area(canvas, 0, 0, gdk_pixbuf_get_width(canvas),
+                   gdk_pixbuf_get_height(canvas), comp->canvas, 0, 0);
+  g_object_unref(canvas);
+
+  return comp->canvas != NULL;
+}
+
+/* Saves the area of f before it gets blended, for its own disposal. The
+ * revert buffer is reused from one frame to the next when possible.
+ */
+static gboolean apng_compositor_save(GdkPixbufApngAnim*        anim,
+                                     GdkPixbufApngCompositor*  comp,
+                                     const GdkPixbufApngFrame* f) {
+  gboolean has_alpha = gdk_pixbuf_get_has_alpha(comp->canvas);
+
+  if (comp->revert == NULL ||
+      gdk_pixbuf_get_width(comp->revert) != (gint)f->fctl.width ||
+      gdk_pixbuf_get_height(comp->revert) != (gint)f->fctl.height ||
+      gdk_pixbuf_get_has_alpha(comp->revert) != has_alpha) {
+    g_clear_object(&comp->revert);
+    comp->revert = gdk_pixbuf_apng_pool_new_pixbuf(
+        anim->pool, has_alpha, f->fctl.width, f->fctl.height);
+    if (comp->revert == NULL)
+      return FALSE;
+  }
+
+  apng_copy_area(comp->canvas, f->fctl.x_offset, f->fctl.y_offset,
+                 f->fctl.width, f->fctl.height, comp->revert, 0, 0);
+
+  return TRUE;
+}
+
+/* Composites f onto the canvas of the frame right before it, or onto a
+ * cleared canvas if f is a keyframe and the canvas is elsewhere.
+ */
+static gboolean apng_compositor_step(GdkPixbufApngCompositor* comp,
+                                     GdkPixbufApngAnim*       anim,
+                                     GdkPixbufApngFrame*      f) {
+  GdkPixbufApngFrame* prev = comp->frame;
+
+  g_assert(f->pixbuf != NULL);
+  g_assert(f->fctl.x_offset >= 0);
+  g_assert(f->fctl.y_offset >= 0);
+  g_assert(f->fctl.width > 0);
+  g_assert(f->fctl.height > 0);
+  g_assert(f->fctl.x_offset + f->fctl.width <= anim->ihdr.width);
+  g_assert(f->fctl.y_offset + f->fctl.height <= anim->ihdr.height);
+
+  if (prev == NULL || comp->canvas == NULL || prev->index + 1 != f->index) {
+    /* First frame may be smaller than the whole image;
+     * if so, we make the area outside it full alpha if the
+     * image has alpha, and background color otherwise.
+     * GIF spec doesn't actually say what to do about this.
+     * Other keyframes start from the same cleared canvas.
+     */
+    gboolean covers = apng_frame_covers(anim, f);
+
+    g_assert(f->keyframe);
+
+    g_clear_object(&comp->canvas);
+    comp->shared = FALSE;
+    comp->canvas = gdk_pixbuf_apng_pool_new_pixbuf(
+        anim->pool, comp->premultiplied || !(f->opaque && covers),
+        anim->ihdr.width, anim->ihdr.height);
+    if (comp->canvas == NULL)
+      return FALSE;
+
+    if (gdk_pixbuf_get_has_alpha(comp->canvas))
+      gdk_pixbuf_fill(comp->canvas, 0);
+
+    if (f->index == 0 && f->fctl.dispose_op == APNG_DISPOSE_OP_PREVIOUS)
+      g_warning("First frame of APNG has bad dispose mode, APNG loader "
+                "should not have loaded this image");
+  } else {
+    if (!apng_compositor_own_canvas(anim, comp))
+      return FALSE;
+
+    switch (prev->fctl.dispose_op) {
+    case APNG_DISPOSE_OP_NONE:
+      break;
+    case APNG_DISPOSE_OP_BACKGROUND:
+      /* Clear area of previous frame to background */
+      apng_canvas_add_alpha(anim, comp);
+      if (comp->canvas == NULL)
+        return FALSE;
+
+      apng_clear_area(comp->canvas, prev->fctl.x_offset, prev->fctl.y_offset,
+                      prev->fctl.width, prev->fctl.height);
+      break;
+    case APNG_DISPOSE_OP_PREVIOUS:
+      g_assert(comp->revert != NULL);
+      apng_copy_area(comp->revert, 0, 0, prev->fctl.width, prev->fctl.height,
+                     comp->canvas, prev->fctl.x_offset, prev->fctl.y_offset);
+      break;
+    default:
+      g_assert(FALSE);
+      break;
+    }
+  }
+
+  if (f->fctl.dispose_op == APNG_DISPOSE_OP_PREVIOUS &&
+      !apng_compositor_save(anim, comp, f))
+    return FALSE;
+
+  if (comp->premultiplied) {
+    gdk_pixbuf_apng_blend_argb32(f->pixbuf, comp->canvas, f->fctl.x_offset,
+                                 f->fctl.y_offset,
+                                 f->fctl.blend_op == APNG_BLEND_OP_OVER);
+    return TRUE;
+  }
+
+  switch (f->fctl.blend_op) {
+  case APNG_BLEND_OP_SOURCE:
+    if (!f->opaque)
+      apng_canvas_add_alpha(anim, comp);
+    if (comp->canvas == NULL)
+      return FALSE;
+
+    apng_copy_area(f->pixbuf, 0, 0, f->fctl.width, f->fctl.height,
+                   comp->canvas, f->fctl.x_offset, f->fctl.y_offset);
+    break;
+  case APNG_BLEND_OP_OVER:
+    /* Blending an opaque frame over anything is a plain copy. */
+    if (f->opaque)
+      apng_copy_area(f->pixbuf, 0, 0, f->fctl.width, f->fctl.height,
+                     comp->canvas, f->fctl.x_offset, f->fctl.y_offset);
+    else
+      gdk_pixbuf_composite(f->pixbuf, comp->canvas, f->fctl.x_offset,
+                           f->fctl.y_offset, f->fctl.width, f->fctl.height,
+                           f->fctl.x_offset, f->fctl.y_offset, 1.0, 1.0,
+                           GDK_INTERP_BILINEAR, 255);
+    break;
+  default:
+    g_assert(FALSE);
+    break;
+  }
+
+  return TRUE;
+}
+
+void gdk_pixbuf_apng_compositor_clear(GdkPixbufApngCompositor* comp) {
+  g_clear_object(&comp->canvas);
+  comp->shared = FALSE;
+  g_clear_object(&comp->revert);
+  g_clear_pointer(&comp->frame, gdk_pixbuf_apng_frame_unref);
+}
+
+GdkPixbuf* gdk_pixbuf_apng_compositor_seek(GdkPixbufApngCompositor* comp,
+                                           GdkPixbufApngAnim*       anim,
+                                           GdkPixbufApngFrame*      frame) {
+  guint i;
+
+  if (comp->frame == frame && comp->canvas != NULL)
+    return comp->canvas;
+
+  /* Step forward from the current canvas when it comes before frame, with
+   * no keyframe in between, else restart from the last keyframe.
+   */
+  for (i = frame->index; i > 0; --i) {
+    GdkPixbufApngFrame* f = gdk_pixbuf_apng_anim_get_frame(anim, i);
+
+    if (f->keyframe)
+      break;
+    if (comp->frame != NULL && comp->canvas != NULL &&
+        comp->frame->index + 1 == i)
+      break;
+  }
+
+  for (; i <= frame->index; ++i) {
+    GdkPixbufApngFrame* f = gdk_pixbuf_apng_anim_get_frame(anim, i);
+
+    if (!apng_compositor_step(comp, anim, f)) {
+      gdk_pixbuf_apng_compositor_clear(comp);
+      return NULL;
+    }
+
+    g_clear_pointer(&comp->frame, gdk_pixbuf_apng_frame_unref);
+    comp->frame = gdk_pixbuf_apng_frame_ref(f);
+  }
+
+  return comp->canvas;
+}
+
+GdkPixbuf* gdk_pixbuf_apng_compositor_push(GdkPixbufApngCompositor* comp,
+                                           GdkPixbufApngAnim*       anim,
+                                           GdkPixbufApngFrame*      frame) {
+  g_mutex_lock(&anim->lock);
+  apng_anim_link_frame(anim, comp->frame, frame);
+  anim->n_frames++;
+  anim->n_decoded++;
+  g_mutex_unlock(&anim->lock);
+
+  if (!apng_compositor_step(comp, anim, frame)) {
+    gdk_pixbuf_apng_compositor_clear(comp);
+    return NULL;
+  }
+
+  g_clear_pointer(&comp->frame, gdk_pixbuf_apng_frame_unref);
+  comp->frame = gdk_pixbuf_apng_frame_ref(frame);
+
+  return comp->canvas;
+}
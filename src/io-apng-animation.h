@@ -1,6 +1,7 @@
 #ifndef IO_APNG_ANIMATION_H
 #define IO_APNG_ANIMATION_H
 
+#include "io-apng-pool.h"
 #include "io-apng.h"
 
 typedef enum {
@@ -14,6 +15,29 @@ typedef enum {
   APNG_BLEND_OP_OVER   = 1
 } GdkPixbufApngBlendOp;
 
+typedef struct {
+  gint x;
+  gint y;
+  gint width;
+  gint height;
+} GdkPixbufApngRect;
+
+/* Rolling canvas, moving from one frame to the next costs a single
+ * disposal and blend. Each user owns its compositor, only the decoded frames
+ * are shared.
+ */
+struct _GdkPixbufApngCompositor {
+  GdkPixbuf*          canvas;
+  GdkPixbuf*          revert;
+  GdkPixbufApngFrame* frame;
+  gboolean            premultiplied;
+
+  /* The canvas was handed out to a caller, it is copied before being
+   * modified.
+   */
+  gboolean shared;
+};
+
 #define GDK_TYPE_PIXBUF_APNG_ANIM (gdk_pixbuf_apng_anim_get_type())
 #define GDK_PIXBUF_APNG_ANIM(object)                                           \
   (G_TYPE_CHECK_INSTANCE_CAST((object), GDK_TYPE_PIXBUF_APNG_ANIM,             \
@@ -36,8 +60,43 @@ struct _GdkPixbufApngAnim {
   ApngChunk_IHDR ihdr;
   ApngChunk_acTL actl;
 
-  gsize  n_frames;
-  GList* frames;
+  gsize      n_frames;
+  GPtrArray* frames;
+
+  /* Frames decoded so far, zero delay frames merged into the next one
+   * included.
+   */
+  gsize n_decoded;
+
+  /* Length of one loop of the animation, in microseconds. */
+  gint64 duration_us;
+
+  /* Union of every frame area, what may differ between the canvas of the
+   * last frame and the canvas of the first one.
+   */
+  GdkPixbufApngRect bounds;
+
+  GdkPixbufApngPool* pool;
+
+  /* Guards the frame list, along with the frame counts, duration and bounds
+   * the loader updates. Decoded frames are never modified once added.
+   */
+  GMutex lock;
+
+  /* Canvas of the first frame, composited on first use and then shared. */
+  GdkPixbuf* static_image;
+
+  /* Zero delay frame held back by the loader, and the canvas it gets merged
+   * onto with the next frame.
+   */
+  GdkPixbufApngFrame*     pending;
+  GdkPixbufApngCompositor merge;
+
+  /* Canvases hold native-endian premultiplied ARGB32, the cairo image
+   * surface layout, instead of straight RGB(A) bytes. Accessed atomically,
+   * iterators on other threads read it.
+   */
+  gint premultiplied;
 };
 
 struct _GdkPixbufApngAnimClass {
@@ -46,6 +105,27 @@ struct _GdkPixbufApngAnimClass {
 
 GType gdk_pixbuf_apng_anim_get_type(void) G_GNUC_CONST;
 
+void     gdk_pixbuf_apng_anim_set_premultiplied(GdkPixbufApngAnim* anim,
+                                                gboolean premultiplied);
+gboolean gdk_pixbuf_apng_anim_get_premultiplied(GdkPixbufApngAnim* anim);
+
+void gdk_pixbuf_apng_compositor_clear(GdkPixbufApngCompositor* compositor);
+
+/* Moves the canvas to frame, stepping forward from the current frame when
+ * it precedes frame, or else from the closest preceding keyframe. Returns
+ * the canvas, owned by the compositor, or NULL when out of memory.
+ */
+GdkPixbuf* gdk_pixbuf_apng_compositor_seek(GdkPixbufApngCompositor* compositor,
+                                           GdkPixbufApngAnim*       animation,
+                                           GdkPixbufApngFrame*      frame);
+
+/* Composites a new frame that isn't stored in the animation, right after the
+ * current one. Only the canvas and the revert state are kept.
+ */
+GdkPixbuf* gdk_pixbuf_apng_compositor_push(GdkPixbufApngCompositor* compositor,
+                                           GdkPixbufApngAnim*       animation,
+                                           GdkPixbufApngFrame*      frame);
+
 typedef struct _GdkPixbufApngAnimIter      GdkPixbufApngAnimIter;
 typedef struct _GdkPixbufApngAnimIterClass GdkPixbufApngAnimIterClass;
 
@@ -71,7 +151,17 @@ struct _GdkPixbufApngAnimIter {
 
   GTimeVal start_time;
   GTimeVal current_time;
-  GList*   current_frame;
+  guint    current_frame;
+
+  GdkPixbufApngCompositor compositor;
+
+  /* Straight alpha copy of a premultiplied canvas, for get_pixbuf. */
+  GdkPixbuf*          pixbuf;
+  GdkPixbufApngFrame* pixbuf_frame;
+
+  /* Frame whose damage was reported last, and that damage. */
+  guint             damage_frame;
+  GdkPixbufApngRect damage;
 };
 
 struct _GdkPixbufApngAnimIterClass {
@@ -80,19 +170,104 @@ struct _GdkPixbufApngAnimIterClass {
 
 GType gdk_pixbuf_apng_anim_iter_get_type(void) G_GNUC_CONST;
 
+/* Returns the canvas area that changed since the previous call, covering
+ * the previous frame disposal and the current frame blending when the
+ * iterator moved to the next frame. On the first call, after wrapping
+ * around to the first frame, or when frames were skipped or seeked over,
+ * every area touched by the animation is damaged.
+ */
+gboolean gdk_pixbuf_apng_anim_iter_get_damage(GdkPixbufApngAnimIter* iter,
+                                              GdkPixbufApngRect*     damage);
+
+/* Returns the current canvas as CAIRO_FORMAT_ARGB32 pixels, suitable for
+ * cairo_image_surface_create_for_data, or NULL if the animation is not in
+ * premultiplied mode. The data is owned by the iterator and stays valid
+ * until it is advanced.
+ */
+const guchar* gdk_pixbuf_apng_anim_iter_get_argb32(GdkPixbufApngAnimIter* iter,
+                                                   gint* width, gint* height,
+                                                   gint* stride);
+
+/* Moves the iterator to the given frame, or to the frame displayed at the
+ * given time from the start of the animation, in milliseconds. The canvas
+ * is then composited from the closest preceding keyframe instead of from
+ * the first frame. Returns FALSE if the frame isn't loaded yet.
+ */
+gboolean gdk_pixbuf_apng_anim_iter_seek_frame(GdkPixbufApngAnimIter* iter,
+                                              guint                  index);
+gboolean gdk_pixbuf_apng_anim_iter_seek_time(GdkPixbufApngAnimIter* iter,
+                                             gint64                 time);
+
+typedef struct {
+  GdkPixbufApngRect      area;
+  GdkPixbufApngDisposeOp dispose_op;
+  GdkPixbufApngBlendOp   blend_op;
+
+  /* Start time within a loop and delay, in milliseconds. */
+  gint64 start;
+  gint   delay;
+
+  gboolean keyframe;
+
+  /* Offsets in the file of the frame fcTL chunk and of its first IDAT or
+   * fdAT chunk.
+   */
+  gsize fctl_offset;
+  gsize data_offset;
+} GdkPixbufApngFrameInfo;
+
+gboolean gdk_pixbuf_apng_anim_get_frame_info(GdkPixbufApngAnim*      anim,
+                                             guint                   index,
+                                             GdkPixbufApngFrameInfo* info);
+
 struct _GdkPixbufApngFrame {
+  gint ref_count;
+
   ApngChunk_fcTL fctl;
 
-  guchar* buf;
-  gsize   off;
-  gsize   size;
+  /* Position in the animation and start time within a loop. */
+  guint  index;
+  gint64 start_us;
+
+  gsize fctl_offset;
+  gsize data_offset;
+
+  /* The canvas this frame is blended onto doesn't depend on the previous
+   * frames, either because it was cleared entirely or because the frame
+   * replaces every pixel. Compositing can restart from here.
+   */
+  gboolean keyframe;
+
+  gsize off;
+  gsize size;
+
+  /* No transparent pixel, pixbuf is stored without alpha channel. */
+  gboolean opaque;
+
+  /* Canvas area changed by this frame, including the previous frame
+   * disposal.
+   */
+  GdkPixbufApngRect damage;
 
   GdkPixbuf* pixbuf;
-  GdkPixbuf* composited;
-  GdkPixbuf* revert;
 };
 
-void gdk_pixbuf_apng_anim_frame_composite(GdkPixbufApngAnim*  animation,
-                                          GdkPixbufApngFrame* frame);
+GdkPixbufApngFrame* gdk_pixbuf_apng_frame_new(void);
+GdkPixbufApngFrame* gdk_pixbuf_apng_frame_ref(GdkPixbufApngFrame* frame);
+void                gdk_pixbuf_apng_frame_unref(GdkPixbufApngFrame* frame);
+
+gint64 gdk_pixbuf_apng_frame_get_delay_us(const GdkPixbufApngFrame* frame);
+
+/* The animation takes over the reference to frame. Zero delay frames are
+ * never displayed, they are merged with the next frame when possible.
+ */
+void gdk_pixbuf_apng_anim_add_frame(GdkPixbufApngAnim*  animation,
+                                    GdkPixbufApngFrame* frame);
+
+/* Returns the frame at index, or NULL if it isn't loaded yet. Frames stay
+ * valid as long as the animation.
+ */
+GdkPixbufApngFrame* gdk_pixbuf_apng_anim_get_frame(GdkPixbufApngAnim* animation,
+                                                   guint              index);
 
 #endif // IO_APNG_ANIMATION_H
@@ -0,0 +1,97 @@
+#include "io-apng-argb32.h"
+
+/* x * a / 255, rounded, without a division */
+static inline guint32 apng_mul_un8(guint32 x, guint32 a) {
+  guint32 t = x * a + 0x80;
+  return ((t >> 8) + t) >> 8;
+}
+
+static inline guint32 apng_premultiply(guint8 r, guint8 g, guint8 b,
+                                       guint8 a) {
+  if (a == 0xff)
+    return 0xff000000u | (r << 16) | (g << 8) | b;
+  if (a == 0x00)
+    return 0;
+
+  return ((guint32)a << 24) | (apng_mul_un8(r, a) << 16) |
+         (apng_mul_un8(g, a) << 8) | apng_mul_un8(b, a);
+}
+
+static inline guint32 apng_over(guint32 src, guint32 dest) {
+  guint32 ia = 0xff - (src >> 24);
+
+  if (ia == 0)
+    return src;
+  if (ia == 0xff)
+    return dest;
+
+  /* Premultiplied channels never overflow: s + d * (1 - sa) <= 1 */
+  return src + ((apng_mul_un8(dest >> 24, ia) << 24) |
+                (apng_mul_un8((dest >> 16) & 0xff, ia) << 16) |
+                (apng_mul_un8((dest >> 8) & 0xff, ia) << 8) |
+                apng_mul_un8(dest & 0xff, ia));
+}
+
+void gdk_pixbuf_apng_blend_argb32(const GdkPixbuf* src, GdkPixbuf* dest,
+                                  gint x, gint y, gboolean over) {
+  gint          width          = gdk_pixbuf_get_width(src);
+  gint          height         = gdk_pixbuf_get_height(src);
+  gint          n_channels     = gdk_pixbuf_get_n_channels(src);
+  gint          src_rowstride  = gdk_pixbuf_get_rowstride(src);
+  gint          dest_rowstride = gdk_pixbuf_get_rowstride(dest);
+  const guchar* src_pixels     = gdk_pixbuf_get_pixels(src);
+  guchar*       dest_pixels    = gdk_pixbuf_get_pixels(dest);
+
+  g_assert(gdk_pixbuf_get_n_channels(dest) == 4);
+
+  /* An opaque source covers whatever it is blended over. */
+  if (n_channels == 3)
+    over = FALSE;
+
+  dest_pixels += y * dest_rowstride + x * 4;
+  for (gint j = 0; j < height; ++j) {
+    const guchar* s = src_pixels + j * src_rowstride;
+    guint32*      d = (guint32*)(dest_pixels + j * dest_rowstride);
+
+    for (gint i = 0; i < width; ++i, s += n_channels) {
+      guint32 p =
+          apng_premultiply(s[0], s[1], s[2], n_channels == 4 ? s[3] : 0xff);
+      d[i] = over ? apng_over(p, d[i]) : p;
+    }
+  }
+}
+
+void gdk_pixbuf_apng_unpremultiply(const GdkPixbuf* src, GdkPixbuf* dest) {
+  gint          width          = gdk_pixbuf_get_width(src);
+  gint          height         = gdk_pixbuf_get_height(src);
+  gint          src_rowstride  = gdk_pixbuf_get_rowstride(src);
+  gint          dest_rowstride = gdk_pixbuf_get_rowstride(dest);
+  const guchar* src_pixels     = gdk_pixbuf_get_pixels(src);
+  guchar*       dest_pixels    = gdk_pixbuf_get_pixels(dest);
+
+  g_assert(gdk_pixbuf_get_n_channels(dest) == 4);
+
+  for (gint j = 0; j < height; ++j) {
+    const guint32* s = (const guint32*)(src_pixels + j * src_rowstride);
+    guchar*        d = dest_pixels + j * dest_rowstride;
+
+    for (gint i = 0; i < width; ++i, d += 4) {
+      guint32 p = s[i];
+      guint32 a = p >> 24;
+
+      if (a == 0) {
+        d[0] = d[1] = d[2] = d[3] = 0;
+      } else if (a == 0xff) {
+        d[0] = p >> 16;
+        d[1] = p >> 8;
+        d[2] = p;
+        d[3] = 0xff;
+      } else {
+        d[0] = (((p >> 16) & 0xff) * 0xff + a / 2) / a;
+        d[1] = (((p >> 8) & 0xff) * 0xff + a / 2) / a;
+        d[2] = ((p & 0xff) * 0xff + a / 2) / a;
+        d[3] = a;
+      }
+    }
+  }
+}
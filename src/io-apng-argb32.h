@@ -0,0 +1,22 @@
+#ifndef IO_APNG_ARGB32_H
+#define IO_APNG_ARGB32_H
+
+#include "io-apng.h"
+
+/* Helpers for canvases stored as native-endian premultiplied ARGB32, the
+ * layout of CAIRO_FORMAT_ARGB32. Such canvases are plain 4-channel pixbufs
+ * whose bytes must not be interpreted as RGBA.
+ */
+
+/* Blends a straight alpha RGB(A) pixbuf into the canvas at (x, y), either
+ * replacing the destination pixels or compositing over them.
+ */
+void gdk_pixbuf_apng_blend_argb32(const GdkPixbuf* src, GdkPixbuf* dest,
+                                  gint x, gint y, gboolean over);
+
+/* Converts a whole ARGB32 canvas back into a straight alpha RGBA pixbuf of
+ * the same size.
+ */
+void gdk_pixbuf_apng_unpremultiply(const GdkPixbuf* src, GdkPixbuf* dest);
+
+#endif // IO_APNG_ARGB32_H
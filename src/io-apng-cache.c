@@ -0,0 +1,186 @@
+#include "io-apng-cache.h"
+#include "io-apng-animation.h"
+
+typedef struct {
+  gchar*             key;
+  gchar*             prefix;
+  gchar*             alias;
+  GdkPixbufApngAnim* anim;
+  gsize              size;
+  GList              link;
+} ApngCacheEntry;
+
+G_LOCK_DEFINE_STATIC(cache);
+static gsize       cache_budget   = 0;
+static gsize       cache_size     = 0;
+static guint64     cache_hits     = 0;
+static guint64     cache_misses   = 0;
+static GHashTable* cache_entries  = NULL; // key or alias -> entry
+static GHashTable* cache_prefixes = NULL; // prefix -> entry
+static GQueue      cache_lru      = G_QUEUE_INIT;
+
+/* Bytes held by the decoded frames of anim. */
+static gsize apng_cache_anim_size(GdkPixbufApngAnim* anim) {
+  gsize size = 0;
+
+  for (guint i = 0; i < anim->n_frames; ++i) {
+    GdkPixbufApngFrame* frame = gdk_pixbuf_apng_anim_get_frame(anim, i);
+
+    if (frame != NULL && frame->pixbuf != NULL)
+      size += (gsize)gdk_pixbuf_get_rowstride(frame->pixbuf) *
+              gdk_pixbuf_get_height(frame->pixbuf);
+  }
+
+  return size;
+}
+
+static void apng_cache_remove(ApngCacheEntry* entry) {
+  g_hash_table_remove(cache_entries, entry->key);
+  if (entry->alias != NULL &&
+      g_hash_table_lookup(cache_entries, entry->alias) == entry)
+    g_hash_table_remove(cache_entries, entry->alias);
+  if (entry->prefix != NULL &&
+      g_hash_table_lookup(cache_prefixes, entry->prefix) == entry)
+    g_hash_table_remove(cache_prefixes, entry->prefix);
+  g_queue_unlink(&cache_lru, &entry->link);
+  cache_size -= entry->size;
+
+  g_object_unref(entry->anim);
+  g_free(entry->key);
+  g_free(entry->prefix);
+  g_free(entry->alias);
+  g_free(entry);
+}
+
+/* Drops the least recently used entries until size more bytes fit. */
+static void apng_cache_evict(gsize size) {
+  while (cache_lru.tail != NULL && cache_size + size > cache_budget)
+    apng_cache_remove(cache_lru.tail->data);
+}
+
+void gdk_pixbuf_apng_cache_set_budget(gsize budget) {
+  G_LOCK(cache);
+  if (cache_entries == NULL) {
+    cache_entries  = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                           NULL);
+    cache_prefixes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                           NULL);
+  }
+  cache_budget = budget;
+  apng_cache_evict(0);
+  G_UNLOCK(cache);
+}
+
+void gdk_pixbuf_apng_cache_get_stats(GdkPixbufApngCacheStats* stats) {
+  g_return_if_fail(stats != NULL);
+
+  G_LOCK(cache);
+  stats->hits      = cache_hits;
+  stats->misses    = cache_misses;
+  stats->n_entries = cache_lru.length;
+  stats->size      = cache_size;
+  stats->budget    = cache_budget;
+  G_UNLOCK(cache);
+}
+
+void gdk_pixbuf_apng_cache_clear(void) {
+  G_LOCK(cache);
+  while (cache_lru.head != NULL)
+    apng_cache_remove(cache_lru.head->data);
+  cache_hits   = 0;
+  cache_misses = 0;
+  G_UNLOCK(cache);
+}
+
+gboolean gdk_pixbuf_apng_cache_is_enabled(void) {
+  gboolean enabled;
+
+  G_LOCK(cache);
+  enabled = cache_budget > 0;
+  G_UNLOCK(cache);
+
+  return enabled;
+}
+
+gboolean gdk_pixbuf_apng_cache_has_prefix(const gchar* prefix) {
+  gboolean found = FALSE;
+
+  G_LOCK(cache);
+  if (cache_prefixes != NULL)
+    found = g_hash_table_contains(cache_prefixes, prefix);
+  G_UNLOCK(cache);
+
+  return found;
+}
+
+GdkPixbufApngAnim* gdk_pixbuf_apng_cache_lookup(const gchar* key) {
+  ApngCacheEntry*    entry = NULL;
+  GdkPixbufApngAnim* anim  = NULL;
+
+  G_LOCK(cache);
+  if (cache_entries != NULL)
+    entry = g_hash_table_lookup(cache_entries, key);
+  if (entry != NULL) {
+    g_queue_unlink(&cache_lru, &entry->link);
+    g_queue_push_head_link(&cache_lru, &entry->link);
+    anim = g_object_ref(entry->anim);
+    cache_hits++;
+  }
+  G_UNLOCK(cache);
+
+  return anim;
+}
+
+void gdk_pixbuf_apng_cache_insert(const gchar* key, const gchar* prefix,
+                                  GdkPixbufApngAnim* anim) {
+  ApngCacheEntry* entry;
+  gsize           size = apng_cache_anim_size(anim);
+
+  G_LOCK(cache);
+  if (cache_budget == 0)
+    goto out;
+
+  cache_misses++;
+
+  /* Another loader may have decoded the same data meanwhile. */
+  if (size > cache_budget || g_hash_table_contains(cache_entries, key))
+    goto out;
+
+  apng_cache_evict(size);
+
+  entry            = g_new0(ApngCacheEntry, 1);
+  entry->key       = g_strdup(key);
+  entry->prefix    = g_strdup(prefix);
+  entry->anim      = g_object_ref(anim);
+  entry->size      = size;
+  entry->link.data = entry;
+  g_hash_table_insert(cache_entries, g_strdup(key), entry);
+  if (prefix != NULL)
+    g_hash_table_insert(cache_prefixes, g_strdup(prefix), entry);
+  g_queue_push_head_link(&cache_lru, &entry->link);
+  cache_size += size;
+
+out:
+  G_UNLOCK(cache);
+}
+
+void gdk_pixbuf_apng_cache_alias(const gchar* alias, const gchar* key) {
+  ApngCacheEntry* entry = NULL;
+
+  g_return_if_fail(alias != NULL);
+  g_return_if_fail(key != NULL);
+
+  G_LOCK(cache);
+  if (cache_entries != NULL)
+    entry = g_hash_table_lookup(cache_entries, key);
+  if (entry != NULL && !g_hash_table_contains(cache_entries, alias)) {
+    /* An entry keeps a single alias, a file that changed replaces it. */
+    if (entry->alias != NULL &&
+        g_hash_table_lookup(cache_entries, entry->alias) == entry)
+      g_hash_table_remove(cache_entries, entry->alias);
+    g_free(entry->alias);
+    entry->alias = g_strdup(alias);
+    g_hash_table_insert(cache_entries, g_strdup(alias), entry);
+  }
+  G_UNLOCK(cache);
+}
@@ -0,0 +1,49 @@
+#ifndef IO_APNG_CACHE_H
+#define IO_APNG_CACHE_H
+
+#include "io-apng.h"
+
+/* Animations whose data hash, or whose file identity, matches one already
+ * decoded are shared instead of being decoded again. The cache is process
+ * wide and disabled until given a budget, in bytes of decoded frames; the
+ * least recently used animations are dropped to stay within it.
+ *
+ * Cached animations are shared by every loader that hits them, they must not
+ * be modified, premultiplied property included.
+ */
+typedef struct {
+  guint64 hits;
+  guint64 misses;
+  guint   n_entries;
+  gsize   size;
+  gsize   budget;
+} GdkPixbufApngCacheStats;
+
+void gdk_pixbuf_apng_cache_set_budget(gsize budget);
+void gdk_pixbuf_apng_cache_get_stats(GdkPixbufApngCacheStats* stats);
+void gdk_pixbuf_apng_cache_clear(void);
+
+/* Loaders hold back the first APNG_CACHE_PREFIX_SIZE bytes until they are
+ * hashed. A known prefix makes them keep buffering without decoding until
+ * the whole hash confirms the match, an unknown one lets them decode.
+ */
+#define APNG_CACHE_PREFIX_SIZE 4096
+
+gboolean gdk_pixbuf_apng_cache_is_enabled(void);
+gboolean gdk_pixbuf_apng_cache_has_prefix(const gchar* prefix);
+
+/* Returns a new reference to the animation cached under key, a data hash
+ * or a file identity, and counts a hit, or returns NULL.
+ */
+GdkPixbufApngAnim* gdk_pixbuf_apng_cache_lookup(const gchar* key);
+
+/* Adds a freshly decoded anim under its data hash and prefix hash, and
+ * counts a miss. prefix is NULL for data shorter than APNG_CACHE_PREFIX_SIZE.
+ */
+void gdk_pixbuf_apng_cache_insert(const gchar* key, const gchar* prefix,
+                                  GdkPixbufApngAnim* anim);
+
+/* Makes the animation cached under key reachable with alias as well. */
+void gdk_pixbuf_apng_cache_alias(const gchar* alias, const gchar* key);
+
+#endif // IO_APNG_CACHE_H
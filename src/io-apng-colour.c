@@ -0,0 +1,428 @@
+#include "io-apng-colour.h"
+#include "io-apng.h"
+
+#include <math.h>
+#include <string.h>
+
+#define APNG_COLOUR_LINEAR_ONE (1 << APNG_COLOUR_LINEAR_BITS)
+#define APNG_COLOUR_MATRIX_BITS 12
+
+/* White point, then red, green and blue primaries, as x, y pairs. */
+static const gdouble apng_srgb_chrm[8] = {0.3127, 0.3290, 0.64, 0.33,
+                                          0.30,   0.60,   0.15, 0.06};
+
+static guint32 apng_be32(const guchar* p) {
+  return ((guint32)p[0] << 24) | ((guint32)p[1] << 16) |
+         ((guint32)p[2] << 8) | (guint32)p[3];
+}
+
+static guint16 apng_be16(const guchar* p) {
+  return ((guint16)p[0] << 8) | p[1];
+}
+
+static gdouble apng_s15_fixed16(const guchar* p) {
+  return (gint32)apng_be32(p) / 65536.0;
+}
+
+static gdouble apng_srgb_decode(gdouble v) {
+  return v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+}
+
+static gdouble apng_srgb_encode(gdouble v) {
+  if (!(v > 0.0))
+    return 0.0;
+  if (v >= 1.0)
+    return 1.0;
+  return v <= 0.0031308 ? v * 12.92 : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+}
+
+static void apng_mat_mul(gdouble r[3][3], const gdouble a[3][3],
+                         const gdouble b[3][3]) {
+  gdouble t[3][3];
+
+  for (gint i = 0; i < 3; ++i)
+    for (gint j = 0; j < 3; ++j)
+      t[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j];
+  memcpy(r, t, sizeof(t));
+}
+
+static gboolean apng_mat_invert(gdouble r[3][3], const gdouble m[3][3]) {
+  gdouble det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+                m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+  gdouble t[3][3];
+
+  if (fabs(det) < 1e-9)
+    return FALSE;
+
+  for (gint i = 0; i < 3; ++i)
+    for (gint j = 0; j < 3; ++j)
+      t[j][i] = (m[(i + 1) % 3][(j + 1) % 3] * m[(i + 2) % 3][(j + 2) % 3] -
+                 m[(i + 1) % 3][(j + 2) % 3] * m[(i + 2) % 3][(j + 1) % 3]) /
+                det;
+  memcpy(r, t, sizeof(t));
+
+  return TRUE;
+}
+
+/* RGB to XYZ for the given chromaticities, Bradford-adapted to D50 as ICC
+ * matrices are.
+ */
+static gboolean apng_chrm_matrix(gdouble m[3][3], const gdouble chrm[8]) {
+  static const gdouble bradford[3][3] = {{0.8951, 0.2664, -0.1614},
+                                         {-0.7502, 1.7135, 0.0367},
+                                         {0.0389, -0.0685, 1.0296}};
+  static const gdouble d50[3]         = {0.9642, 1.0, 0.8249};
+  gdouble              primaries[3][3];
+  gdouble              inverse[3][3];
+  gdouble              adapt[3][3] = {{0}};
+  gdouble              white[3];
+  gdouble              scale[3];
+  gdouble              cone_src[3];
+  gdouble              cone_dst[3];
+
+  for (gint i = 0; i < 4; ++i)
+    if (!(chrm[2 * i + 1] > 0.0) || chrm[2 * i] < 0.0 ||
+        chrm[2 * i] + chrm[2 * i + 1] > 1.0)
+      return FALSE;
+
+  for (gint c = 0; c < 3; ++c) {
+    gdouble x = chrm[2 + 2 * c], y = chrm[3 + 2 * c];
+
+    primaries[0][c] = x / y;
+    primaries[1][c] = 1.0;
+    primaries[2][c] = (1.0 - x - y) / y;
+  }
+  white[0] = chrm[0] / chrm[1];
+  white[1] = 1.0;
+  white[2] = (1.0 - chrm[0] - chrm[1]) / chrm[1];
+
+  if (!apng_mat_invert(inverse, primaries))
+    return FALSE;
+  for (gint i = 0; i < 3; ++i)
+    scale[i] = inverse[i][0] * white[0] + inverse[i][1] * white[1] +
+               inverse[i][2] * white[2];
+  for (gint i = 0; i < 3; ++i)
+    for (gint c = 0; c < 3; ++c)
+      m[i][c] = primaries[i][c] * scale[c];
+
+  for (gint i = 0; i < 3; ++i) {
+    cone_src[i] = bradford[i][0] * white[0] + bradford[i][1] * white[1] +
+                  bradford[i][2] * white[2];
+    cone_dst[i] = bradford[i][0] * d50[0] + bradford[i][1] * d50[1] +
+                  bradford[i][2] * d50[2];
+    adapt[i][i] = cone_dst[i] / cone_src[i];
+  }
+  if (!apng_mat_invert(inverse, bradford))
+    return FALSE;
+  apng_mat_mul(adapt, adapt, bradford);
+  apng_mat_mul(adapt, inverse, adapt);
+  apng_mat_mul(m, adapt, m);
+
+  return TRUE;
+}
+
+/* Evaluates an ICC curv or para tag at the 256 sample values. */
+static gboolean apng_icc_curve(gfloat trc[256], const guchar* tag,
+                               gsize size) {
+  static const guint n_params[] = {1, 3, 4, 5, 7};
+
+  if (size < 12)
+    return FALSE;
+
+  if (memcmp(tag, "curv", 4) == 0) {
+    guint32 n = apng_be32(tag + 8);
+
+    if (n > (size - 12) / 2)
+      return FALSE;
+
+    for (guint v = 0; v < 256; ++v) {
+      if (n == 0) {
+        trc[v] = v / 255.0;
+      } else if (n == 1) {
+        trc[v] = pow(v / 255.0, apng_be16(tag + 12) / 256.0);
+      } else {
+        gdouble x = v * (n - 1) / 255.0;
+        guint   i = MIN((guint)x, n - 2);
+        gdouble a = apng_be16(tag + 12 + 2 * i) / 65535.0;
+        gdouble b = apng_be16(tag + 14 + 2 * i) / 65535.0;
+
+        trc[v] = a + (b - a) * (x - i);
+      }
+    }
+  } else if (memcmp(tag, "para", 4) == 0) {
+    guint   type = apng_be16(tag + 8);
+    gdouble p[7] = {0};
+
+    if (type >= G_N_ELEMENTS(n_params) || size < 12 + 4 * n_params[type])
+      return FALSE;
+    for (guint i = 0; i < n_params[type]; ++i)
+      p[i] = apng_s15_fixed16(tag + 12 + 4 * i);
+
+    /* Every type is a special case of the 7 parameter function. */
+    switch (type) {
+    case 0:
+      p[1] = 1.0;
+      break;
+    case 1:
+      p[4] = p[1] != 0.0 ? -p[2] / p[1] : 0.0;
+      break;
+    case 2:
+      p[5] = p[3];
+      p[6] = p[3];
+      p[4] = p[1] != 0.0 ? -p[2] / p[1] : 0.0;
+      p[3] = 0.0;
+      break;
+    case 3:
+      break;
+    }
+
+    for (guint v = 0; v < 256; ++v) {
+      gdouble x = v / 255.0;
+      gdouble y;
+
+      if (x >= p[4]) {
+        gdouble base = p[1] * x + p[2];
+        y            = (base > 0.0 ? pow(base, p[0]) : 0.0) + p[5];
+      } else {
+        y = p[3] * x + p[6];
+      }
+      trc[v] = y;
+    }
+  } else {
+    return FALSE;
+  }
+
+  for (guint v = 0; v < 256; ++v)
+    trc[v] = isfinite(trc[v]) ? CLAMP(trc[v], 0.0f, 1.0f) : 0.0f;
+
+  return TRUE;
+}
+
+/* Extracts the matrix and curves of an RGB display profile. Profiles that
+ * only describe the conversion with lookup tables aren't supported.
+ */
+static gboolean apng_icc_parse(ApngColour* colour, const guchar* icc,
+                               gsize size) {
+  static const gchar* const colorant_tags[] = {"rXYZ", "gXYZ", "bXYZ"};
+  static const gchar* const curve_tags[]    = {"rTRC", "gTRC", "bTRC"};
+  guint                     found           = 0;
+  guint32                   n_tags;
+
+  if (size < 132 || apng_be32(icc) > size ||
+      memcmp(icc + 16, "RGB ", 4) != 0 || memcmp(icc + 20, "XYZ ", 4) != 0 ||
+      memcmp(icc + 36, "acsp", 4) != 0)
+    return FALSE;
+
+  n_tags = apng_be32(icc + 128);
+  if (n_tags > (size - 132) / 12)
+    return FALSE;
+
+  for (guint32 i = 0; i < n_tags; ++i) {
+    const guchar* entry  = icc + 132 + 12 * i;
+    guint32       offset = apng_be32(entry + 4);
+    guint32       length = apng_be32(entry + 8);
+
+    if (offset > size || length > size - offset)
+      continue;
+
+    for (guint c = 0; c < 3; ++c) {
+      if (memcmp(entry, colorant_tags[c], 4) == 0 && length >= 20 &&
+          memcmp(icc + offset, "XYZ ", 4) == 0) {
+        for (guint j = 0; j < 3; ++j)
+          colour->icc_matrix[j][c] =
+              apng_s15_fixed16(icc + offset + 8 + 4 * j);
+        found |= 1 << c;
+      }
+      if (memcmp(entry, curve_tags[c], 4) == 0 &&
+          apng_icc_curve(colour->icc_trc[c], icc + offset, length))
+        found |= 8 << c;
+    }
+  }
+
+  return found == 0x3f;
+}
+
+static gsize apng_iccp_parse(ApngColour* colour, const guchar* data,
+                             gsize size, gsize max_icc_size) {
+  const guchar* name_end = memchr(data, '\0', MIN(size, 80));
+  z_stream      zstream  = {0};
+  guchar*       icc      = NULL;
+  gsize         icc_size = 0;
+  gsize         header;
+  gsize         inflated;
+  int           zerr;
+
+  /* Profile name, then the compression method, always deflate. */
+  header = name_end != NULL ? (gsize)(name_end - data) + 2 : 0;
+  if (header < 3 || header > size || name_end[1] != 0)
+    return 0;
+  data += header;
+  size -= header;
+
+  max_icc_size = MIN(max_icc_size, APNG_MAX_ICC_PROFILE_SIZE);
+  if (max_icc_size == 0 || inflateInit(&zstream) != Z_OK)
+    return 0;
+  zstream.next_in  = (Bytef*)data;
+  zstream.avail_in = size;
+  do {
+    icc_size          = MIN(icc_size == 0 ? 4096 : 2 * icc_size, max_icc_size);
+    icc               = g_realloc(icc, icc_size);
+    zstream.next_out  = icc + zstream.total_out;
+    zstream.avail_out = icc_size - zstream.total_out;
+    zerr              = inflate(&zstream, Z_FINISH);
+  } while (zerr == Z_BUF_ERROR && zstream.avail_out == 0 &&
+           icc_size < max_icc_size);
+
+  inflated = zstream.total_out;
+  if (zerr == Z_STREAM_END)
+    colour->has_icc = apng_icc_parse(colour, icc, inflated);
+
+  inflateEnd(&zstream);
+  g_free(icc);
+
+  return inflated;
+}
+
+gsize gdk_pixbuf_apng_colour_parse(ApngColour* colour, guint32 chunk_type,
+                                   const guchar* data, gsize size,
+                                   gsize max_icc_size) {
+  switch (chunk_type) {
+  case APNG_CHUNK_gAMA:
+    if (size == 4)
+      colour->gama = apng_be32(data);
+    break;
+  case APNG_CHUNK_cHRM:
+    if (size == 32) {
+      for (guint i = 0; i < 8; ++i)
+        colour->chrm[i] = apng_be32(data + 4 * i) / 100000.0;
+      colour->has_chrm = TRUE;
+    }
+    break;
+  case APNG_CHUNK_sRGB:
+    if (size == 1)
+      colour->srgb = TRUE;
+    break;
+  case APNG_CHUNK_iCCP:
+    if (size <= APNG_MAX_ICCP_CHUNK_SIZE)
+      return apng_iccp_parse(colour, data, size, max_icc_size);
+    break;
+  default:
+    break;
+  }
+
+  return 0;
+}
+
+void gdk_pixbuf_apng_colour_prepare(ApngColour* colour) {
+  gdouble  to_srgb[3][3];
+  gdouble  matrix[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+  gdouble  linear[3][256];
+  gboolean diagonal = TRUE;
+
+  if (colour->prepared)
+    return;
+  colour->prepared = TRUE;
+
+  /* iCCP takes precedence over sRGB, which takes precedence over gAMA and
+   * cHRM. Without any of them the samples are taken as sRGB already.
+   */
+  if (colour->has_icc) {
+    if (!apng_chrm_matrix(to_srgb, apng_srgb_chrm) ||
+        !apng_mat_invert(to_srgb, to_srgb))
+      return;
+    apng_mat_mul(matrix, to_srgb, colour->icc_matrix);
+    for (guint c = 0; c < 3; ++c)
+      for (guint v = 0; v < 256; ++v)
+        linear[c][v] = colour->icc_trc[c][v];
+  } else if (colour->srgb || (colour->gama == 0 && !colour->has_chrm)) {
+    return;
+  } else {
+    gdouble gamma = colour->gama / 100000.0;
+
+    if (colour->has_chrm) {
+      if (!apng_chrm_matrix(matrix, colour->chrm) ||
+          !apng_chrm_matrix(to_srgb, apng_srgb_chrm) ||
+          !apng_mat_invert(to_srgb, to_srgb))
+        return;
+      apng_mat_mul(matrix, to_srgb, matrix);
+    }
+
+    /* Like libpng, a gamma within 5% of 1/2.2 isn't worth correcting, and
+     * neither is a missing one.
+     */
+    for (guint v = 0; v < 256; ++v) {
+      gdouble l = colour->gama == 0 || fabs(gamma * 2.2 - 1.0) < 0.05
+                      ? apng_srgb_decode(v / 255.0)
+                      : pow(v / 255.0, 1.0 / gamma);
+
+      linear[0][v] = linear[1][v] = linear[2][v] = l;
+    }
+  }
+
+  /* Primaries close enough to sRGB only need per-channel tables. */
+  for (guint i = 0; i < 3; ++i)
+    for (guint j = 0; j < 3; ++j)
+      if (fabs(matrix[i][j] - (i == j)) > 2e-3)
+        diagonal = FALSE;
+
+  if (diagonal) {
+    for (guint c = 0; c < 3; ++c)
+      for (guint v = 0; v < 256; ++v) {
+        colour->lut[c][v] = lround(apng_srgb_encode(linear[c][v]) * 255.0);
+        if (colour->lut[c][v] != v)
+          colour->enabled = TRUE;
+      }
+    return;
+  }
+
+  for (guint c = 0; c < 3; ++c) {
+    for (guint v = 0; v < 256; ++v)
+      colour->linear[c][v] = lround(linear[c][v] * APNG_COLOUR_LINEAR_ONE);
+    /* Bounded so that the fixed point products can't overflow. */
+    for (guint k = 0; k < 3; ++k)
+      colour->matrix[c][k] = lround(CLAMP(matrix[c][k], -8.0, 8.0) *
+                                    (1 << APNG_COLOUR_MATRIX_BITS));
+  }
+
+  colour->encode = g_malloc(APNG_COLOUR_LINEAR_ONE + 1);
+  for (guint l = 0; l <= APNG_COLOUR_LINEAR_ONE; ++l)
+    colour->encode[l] =
+        lround(apng_srgb_encode((gdouble)l / APNG_COLOUR_LINEAR_ONE) * 255.0);
+  colour->enabled = TRUE;
+}
+
+void gdk_pixbuf_apng_colour_clear(ApngColour* colour) {
+  g_clear_pointer(&colour->encode, g_free);
+}
+
+static void apng_colour_convert(const ApngColour* colour, guint8* pixel) {
+  gint32 l[3] = {colour->linear[0][pixel[0]], colour->linear[1][pixel[1]],
+                 colour->linear[2][pixel[2]]};
+
+  for (guint c = 0; c < 3; ++c) {
+    gint32 v = (colour->matrix[c][0] * l[0] + colour->matrix[c][1] * l[1] +
+                colour->matrix[c][2] * l[2] +
+                (1 << (APNG_COLOUR_MATRIX_BITS - 1))) >>
+               APNG_COLOUR_MATRIX_BITS;
+
+    pixel[c] = colour->encode[CLAMP(v, 0, APNG_COLOUR_LINEAR_ONE)];
+  }
+}
+
+void gdk_pixbuf_apng_colour_apply(const ApngColour* colour, guint8* pixels,
+                                  gsize width, guint n_channels) {
+  if (!colour->enabled)
+    return;
+
+  if (colour->encode != NULL) {
+    for (gsize x = 0; x < width; ++x, pixels += n_channels)
+      apng_colour_convert(colour, pixels);
+  } else {
+    for (gsize x = 0; x < width; ++x, pixels += n_channels) {
+      pixels[0] = colour->lut[0][pixels[0]];
+      pixels[1] = colour->lut[1][pixels[1]];
+      pixels[2] = colour->lut[2][pixels[2]];
+    }
+  }
+}
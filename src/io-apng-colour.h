@@ -0,0 +1,57 @@
+#ifndef IO_APNG_COLOUR_H
+#define IO_APNG_COLOUR_H
+
+#include <glib.h>
+
+/* Precision of the linear light values between the two tables. */
+#define APNG_COLOUR_LINEAR_BITS 14
+
+/* Largest iCCP chunk, and decompressed profile, the loader looks at. */
+#define APNG_MAX_ICCP_CHUNK_SIZE (1 << 20)
+#define APNG_MAX_ICC_PROFILE_SIZE (4 << 20)
+
+/* Conversion of the image samples to sRGB, described by the gAMA, cHRM,
+ * sRGB and iCCP chunks. The chunks are reduced to lookup tables before the
+ * first PLTE or image data, so that converting a pixel costs one table
+ * lookup per channel. When the primaries differ from sRGB, the samples go
+ * through a table into linear light, a fixed point matrix, and a table
+ * back.
+ */
+typedef struct {
+  /* Chunks seen so far, only the one taking precedence is used. */
+  guint32  gama;
+  gboolean srgb;
+  gboolean has_chrm;
+  gdouble  chrm[8];
+  /* A usable matrix/TRC profile: RGB to D50 XYZ and linear samples. */
+  gboolean has_icc;
+  gdouble  icc_matrix[3][3];
+  gfloat   icc_trc[3][256];
+
+  /* Later colour chunks are ignored, as the PNG spec requires. */
+  gboolean prepared;
+  /* Whether samples need converting at all. */
+  gboolean enabled;
+  guint8   lut[3][256];
+  /* The matrix conversion, used when encode isn't NULL. */
+  guint16 linear[3][256];
+  gint32  matrix[3][3];
+  guint8* encode;
+} ApngColour;
+
+/* Records a gAMA, cHRM, sRGB or iCCP chunk, invalid ones are ignored. An
+ * iCCP profile is inflated up to max_icc_size bytes, and no further than
+ * APNG_MAX_ICC_PROFILE_SIZE. Returns the number of bytes inflated.
+ */
+gsize gdk_pixbuf_apng_colour_parse(ApngColour* colour, guint32 chunk_type,
+                                   const guchar* data, gsize size,
+                                   gsize max_icc_size);
+/* Builds the tables from the chunks seen so far. */
+void gdk_pixbuf_apng_colour_prepare(ApngColour* colour);
+void gdk_pixbuf_apng_colour_clear(ApngColour* colour);
+
+/* Converts width RGB or RGBA pixels in place, alpha is left untouched. */
+void gdk_pixbuf_apng_colour_apply(const ApngColour* colour, guint8* pixels,
+                                  gsize width, guint n_channels);
+
+#endif // IO_APNG_COLOUR_H
@@ -0,0 +1,207 @@
+#include "io-apng-pool.h"
+
+typedef struct _GdkPixbufApngPoolBlock GdkPixbufApngPoolBlock;
+
+struct _GdkPixbufApngPoolBlock {
+  GdkPixbufApngPool* pool;
+  gsize              size;
+
+  /* While released: in the list of blocks of the same size, and in the list
+   * of every released block, most recently released first in both.
+   */
+  GList size_link;
+  GList age_link;
+};
+
+/* Pixel data follows the block header, kept 16-byte aligned. */
+#define APNG_POOL_HEADER_SIZE ((sizeof(GdkPixbufApngPoolBlock) + 15) & ~15)
+
+struct _GdkPixbufApngPool {
+  gint   ref_count;
+  GMutex lock;
+
+  /* byte length -> GQueue of released blocks */
+  GHashTable* free_blocks;
+  GQueue      free_by_age;
+  gsize       free_bytes;
+
+  guint max_blocks;
+  gsize max_bytes;
+};
+
+GdkPixbufApngPool* gdk_pixbuf_apng_pool_new(void) {
+  GdkPixbufApngPool* pool;
+
+  pool            = g_new0(GdkPixbufApngPool, 1);
+  pool->ref_count = 1;
+  g_mutex_init(&pool->lock);
+  pool->free_blocks =
+      g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  g_queue_init(&pool->free_by_age);
+  pool->max_blocks = APNG_POOL_MAX_BLOCKS;
+  pool->max_bytes  = APNG_POOL_MAX_BYTES;
+
+  return pool;
+}
+
+GdkPixbufApngPool* gdk_pixbuf_apng_pool_ref(GdkPixbufApngPool* pool) {
+  g_atomic_int_inc(&pool->ref_count);
+  return pool;
+}
+
+/* Takes a released block out of both lists, the pool lock is held. */
+static void apng_pool_unlink(GdkPixbufApngPool*      pool,
+                             GdkPixbufApngPoolBlock* block) {
+  gpointer key   = GSIZE_TO_POINTER(block->size);
+  GQueue*  queue = g_hash_table_lookup(pool->free_blocks, key);
+
+  g_queue_unlink(queue, &block->size_link);
+  if (g_queue_is_empty(queue))
+    g_hash_table_remove(pool->free_blocks, key);
+  g_queue_unlink(&pool->free_by_age, &block->age_link);
+  pool->free_bytes -= block->size;
+}
+
+/* Frees the oldest released blocks until both bounds are met, queue being
+ * the list of the size that just grew, if any.
+ */
+static void apng_pool_trim(GdkPixbufApngPool* pool, GQueue* queue) {
+  while (queue != NULL && queue->length > pool->max_blocks) {
+    GdkPixbufApngPoolBlock* block = queue->tail->data;
+
+    /* The list goes away along with its last block. */
+    if (queue->length == 1)
+      queue = NULL;
+    apng_pool_unlink(pool, block);
+    g_free(block);
+  }
+
+  while (pool->free_bytes > pool->max_bytes) {
+    GdkPixbufApngPoolBlock* block = pool->free_by_age.tail->data;
+
+    apng_pool_unlink(pool, block);
+    g_free(block);
+  }
+}
+
+void gdk_pixbuf_apng_pool_unref(GdkPixbufApngPool* pool) {
+  if (!g_atomic_int_dec_and_test(&pool->ref_count))
+    return;
+
+  while (pool->free_by_age.head != NULL) {
+    GdkPixbufApngPoolBlock* block = pool->free_by_age.head->data;
+
+    apng_pool_unlink(pool, block);
+    g_free(block);
+  }
+  g_hash_table_destroy(pool->free_blocks);
+  g_mutex_clear(&pool->lock);
+  g_free(pool);
+}
+
+void gdk_pixbuf_apng_pool_set_limits(GdkPixbufApngPool* pool, guint max_blocks,
+                                     gsize max_bytes) {
+  GList* link;
+
+  g_mutex_lock(&pool->lock);
+  pool->max_blocks = max_blocks;
+  pool->max_bytes  = max_bytes;
+
+  /* Oldest first, so that each size keeps its most recent blocks. */
+  link = pool->free_by_age.tail;
+  while (link != NULL) {
+    GdkPixbufApngPoolBlock* block = link->data;
+    GQueue*                 queue =
+        g_hash_table_lookup(pool->free_blocks, GSIZE_TO_POINTER(block->size));
+
+    link = link->prev;
+    if (queue->length > max_blocks) {
+      apng_pool_unlink(pool, block);
+      g_free(block);
+    }
+  }
+  apng_pool_trim(pool, NULL);
+  g_mutex_unlock(&pool->lock);
+}
+
+gsize gdk_pixbuf_apng_pool_get_retained(GdkPixbufApngPool* pool,
+                                        guint*             n_blocks) {
+  gsize bytes;
+
+  g_mutex_lock(&pool->lock);
+  bytes = pool->free_bytes;
+  if (n_blocks != NULL)
+    *n_blocks = pool->free_by_age.length;
+  g_mutex_unlock(&pool->lock);
+
+  return bytes;
+}
+
+static void gdk_pixbuf_apng_pool_release(guchar* pixels, gpointer data) {
+  GdkPixbufApngPoolBlock* block = data;
+  GdkPixbufApngPool*      pool  = block->pool;
+  gpointer                key   = GSIZE_TO_POINTER(block->size);
+  GQueue*                 queue;
+
+  g_mutex_lock(&pool->lock);
+  queue = g_hash_table_lookup(pool->free_blocks, key);
+  if (queue == NULL) {
+    queue = g_new0(GQueue, 1);
+    g_hash_table_insert(pool->free_blocks, key, queue);
+  }
+  g_queue_push_head_link(queue, &block->size_link);
+  g_queue_push_head_link(&pool->free_by_age, &block->age_link);
+  pool->free_bytes += block->size;
+  apng_pool_trim(pool, queue);
+  g_mutex_unlock(&pool->lock);
+
+  gdk_pixbuf_apng_pool_unref(pool);
+}
+
+GdkPixbuf* gdk_pixbuf_apng_pool_new_pixbuf(GdkPixbufApngPool* pool,
+                                           gboolean has_alpha, gint width,
+                                           gint height) {
+  GdkPixbufApngPoolBlock* block = NULL;
+  GdkPixbuf*              pixbuf;
+  gint                    n_channels = has_alpha ? 4 : 3;
+  gsize                   rowstride;
+  gsize                   size;
+  GQueue*                 queue;
+
+  if (width <= 0 || height <= 0 || width > (G_MAXINT - 3) / n_channels)
+    return NULL;
+
+  /* Same layout as gdk_pixbuf_new, so the buffers are interchangeable. */
+  rowstride = ((gsize)width * n_channels + 3) & ~(gsize)3;
+  if ((gsize)height > (G_MAXSIZE - APNG_POOL_HEADER_SIZE) / rowstride)
+    return NULL;
+  size = rowstride * height;
+
+  g_mutex_lock(&pool->lock);
+  queue = g_hash_table_lookup(pool->free_blocks, GSIZE_TO_POINTER(size));
+  if (queue != NULL) {
+    block = queue->head->data;
+    apng_pool_unlink(pool, block);
+  }
+  g_mutex_unlock(&pool->lock);
+
+  if (block == NULL) {
+    block = g_try_malloc(APNG_POOL_HEADER_SIZE + size);
+    if (block == NULL)
+      return NULL;
+
+    block->pool      = pool;
+    block->size      = size;
+    block->size_link = (GList){block, NULL, NULL};
+    block->age_link  = (GList){block, NULL, NULL};
+  }
+
+  gdk_pixbuf_apng_pool_ref(pool);
+  pixbuf = gdk_pixbuf_new_from_data(
+      (guchar*)block + APNG_POOL_HEADER_SIZE, GDK_COLORSPACE_RGB, has_alpha, 8,
+      width, height, rowstride, gdk_pixbuf_apng_pool_release, block);
+  if (pixbuf == NULL)
+    gdk_pixbuf_apng_pool_release(NULL, block);
+
+  return pixbuf;
+}
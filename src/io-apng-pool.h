@@ -0,0 +1,37 @@
+#ifndef IO_APNG_POOL_H
+#define IO_APNG_POOL_H
+
+#include "io-apng.h"
+
+/* Recycles pixel buffers of identical byte length. Buffers are handed out
+ * wrapped in GdkPixbuf objects, and go back to the pool when the last
+ * reference to the pixbuf is dropped, from whichever thread that happens.
+ *
+ * Released buffers are kept for reuse within two bounds: at most max_blocks
+ * buffers of each byte length, and at most max_bytes in total. Past either
+ * one, the least recently released buffers are freed first.
+ */
+typedef struct _GdkPixbufApngPool GdkPixbufApngPool;
+
+#define APNG_POOL_MAX_BLOCKS 4
+#define APNG_POOL_MAX_BYTES (16 << 20)
+
+GdkPixbufApngPool* gdk_pixbuf_apng_pool_new(void);
+GdkPixbufApngPool* gdk_pixbuf_apng_pool_ref(GdkPixbufApngPool* pool);
+void               gdk_pixbuf_apng_pool_unref(GdkPixbufApngPool* pool);
+
+/* Changes the bounds, APNG_POOL_MAX_BLOCKS and APNG_POOL_MAX_BYTES by
+ * default. Buffers kept beyond the new ones are freed right away.
+ */
+void gdk_pixbuf_apng_pool_set_limits(GdkPixbufApngPool* pool, guint max_blocks,
+                                     gsize max_bytes);
+
+/* Returns the bytes of pixel data kept for reuse, and how many buffers. */
+gsize gdk_pixbuf_apng_pool_get_retained(GdkPixbufApngPool* pool,
+                                        guint*             n_blocks);
+
+GdkPixbuf* gdk_pixbuf_apng_pool_new_pixbuf(GdkPixbufApngPool* pool,
+                                           gboolean has_alpha, gint width,
+                                           gint height);
+
+#endif // IO_APNG_POOL_H
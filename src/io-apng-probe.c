@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "io-apng.h"
+
+/* Either a FILE or an in-memory buffer, chunk payloads the probe doesn't
+ * need are seeked over instead of being read.
+ */
+typedef struct {
+  FILE*         file;
+  const guchar* data;
+  gsize         size;
+  gsize         off;
+} ApngProbeSource;
+
+static gboolean apng_probe_read(ApngProbeSource* src, gpointer buf,
+                                gsize size) {
+  if (src->file != NULL)
+    return fread(buf, 1, size, src->file) == size;
+
+  if (src->size - src->off < size)
+    return FALSE;
+
+  memcpy(buf, src->data + src->off, size);
+  src->off += size;
+  return TRUE;
+}
+
+static gboolean apng_probe_skip(ApngProbeSource* src, gsize size) {
+  if (src->file != NULL)
+    return fseek(src->file, size, SEEK_CUR) == 0;
+
+  if (src->size - src->off < size)
+    return FALSE;
+
+  src->off += size;
+  return TRUE;
+}
+
+static gboolean apng_probe(ApngProbeSource* src, GdkPixbufApngInfo* info,
+                           GError** error) {
+  guint64  apng_header;
+  gint64   duration_us = 0;
+  gboolean has_ihdr    = FALSE;
+
+  memset(info, 0, sizeof(*info));
+
+  if (!apng_probe_read(src, &apng_header, sizeof(apng_header)))
+    goto truncated;
+  if (apng_header != GUINT64_TO_BE(0x89504e470d0a1a0a)) {
+    g_set_error_literal(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                        "Invalid APNG file signature");
+    return FALSE;
+  }
+
+  for (;;) {
+    guint32 chunk_header[2];
+    guint32 chunk_size;
+    guint32 chunk_type;
+    guchar  buf[sizeof(ApngChunk_fcTL)];
+    gsize   expected = 0;
+
+    if (!apng_probe_read(src, chunk_header, sizeof(chunk_header)))
+      goto truncated;
+    chunk_size = GUINT32_FROM_BE(chunk_header[0]);
+    chunk_type = GUINT32_FROM_BE(chunk_header[1]);
+
+    if (chunk_size > G_MAXINT32)
+      goto corrupt;
+    if (!has_ihdr && chunk_type != APNG_CHUNK_IHDR)
+      goto corrupt;
+
+    switch (chunk_type) {
+    case APNG_CHUNK_IHDR:
+      expected = sizeof(ApngChunk_IHDR);
+      break;
+    case APNG_CHUNK_acTL:
+      expected = sizeof(ApngChunk_acTL);
+      break;
+    case APNG_CHUNK_fcTL:
+      expected = sizeof(ApngChunk_fcTL);
+      break;
+    case APNG_CHUNK_IEND:
+      /* Read rather than seeked over, fseek succeeds past the end. */
+      if (!apng_probe_read(src, buf, sizeof(guint32)))
+        goto truncated;
+      info->duration = duration_us / 1000;
+      return TRUE;
+    default:
+      if (!apng_probe_skip(src, chunk_size))
+        goto truncated;
+      break;
+    }
+
+    if (expected > 0) {
+      if (chunk_size != expected)
+        goto corrupt;
+      if (!apng_probe_read(src, buf, chunk_size))
+        goto truncated;
+    }
+
+    switch (chunk_type) {
+    case APNG_CHUNK_IHDR: {
+      ApngChunk_IHDR ihdr;
+
+      memcpy(&ihdr, buf, sizeof(ihdr));
+      info->width  = GUINT32_FROM_BE(ihdr.width);
+      info->height = GUINT32_FROM_BE(ihdr.height);
+      has_ihdr     = TRUE;
+      break;
+    }
+    case APNG_CHUNK_acTL: {
+      ApngChunk_acTL actl;
+
+      memcpy(&actl, buf, sizeof(actl));
+      info->num_frames = GUINT32_FROM_BE(actl.num_frames);
+      info->num_plays  = GUINT32_FROM_BE(actl.num_plays);
+      break;
+    }
+    case APNG_CHUNK_fcTL: {
+      ApngChunk_fcTL fctl;
+
+      memcpy(&fctl, buf, sizeof(fctl));
+      fctl.delay_num = GUINT16_FROM_BE(fctl.delay_num);
+      fctl.delay_den = GUINT16_FROM_BE(fctl.delay_den);
+
+      /* Summed like the animation duration, rounded once at IEND. */
+      duration_us += gdk_pixbuf_apng_fctl_get_delay_us(&fctl);
+      break;
+    }
+    }
+
+    if (!apng_probe_skip(src, sizeof(guint32)))
+      goto truncated;
+  }
+
+truncated:
+  g_set_error_literal(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                      "APNG image was truncated or incomplete.");
+  return FALSE;
+
+corrupt:
+  g_set_error_literal(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                      "Invalid chunk in APNG file");
+  return FALSE;
+}
+
+gboolean gdk_pixbuf_apng_probe_file(FILE* file, GdkPixbufApngInfo* info,
+                                    GError** error) {
+  ApngProbeSource src = {file, NULL, 0, 0};
+
+  g_return_val_if_fail(file != NULL, FALSE);
+  g_return_val_if_fail(info != NULL, FALSE);
+
+  return apng_probe(&src, info, error);
+}
+
+gboolean gdk_pixbuf_apng_probe_data(const guchar* data, gsize size,
+                                    GdkPixbufApngInfo* info, GError** error) {
+  ApngProbeSource src = {NULL, data, size, 0};
+
+  g_return_val_if_fail(data != NULL || size == 0, FALSE);
+  g_return_val_if_fail(info != NULL, FALSE);
+
+  return apng_probe(&src, info, error);
+}
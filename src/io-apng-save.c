@@ -0,0 +1,576 @@
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "io-apng-animation.h"
+#include "io-apng-save.h"
+
+typedef struct {
+  ApngChunk_fcTL fctl;
+  /* Accumulated over merged frames, in milliseconds. */
+  guint64 delay;
+
+  /* Unfiltered pixels of the frame area, freed once compressed. */
+  guchar* pixels;
+  guchar* data;
+  gsize   size;
+  int     zerr;
+} ApngSaveFrame;
+
+typedef struct {
+  gint   width;
+  gint   height;
+  guint8 colour_type;
+  gsize  bpp;
+  gint   compression;
+} ApngSaver;
+
+static void apng_save_frame_free(gpointer data) {
+  ApngSaveFrame* frame = data;
+
+  g_free(frame->pixels);
+  g_free(frame->data);
+  g_free(frame);
+}
+
+static guint8 apng_paeth(guint8 a, guint8 b, guint8 c) {
+  gint  p  = a + b - c;
+  guint pa = abs(p - a);
+  guint pb = abs(p - b);
+  guint pc = abs(p - c);
+
+  if (pa <= pb && pa <= pc)
+    return a;
+  else if (pb <= pc)
+    return b;
+  else
+    return c;
+}
+
+/* Filters row into out, returns the sum of the filtered bytes taken as
+ * signed values, the usual estimate of how well a row compresses.
+ */
+static guint apng_filter_row(guint8* out, const guint8* row,
+                             const guint8* prev, guint8 filter_type,
+                             gsize bpp, gsize length) {
+  guint sum = 0;
+
+  for (gsize x = 0; x < length; ++x) {
+    guint8 a = x >= bpp ? row[x - bpp] : 0;
+    guint8 b = prev != NULL ? prev[x] : 0;
+    guint8 c = prev != NULL && x >= bpp ? prev[x - bpp] : 0;
+    guint8 v = row[x];
+
+    if (filter_type == 1)
+      v -= a;
+    else if (filter_type == 2)
+      v -= b;
+    else if (filter_type == 3)
+      v -= (a + b) / 2;
+    else if (filter_type == 4)
+      v -= apng_paeth(a, b, c);
+
+    out[x] = v;
+    sum += v < 128 ? v : 256 - v;
+  }
+
+  return sum;
+}
+
+static void apng_save_compress(gpointer data, gpointer user_data) {
+  ApngSaveFrame* frame  = data;
+  ApngSaver*     saver  = user_data;
+  gsize const    width  = frame->fctl.width;
+  gsize const    height = frame->fctl.height;
+  gsize const    length = width * saver->bpp;
+  guint8*        filtered;
+  guint8*        candidate;
+  z_stream       zstream;
+
+  filtered  = g_try_malloc((length + 1) * height);
+  candidate = g_try_malloc(length);
+  if (filtered == NULL || candidate == NULL) {
+    frame->zerr = Z_MEM_ERROR;
+    goto out;
+  }
+
+  /* Each row keeps the filter with the smallest sum of absolute values. */
+  for (gsize y = 0; y < height; ++y) {
+    const guint8* row  = frame->pixels + y * length;
+    const guint8* prev = y > 0 ? row - length : NULL;
+    guint8*       out  = filtered + y * (length + 1);
+    guint         best = G_MAXUINT;
+
+    for (guint8 filter_type = 0; filter_type < 5; ++filter_type) {
+      guint sum = apng_filter_row(candidate, row, prev, filter_type,
+                                  saver->bpp, length);
+      if (sum < best) {
+        best   = sum;
+        out[0] = filter_type;
+        memcpy(out + 1, candidate, length);
+      }
+    }
+  }
+
+  memset(&zstream, 0, sizeof(zstream));
+  frame->zerr = deflateInit2(&zstream, saver->compression, Z_DEFLATED, 15, 8,
+                             Z_FILTERED);
+  if (frame->zerr != Z_OK)
+    goto out;
+
+  frame->size = deflateBound(&zstream, (length + 1) * height);
+  frame->data = g_try_malloc(frame->size);
+  if (frame->data == NULL) {
+    frame->zerr = Z_MEM_ERROR;
+    deflateEnd(&zstream);
+    goto out;
+  }
+
+  zstream.next_in   = filtered;
+  zstream.avail_in  = (length + 1) * height;
+  zstream.next_out  = frame->data;
+  zstream.avail_out = frame->size;
+  frame->zerr       = deflate(&zstream, Z_FINISH);
+  frame->size -= zstream.avail_out;
+  deflateEnd(&zstream);
+
+  if (frame->zerr == Z_STREAM_END)
+    frame->zerr = Z_OK;
+  else if (frame->zerr == Z_OK)
+    frame->zerr = Z_BUF_ERROR;
+
+out:
+  g_free(candidate);
+  g_free(filtered);
+  g_clear_pointer(&frame->pixels, g_free);
+}
+
+/* Canvas pixels are RGBA bytes, with fully transparent pixels normalized to
+ * zero so that they compare equal whatever their colour.
+ */
+static void apng_save_load_pixels(GdkPixbuf* pixbuf, guint32* canvas) {
+  gint          width      = gdk_pixbuf_get_width(pixbuf);
+  gint          height     = gdk_pixbuf_get_height(pixbuf);
+  gint          rowstride  = gdk_pixbuf_get_rowstride(pixbuf);
+  gint          n_channels = gdk_pixbuf_get_n_channels(pixbuf);
+  const guchar* pixels     = gdk_pixbuf_read_pixels(pixbuf);
+
+  for (gint y = 0; y < height; ++y) {
+    const guchar* s = pixels + y * rowstride;
+    guint8*       d = (guint8*)(canvas + y * width);
+
+    for (gint x = 0; x < width; ++x, s += n_channels, d += 4) {
+      if (n_channels == 4 && s[3] == 0) {
+        memset(d, 0, 4);
+        continue;
+      }
+      d[0] = s[0];
+      d[1] = s[1];
+      d[2] = s[2];
+      d[3] = n_channels == 4 ? s[3] : 0xff;
+    }
+  }
+}
+
+static gboolean apng_save_is_opaque(GdkPixbuf* pixbuf) {
+  gint          width     = gdk_pixbuf_get_width(pixbuf);
+  gint          height    = gdk_pixbuf_get_height(pixbuf);
+  gint          rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+  const guchar* pixels    = gdk_pixbuf_read_pixels(pixbuf);
+
+  if (!gdk_pixbuf_get_has_alpha(pixbuf))
+    return TRUE;
+
+  for (gint y = 0; y < height; ++y)
+    for (gint x = 0; x < width; ++x)
+      if (pixels[y * rowstride + x * 4 + 3] != 0xff)
+        return FALSE;
+
+  return TRUE;
+}
+
+/* Bounding box of the pixels that differ between base and image, pixels of
+ * base inside cleared, if any, are taken as fully transparent.
+ */
+static GdkPixbufApngRect
+apng_save_diff(const ApngSaver* saver, const guint32* base,
+               const guint32* image, const GdkPixbufApngRect* cleared) {
+  GdkPixbufApngRect rect = {0, 0, 0, 0};
+  gint              x1   = saver->width;
+  gint              y1   = saver->height;
+  gint              x2   = -1;
+  gint              y2   = -1;
+
+  for (gint y = 0; y < saver->height; ++y) {
+    const guint32* b = base + y * saver->width;
+    const guint32* i = image + y * saver->width;
+    gboolean       in_rows =
+        cleared != NULL && y >= cleared->y && y < cleared->y + cleared->height;
+
+    for (gint x = 0; x < saver->width; ++x) {
+      guint32 pixel = b[x];
+
+      if (in_rows && x >= cleared->x && x < cleared->x + cleared->width)
+        pixel = 0;
+      if (pixel == i[x])
+        continue;
+
+      x1 = MIN(x1, x);
+      x2 = MAX(x2, x);
+      y1 = MIN(y1, y);
+      y2 = y;
+    }
+  }
+
+  if (x2 >= 0) {
+    rect.x      = x1;
+    rect.y      = y1;
+    rect.width  = x2 - x1 + 1;
+    rect.height = y2 - y1 + 1;
+  }
+
+  return rect;
+}
+
+/* Copies the frame area of image out of the canvas. With OVER blending the
+ * pixels unchanged from base are left fully transparent, which compresses
+ * better.
+ */
+static guchar* apng_save_extract(const ApngSaver* saver, const guint32* base,
+                                 const guint32* image,
+                                 const ApngChunk_fcTL* fctl) {
+  gsize   length = fctl->width * saver->bpp;
+  guchar* pixels = g_try_malloc(length * fctl->height);
+
+  if (pixels == NULL)
+    return NULL;
+
+  for (guint y = 0; y < fctl->height; ++y) {
+    gsize offset = (fctl->y_offset + y) * saver->width + fctl->x_offset;
+    const guint32* b = base + offset;
+    const guint32* i = image + offset;
+    guchar*        d = pixels + y * length;
+
+    for (guint x = 0; x < fctl->width; ++x, d += saver->bpp) {
+      guint32 pixel = i[x];
+
+      if (fctl->blend_op == APNG_BLEND_OP_OVER && pixel == b[x])
+        pixel = 0;
+      memcpy(d, &pixel, saver->bpp);
+    }
+  }
+
+  return pixels;
+}
+
+/* Whether every pixel that changed is opaque, OVER then gives the same
+ * result as SOURCE.
+ */
+static gboolean apng_save_can_blend_over(const ApngSaver*         saver,
+                                         const guint32*           base,
+                                         const guint32*           image,
+                                         const GdkPixbufApngRect* rect) {
+  if (saver->colour_type != 6)
+    return FALSE;
+
+  for (gint y = rect->y; y < rect->y + rect->height; ++y) {
+    for (gint x = rect->x; x < rect->x + rect->width; ++x) {
+      guint32 pixel = image[y * saver->width + x];
+
+      if (pixel != base[y * saver->width + x] &&
+          ((const guint8*)&pixel)[3] != 0xff)
+        return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+static gboolean apng_save_write(GdkPixbufSaveFunc save_func,
+                                gpointer user_data, const void* buf,
+                                gsize size, guint32* crc, GError** error) {
+  if (crc != NULL)
+    *crc = crc32(*crc, buf, size);
+  return (*save_func)(buf, size, error, user_data);
+}
+
+/* Writes a chunk, fdAT chunks get their sequence number prepended. */
+static gboolean apng_save_chunk(GdkPixbufSaveFunc save_func,
+                                gpointer user_data, guint32 chunk_type,
+                                const guint32* sequence_number,
+                                const void* data, gsize size,
+                                GError** error) {
+  guint32 crc = crc32(0, NULL, 0);
+  guint32 header[2];
+  guint32 be;
+
+  header[0] = GUINT32_TO_BE(size + (sequence_number != NULL ? 4 : 0));
+  header[1] = GUINT32_TO_BE(chunk_type);
+  if (!apng_save_write(save_func, user_data, &header[0], 4, NULL, error) ||
+      !apng_save_write(save_func, user_data, &header[1], 4, &crc, error))
+    return FALSE;
+
+  if (sequence_number != NULL) {
+    be = GUINT32_TO_BE(*sequence_number);
+    if (!apng_save_write(save_func, user_data, &be, 4, &crc, error))
+      return FALSE;
+  }
+
+  if (size > 0 &&
+      !apng_save_write(save_func, user_data, data, size, &crc, error))
+    return FALSE;
+
+  be = GUINT32_TO_BE(crc);
+  return apng_save_write(save_func, user_data, &be, 4, NULL, error);
+}
+
+static gboolean apng_save_frames(GdkPixbufSaveFunc save_func,
+                                 gpointer user_data, const ApngSaver* saver,
+                                 GPtrArray* frames, guint num_plays,
+                                 GError** error) {
+  ApngChunk_IHDR ihdr;
+  ApngChunk_acTL actl;
+  guint64        apng_header     = GUINT64_TO_BE(0x89504e470d0a1a0a);
+  guint32        sequence_number = 0;
+
+  if (!(*save_func)((const gchar*)&apng_header, sizeof(apng_header), error,
+                    user_data))
+    return FALSE;
+
+  ihdr.width              = GUINT32_TO_BE(saver->width);
+  ihdr.height             = GUINT32_TO_BE(saver->height);
+  ihdr.bit_depth          = 8;
+  ihdr.colour_type        = saver->colour_type;
+  ihdr.compression_method = 0;
+  ihdr.filter_method      = 0;
+  ihdr.interlace_method   = 0;
+  if (!apng_save_chunk(save_func, user_data, APNG_CHUNK_IHDR, NULL, &ihdr,
+                       sizeof(ihdr), error))
+    return FALSE;
+
+  actl.num_frames = GUINT32_TO_BE(frames->len);
+  actl.num_plays  = GUINT32_TO_BE(num_plays);
+  if (!apng_save_chunk(save_func, user_data, APNG_CHUNK_acTL, NULL, &actl,
+                       sizeof(actl), error))
+    return FALSE;
+
+  for (guint i = 0; i < frames->len; ++i) {
+    ApngSaveFrame* frame = g_ptr_array_index(frames, i);
+    ApngChunk_fcTL fctl  = frame->fctl;
+
+    /* Milliseconds fit 16 bits up to a minute, longer delays lose
+     * precision.
+     */
+    if (frame->delay <= G_MAXUINT16) {
+      fctl.delay_num = frame->delay;
+      fctl.delay_den = 1000;
+    } else if (frame->delay / 10 <= G_MAXUINT16) {
+      fctl.delay_num = frame->delay / 10;
+      fctl.delay_den = 100;
+    } else {
+      fctl.delay_num = MIN(frame->delay / 1000, G_MAXUINT16);
+      fctl.delay_den = 1;
+    }
+
+    fctl.sequence_number = GUINT32_TO_BE(sequence_number++);
+    fctl.width           = GUINT32_TO_BE(fctl.width);
+    fctl.height          = GUINT32_TO_BE(fctl.height);
+    fctl.x_offset        = GUINT32_TO_BE(fctl.x_offset);
+    fctl.y_offset        = GUINT32_TO_BE(fctl.y_offset);
+    fctl.delay_num       = GUINT16_TO_BE(fctl.delay_num);
+    fctl.delay_den       = GUINT16_TO_BE(fctl.delay_den);
+    if (!apng_save_chunk(save_func, user_data, APNG_CHUNK_fcTL, NULL, &fctl,
+                         sizeof(fctl), error))
+      return FALSE;
+
+    /* The first frame doubles as the default image. */
+    if (i == 0) {
+      if (!apng_save_chunk(save_func, user_data, APNG_CHUNK_IDAT, NULL,
+                           frame->data, frame->size, error))
+        return FALSE;
+    } else {
+      if (!apng_save_chunk(save_func, user_data, APNG_CHUNK_fdAT,
+                           &sequence_number, frame->data, frame->size, error))
+        return FALSE;
+      sequence_number++;
+    }
+  }
+
+  return apng_save_chunk(save_func, user_data, APNG_CHUNK_IEND, NULL, NULL, 0,
+                         error);
+}
+
+gboolean gdk_pixbuf_apng_save_to_callback(GdkPixbufSaveFunc save_func,
+                                          gpointer          user_data,
+                                          GdkPixbuf* const* pixbufs,
+                                          const gint*       delays,
+                                          gsize n_frames, guint num_plays,
+                                          gint compression, GError** error) {
+  ApngSaver    saver;
+  GPtrArray*   frames;
+  GThreadPool* pool = NULL;
+  guint32*     image;
+  guint32*     prev_image;
+  guint32*     base;
+  gboolean     retval = FALSE;
+
+  g_return_val_if_fail(save_func != NULL, FALSE);
+  g_return_val_if_fail(pixbufs != NULL && n_frames > 0, FALSE);
+  g_return_val_if_fail(delays != NULL, FALSE);
+  g_return_val_if_fail(compression >= -1 && compression <= 9, FALSE);
+
+  saver.width       = gdk_pixbuf_get_width(pixbufs[0]);
+  saver.height      = gdk_pixbuf_get_height(pixbufs[0]);
+  saver.colour_type = 2;
+  saver.compression = compression;
+  for (gsize i = 0; i < n_frames; ++i) {
+    g_return_val_if_fail(gdk_pixbuf_get_width(pixbufs[i]) == saver.width,
+                         FALSE);
+    g_return_val_if_fail(gdk_pixbuf_get_height(pixbufs[i]) == saver.height,
+                         FALSE);
+    g_return_val_if_fail(gdk_pixbuf_get_bits_per_sample(pixbufs[i]) == 8,
+                         FALSE);
+
+    if (saver.colour_type == 2 && !apng_save_is_opaque(pixbufs[i]))
+      saver.colour_type = 6;
+  }
+  saver.bpp = saver.colour_type == 6 ? 4 : 3;
+
+  image      = g_try_new0(guint32, (gsize)saver.width * saver.height);
+  prev_image = g_try_new0(guint32, (gsize)saver.width * saver.height);
+  base       = g_try_new0(guint32, (gsize)saver.width * saver.height);
+  frames     = g_ptr_array_new_with_free_func(apng_save_frame_free);
+  if (image == NULL || prev_image == NULL || base == NULL)
+    goto oom;
+
+  /* Frames are planned in order, each against the canvas left by the
+   * previous one, and compressed on the pool meanwhile.
+   */
+  if (n_frames > 1)
+    pool = g_thread_pool_new(apng_save_compress, &saver,
+                             g_get_num_processors(), FALSE, NULL);
+
+  for (gsize i = 0; i < n_frames; ++i) {
+    ApngSaveFrame*    frame;
+    ApngSaveFrame*    prev = NULL;
+    GdkPixbufApngRect rect = {0, 0, saver.width, saver.height};
+
+    apng_save_load_pixels(pixbufs[i], image);
+
+    if (i > 0) {
+      GdkPixbufApngRect prev_rect;
+      GdkPixbufApngRect candidates[3];
+      guint8            dispose_op = APNG_DISPOSE_OP_NONE;
+
+      prev             = g_ptr_array_index(frames, frames->len - 1);
+      prev_rect.x      = prev->fctl.x_offset;
+      prev_rect.y      = prev->fctl.y_offset;
+      prev_rect.width  = prev->fctl.width;
+      prev_rect.height = prev->fctl.height;
+
+      candidates[APNG_DISPOSE_OP_NONE] =
+          apng_save_diff(&saver, prev_image, image, NULL);
+      if (candidates[APNG_DISPOSE_OP_NONE].width == 0) {
+        prev->delay += MAX(delays[i], 0);
+        continue;
+      }
+
+      /* Picks the disposal of the previous frame that leaves the smallest
+       * area to update. The first frame can't restore what was before it.
+       */
+      candidates[APNG_DISPOSE_OP_BACKGROUND] =
+          apng_save_diff(&saver, prev_image, image, &prev_rect);
+      if (frames->len > 1)
+        candidates[APNG_DISPOSE_OP_PREVIOUS] =
+            apng_save_diff(&saver, base, image, NULL);
+
+      for (guint8 op = 1; op < (frames->len > 1 ? 3 : 2); ++op) {
+        if (candidates[op].width * candidates[op].height <
+            candidates[dispose_op].width * candidates[dispose_op].height)
+          dispose_op = op;
+      }
+      prev->fctl.dispose_op = dispose_op;
+
+      rect = candidates[dispose_op];
+      if (rect.width == 0) {
+        rect.width  = 1;
+        rect.height = 1;
+      }
+
+      if (dispose_op != APNG_DISPOSE_OP_PREVIOUS) {
+        guint32* tmp = base;
+        base         = prev_image;
+        prev_image   = tmp;
+      }
+      if (dispose_op == APNG_DISPOSE_OP_BACKGROUND) {
+        for (gint y = prev_rect.y; y < prev_rect.y + prev_rect.height; ++y)
+          memset(base + y * saver.width + prev_rect.x, 0,
+                 prev_rect.width * sizeof(guint32));
+      }
+    }
+
+    frame = g_try_new0(ApngSaveFrame, 1);
+    if (frame == NULL)
+      goto oom;
+    g_ptr_array_add(frames, frame);
+
+    frame->fctl.x_offset   = rect.x;
+    frame->fctl.y_offset   = rect.y;
+    frame->fctl.width      = rect.width;
+    frame->fctl.height     = rect.height;
+    frame->fctl.dispose_op = APNG_DISPOSE_OP_NONE;
+    frame->fctl.blend_op   = APNG_BLEND_OP_SOURCE;
+    if (i > 0 && apng_save_can_blend_over(&saver, base, image, &rect))
+      frame->fctl.blend_op = APNG_BLEND_OP_OVER;
+    frame->delay = MAX(delays[i], 0);
+
+    frame->pixels = apng_save_extract(&saver, base, image, &frame->fctl);
+    if (frame->pixels == NULL)
+      goto oom;
+
+    if (pool == NULL || !g_thread_pool_push(pool, frame, NULL))
+      apng_save_compress(frame, &saver);
+
+    {
+      guint32* tmp = prev_image;
+      prev_image   = image;
+      image        = tmp;
+    }
+  }
+
+  if (pool != NULL) {
+    g_thread_pool_free(pool, FALSE, TRUE);
+    pool = NULL;
+  }
+
+  for (guint i = 0; i < frames->len; ++i) {
+    ApngSaveFrame* frame = g_ptr_array_index(frames, i);
+
+    if (frame->zerr == Z_MEM_ERROR)
+      goto oom;
+    if (frame->zerr != Z_OK) {
+      g_set_error_literal(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                          "Error while compressing a frame in APNG file");
+      goto out;
+    }
+  }
+
+  retval =
+      apng_save_frames(save_func, user_data, &saver, frames, num_plays, error);
+  goto out;
+
+oom:
+  g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                      GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                      "Not enough memory to save APNG file");
+
+out:
+  if (pool != NULL)
+    g_thread_pool_free(pool, FALSE, TRUE);
+  g_ptr_array_free(frames, TRUE);
+  g_free(base);
+  g_free(prev_image);
+  g_free(image);
+
+  return retval;
+}
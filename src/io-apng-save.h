@@ -0,0 +1,22 @@
+#ifndef IO_APNG_SAVE_H
+#define IO_APNG_SAVE_H
+
+#include "io-apng.h"
+
+/* Writes frames, pixbufs of identical size, as an APNG animation through
+ * save_func. Delays are in milliseconds, num_plays is 0 for an infinite
+ * loop and compression is a zlib level, -1 for the default.
+ *
+ * Each frame only stores the area that changed since the previous one,
+ * using whichever dispose and blend ops make that area the smallest.
+ * Identical consecutive frames are merged. Frames are compressed in
+ * parallel.
+ */
+gboolean gdk_pixbuf_apng_save_to_callback(GdkPixbufSaveFunc save_func,
+                                          gpointer          user_data,
+                                          GdkPixbuf* const* frames,
+                                          const gint*       delays,
+                                          gsize n_frames, guint num_plays,
+                                          gint compression, GError** error);
+
+#endif // IO_APNG_SAVE_H
@@ -1,9 +1,70 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <zlib.h>
 
 #include "io-apng-animation.h"
+#include "io-apng-cache.h"
+#include "io-apng-save.h"
+
+G_LOCK_DEFINE_STATIC(chunk_func);
+static guint32*               chunk_func_types   = NULL;
+static gsize                  chunk_func_n_types = 0;
+static GdkPixbufApngChunkFunc chunk_func         = NULL;
+static gpointer               chunk_func_data    = NULL;
+
+G_LOCK_DEFINE_STATIC(decode_limits);
+static GdkPixbufApngLimits decode_limits = {0};
+
+static gint verify_crc = FALSE;
+
+void gdk_pixbuf_apng_set_chunk_func(const gchar* const*    chunk_types,
+                                    GdkPixbufApngChunkFunc func,
+                                    gpointer               user_data) {
+  guint32* types;
+  gsize    n_types = 0;
+
+  while (func != NULL && chunk_types != NULL && chunk_types[n_types] != NULL) {
+    g_return_if_fail(strlen(chunk_types[n_types]) == 4);
+    n_types++;
+  }
+
+  types = g_new(guint32, n_types);
+  for (gsize i = 0; i < n_types; ++i) {
+    const gchar* t = chunk_types[i];
+    types[i]       = APNG_FOURCC(t[0], t[1], t[2], t[3]);
+  }
+
+  G_LOCK(chunk_func);
+  g_free(chunk_func_types);
+  chunk_func_types   = types;
+  chunk_func_n_types = n_types;
+  chunk_func         = func;
+  chunk_func_data    = user_data;
+  G_UNLOCK(chunk_func);
+}
+
+void gdk_pixbuf_apng_set_limits(const GdkPixbufApngLimits* limits) {
+  G_LOCK(decode_limits);
+  if (limits != NULL)
+    decode_limits = *limits;
+  else
+    memset(&decode_limits, 0, sizeof(decode_limits));
+  G_UNLOCK(decode_limits);
+}
+
+void gdk_pixbuf_apng_get_limits(GdkPixbufApngLimits* limits) {
+  g_return_if_fail(limits != NULL);
+
+  G_LOCK(decode_limits);
+  *limits = decode_limits;
+  G_UNLOCK(decode_limits);
+}
+
+void gdk_pixbuf_apng_set_verify_crc(gboolean verify) {
+  g_atomic_int_set(&verify_crc, !!verify);
+}
 
 static gpointer
 gdk_pixbuf__apng_image_begin_load(GdkPixbufModuleSizeFunc     size_func,
@@ -33,461 +94,408 @@ gdk_pixbuf__apng_image_begin_load(GdkPixbufModuleSizeFunc     size_func,
   ctx->update_func  = update_func;
   ctx->user_data    = user_data;
 
+  ctx->buf_size = 8;
+  ctx->buf      = g_malloc(ctx->buf_size);
+
+  G_LOCK(chunk_func);
+  ctx->n_chunk_types = chunk_func_n_types;
+  ctx->chunk_types =
+      g_memdup2(chunk_func_types, chunk_func_n_types * sizeof(guint32));
+  ctx->chunk_func = chunk_func;
+  ctx->chunk_data = chunk_func_data;
+  G_UNLOCK(chunk_func);
+
+  gdk_pixbuf_apng_get_limits(&ctx->limits);
+  ctx->verify_crc = g_atomic_int_get(&verify_crc);
+
+  if (gdk_pixbuf_apng_cache_is_enabled()) {
+    ctx->cache_hash = g_checksum_new(G_CHECKSUM_SHA256);
+    ctx->cache_data = g_byte_array_new();
+  }
+
   return (gpointer)ctx;
 
 error:
   g_clear_object(&ctx->anim);
-  g_free(ctx->frame);
   g_free(ctx->buf);
   g_free(ctx);
   return NULL;
 }
 
+static gboolean apng_cache_finish(ApngContext* ctx, GError** error);
+
+/* Fails unless every frame announced by acTL was decoded. */
+static gboolean apng_check_complete(ApngContext* ctx, GError** error) {
+  if (ctx->header_only || (ctx->anim->n_decoded > 0 &&
+                           ctx->anim->n_decoded >= ctx->anim->actl.num_frames))
+    return TRUE;
+
+  g_set_error_literal(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                      "APNG image was truncated or incomplete.");
+  return FALSE;
+}
+
 static gboolean gdk_pixbuf__apng_image_stop_load(gpointer context,
                                                  GError** error) {
   ApngContext* ctx    = context;
   gboolean     retval = TRUE;
 
-  if (ctx->anim->frames == NULL ||
-      ctx->anim->n_frames < ctx->anim->actl.num_frames) {
-    g_set_error_literal(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
-                        "APNG image was truncated or incomplete.");
-
+  if (ctx->cache_hash != NULL && !apng_cache_finish(ctx, error)) {
+    retval = FALSE;
+  } else if (!apng_check_complete(ctx, error)) {
     retval = FALSE;
+  } else if (ctx->cache_hash != NULL && !ctx->header_only &&
+             !ctx->cache_hit) {
+    gdk_pixbuf_apng_cache_insert(g_checksum_get_string(ctx->cache_hash),
+                                 ctx->cache_prefix, ctx->anim);
   }
 
+  g_clear_pointer(&ctx->cache_hash, g_checksum_free);
+  g_clear_pointer(&ctx->cache_data, g_byte_array_unref);
+  g_free(ctx->cache_prefix);
   g_clear_object(&ctx->anim);
-  g_free(ctx->frame);
+  g_clear_pointer(&ctx->frame, gdk_pixbuf_apng_frame_unref);
+  if (ctx->compositor != NULL) {
+    gdk_pixbuf_apng_compositor_clear(ctx->compositor);
+    g_free(ctx->compositor);
+  }
+  g_clear_object(&ctx->band);
+  gdk_pixbuf_apng_colour_clear(&ctx->colour);
+  if (ctx->zstream_init)
+    inflateEnd(&ctx->zstream);
+  g_free(ctx->scratch);
+  g_free(ctx->chunk_types);
   g_free(ctx->buf);
   g_free(ctx);
 
   return retval;
 }
 
-static gboolean apng_decompress_3(ApngContext* ctx, GdkPixbufApngFrame* frame,
-                                  const guchar* buf, guint size, int* zerr) {
-  uLongf dsize;
-
-  *zerr = Z_OK;
-  if (frame->buf == NULL) {
-    frame->buf  = gdk_pixbuf_get_pixels(frame->pixbuf);
-    frame->off  = 0;
-    frame->size = gdk_pixbuf_get_byte_length(frame->pixbuf);
+static gboolean apng_unfilter_row(guint8* row, const guint8* prev,
+                                  guint8 filter_type, gsize bpp,
+                                  gsize length) {
+  if (filter_type == 0) {
+  } else if (filter_type == 1) {
+    for (gsize x = bpp; x < length; ++x)
+      row[x] += row[x - bpp];
+  } else if (filter_type == 2) {
+    if (prev != NULL)
+      for (gsize x = 0; x < length; ++x)
+        row[x] += prev[x];
+  } else if (filter_type == 3) {
+    for (gsize x = 0; x < length; ++x) {
+      guint8 a = x >= bpp ? row[x - bpp] : 0;
+      guint8 b = prev != NULL ? prev[x] : 0;
+      row[x] += (a + b) / 2;
+    }
+  } else if (filter_type == 4) {
+    for (gsize x = 0; x < length; ++x) {
+      guint8 a  = x >= bpp ? row[x - bpp] : 0;
+      guint8 b  = prev != NULL ? prev[x] : 0;
+      guint8 c  = prev != NULL && x >= bpp ? prev[x - bpp] : 0;
+      gint   p  = a + b - c;
+      guint  pa = abs(p - a);
+      guint  pb = abs(p - b);
+      guint  pc = abs(p - c);
+      if (pa <= pb && pa <= pc)
+        row[x] += a;
+      else if (pb <= pc)
+        row[x] += b;
+      else
+        row[x] += c;
+    }
+  } else {
+    return FALSE;
   }
 
-  dsize = frame->size - frame->off;
-  *zerr = uncompress(frame->buf + frame->off, &dsize, buf, size);
-  if (*zerr != Z_OK)
+  return TRUE;
+}
+
+static gboolean apng_row_is_opaque(ApngContext* ctx, const guint8* row,
+                                   gsize width) {
+  switch (ctx->anim->ihdr.colour_type) {
+  case 2:
+    if (!ctx->trns.present)
+      return TRUE;
+    for (gsize x = 0; x < width; ++x)
+      if (memcmp(&row[x * 3], ctx->trns.rgb, 3) == 0)
+        return FALSE;
+    return TRUE;
+  case 3:
+    if (ctx->plte.opaque)
+      return TRUE;
+    for (gsize x = 0; x < width; ++x)
+      if ((ctx->plte.rgba[row[x]] >> 24) != 0xff)
+        return FALSE;
+    return TRUE;
+  case 6:
+    for (gsize x = 0; x < width; ++x)
+      if (row[x * 4 + 3] != 0xff)
+        return FALSE;
+    return TRUE;
+  default:
+    g_assert(FALSE);
     return FALSE;
-  frame->off += dsize;
+  }
+}
 
-  gsize const height = frame->fctl.height;
-  gsize const width  = frame->fctl.width;
+static void apng_convert_row(ApngContext* ctx, guint8* pixel,
+                             const guint8* row, gsize width, gboolean opaque) {
+  guint8* start = pixel;
 
-  if (frame->off == height * (width + 1)) {
-    guint8*  index = (guint8*)frame->buf;
-    guint32* pixel = (guint32*)index;
+  switch (ctx->anim->ihdr.colour_type) {
+  case 2:
+    if (opaque) {
+      memcpy(pixel, row, width * 3);
+    } else {
+      for (gsize x = 0; x < width; ++x, row += 3, pixel += 4) {
+        pixel[0] = row[0];
+        pixel[1] = row[1];
+        pixel[2] = row[2];
+        pixel[3] = memcmp(row, ctx->trns.rgb, 3) == 0 ? 0x00 : 0xff;
+      }
+    }
+    break;
+  case 3:
+    for (gsize x = 0; x < width; ++x) {
+      guint32 rgba = ctx->plte.rgba[row[x]];
+      *pixel++     = rgba >> 0;
+      *pixel++     = rgba >> 8;
+      *pixel++     = rgba >> 16;
+      if (!opaque)
+        *pixel++ = rgba >> 24;
+    }
+    break;
+  case 6:
+    if (opaque) {
+      for (gsize x = 0; x < width; ++x, row += 4, pixel += 3) {
+        pixel[0] = row[0];
+        pixel[1] = row[1];
+        pixel[2] = row[2];
+      }
+    } else {
+      memcpy(pixel, row, width * 4);
+    }
+    break;
+  default:
+    g_assert(FALSE);
+    break;
+  }
+
+  /* Palettes are corrected once, when the PLTE chunk arrives. */
+  if (ctx->anim->ihdr.colour_type != 3)
+    gdk_pixbuf_apng_colour_apply(&ctx->colour, start, width, opaque ? 3 : 4);
+}
 
-    for (gssize y = height - 1; y >= 0; --y) {
-      guint8 filter_type = index[y * (width + 1)];
-      g_assert(filter_type == 0);
+/* Hands rows y to y + n_rows - 1 of the band over. */
+static void apng_band_flush(ApngContext* ctx, GdkPixbufApngFrame* frame,
+                            guint y, guint n_rows) {
+  GdkPixbuf* band;
 
-      for (gssize x = width - 1; x >= 0; --x)
-        pixel[y * width + x] = ctx->plte.rgba[index[y * (width + 1) + x + 1]];
+  if (frame->fctl.width < (guint)gdk_pixbuf_get_width(ctx->band) ||
+      n_rows < (guint)gdk_pixbuf_get_height(ctx->band))
+    band = gdk_pixbuf_new_subpixbuf(ctx->band, 0, 0, frame->fctl.width, n_rows);
+  else
+    band = g_object_ref(ctx->band);
+
+  (*ctx->band_func)(ctx->anim->n_decoded, &frame->fctl, band, y,
+                    ctx->band_data);
+  g_object_unref(band);
+}
+
+/* Strip mode, rows are unfiltered and converted as soon as they are
+ * inflated. The scratch buffer only holds the current and previous rows.
+ */
+static gboolean apng_decompress_rows(ApngContext*        ctx,
+                                     GdkPixbufApngFrame* frame, gsize bpp,
+                                     gsize stride, int* zerr) {
+  guint8* pixels    = gdk_pixbuf_get_pixels(ctx->band);
+  gsize   rowstride = gdk_pixbuf_get_rowstride(ctx->band);
+
+  while (ctx->zstream.avail_in > 0 && frame->off < frame->size) {
+    gsize   y    = frame->off / stride;
+    gsize   col  = frame->off % stride;
+    guint8* row  = ctx->scratch + (y % 2) * stride;
+    guint8* prev = y > 0 ? ctx->scratch + ((y + 1) % 2) * stride + 1 : NULL;
+    guint   band_row;
+
+    ctx->zstream.next_out  = row + col;
+    ctx->zstream.avail_out = stride - col;
+    *zerr                  = inflate(&ctx->zstream, Z_NO_FLUSH);
+    if (*zerr != Z_OK && *zerr != Z_STREAM_END)
+      return FALSE;
+    frame->off += stride - col - ctx->zstream.avail_out;
+
+    if (ctx->zstream.avail_out == 0) {
+      if (!apng_unfilter_row(row + 1, prev, row[0], bpp, stride - 1)) {
+        *zerr = Z_DATA_ERROR;
+        return FALSE;
+      }
+
+      band_row = y % ctx->band_height;
+      apng_convert_row(ctx, pixels + band_row * rowstride, row + 1,
+                       frame->fctl.width, FALSE);
+      if (band_row + 1 == ctx->band_height || y + 1 == frame->fctl.height)
+        apng_band_flush(ctx, frame, y - band_row, band_row + 1);
     }
 
-    frame->off = frame->size;
+    if (*zerr == Z_STREAM_END)
+      break;
   }
 
+  if (*zerr == Z_STREAM_END && frame->off != frame->size) {
+    *zerr = Z_DATA_ERROR;
+    return FALSE;
+  }
+  *zerr = Z_OK;
+
   return TRUE;
 }
 
-static gboolean apng_decompress_6(ApngContext* ctx, GdkPixbufApngFrame* frame,
-                                  const guchar* buf, guint size, int* zerr) {
-  uLongf dsize;
-
+static gboolean apng_decompress(ApngContext* ctx, GdkPixbufApngFrame* frame,
+                                const guchar* buf, guint size, int* zerr) {
   gsize const height = frame->fctl.height;
   gsize const width  = frame->fctl.width;
+  gsize const bpp    = ctx->anim->ihdr.colour_type == 2   ? 3
+                       : ctx->anim->ihdr.colour_type == 6 ? 4
+                                                          : 1;
+  gsize const stride = width * bpp + 1;
 
   *zerr = Z_OK;
-  if (frame->buf == NULL) {
-    frame->size = height * (width * 4 + 1);
-    frame->buf  = g_malloc(frame->size);
+  if (frame->size == 0) {
+    gdk_pixbuf_apng_colour_prepare(&ctx->colour);
+
+    /* Filtered rows are inflated into a scratch buffer shared by all the
+     * frames, the pixbuf is only allocated once we know whether the frame
+     * needs an alpha channel.
+     */
+    gsize scratch_size = ctx->band_func != NULL ? 2 * stride : height * stride;
+
+    frame->size = height * stride;
     frame->off  = 0;
-  }
+    if (ctx->scratch_size < scratch_size) {
+      g_free(ctx->scratch);
+      ctx->scratch_size = 0;
+      ctx->scratch      = g_try_malloc(scratch_size);
+      if (ctx->scratch == NULL) {
+        *zerr = Z_MEM_ERROR;
+        return FALSE;
+      }
+      ctx->scratch_size = scratch_size;
+    }
 
-  dsize = frame->size - frame->off;
-  *zerr = uncompress(frame->buf + frame->off, &dsize, buf, size);
-  if (*zerr != Z_OK)
-    return FALSE;
-  frame->off += dsize;
-
-  if (frame->off == frame->size) {
-    guint8* buffer = (guint8*)frame->buf;
-    guint8* pixel  = (guint8*)gdk_pixbuf_get_pixels(frame->pixbuf);
-
-    for (gsize y = 0; y < height; ++y) {
-      guint8 filter_type = buffer[y * (width * 4 + 1)];
-      memcpy(&pixel[y * width * 4], &buffer[y * (width * 4 + 1) + 1],
-             width * 4);
-
-      gsize dx = ctx->anim->ihdr.bit_depth >= 8
-                     ? 4 * ctx->anim->ihdr.bit_depth / 8
-                     : 1;
-      gsize dy = width * dx;
-      if (filter_type == 0) {
-      } else if (filter_type == 1) {
-        for (gsize x = 0; x < dy; ++x) {
-          guint8 a = x > 3 ? pixel[y * dy + x - dx] : 0;
-          pixel[y * dy + x] += a;
-        }
-      } else if (filter_type == 2) {
-        for (gsize x = 0; x < dy; ++x) {
-          guint8 b = y > 0 ? pixel[y * dy + x - dy] : 0;
-          pixel[y * dy + x] += b;
-        }
-      } else if (filter_type == 3) {
-        for (gsize x = 0; x < dy; ++x) {
-          guint8 a = x > 3 ? pixel[y * dy + x - dx] : 0;
-          guint8 b = y > 0 ? pixel[y * dy + x - dy] : 0;
-          pixel[y * dy + x] += (a + b) / 2;
-        }
-      } else if (filter_type == 4) {
-        for (gsize x = 0; x < dy; ++x) {
-          guint8 a  = x > 3 ? pixel[y * dy + x - dx] : 0;
-          guint8 b  = y > 0 ? pixel[y * dy + x - dy] : 0;
-          guint8 c  = y > 0 && x > 3 ? pixel[y * dy + x - dx - dy] : 0;
-          gint   p  = a + b - c;
-          guint  pa = abs(p - a);
-          guint  pb = abs(p - b);
-          guint  pc = abs(p - c);
-          if (pa <= pb && pa <= pc)
-            pixel[y * dy + x] += a;
-          else if (pb <= pc)
-            pixel[y * dy + x] += b;
-          else
-            pixel[y * dy + x] += c;
-        }
-      } else {
-        g_assert(FALSE);
+    /* A single band as wide as the canvas serves every frame, narrower
+     * and shorter ones get a view of it.
+     */
+    guint const band_width  = ctx->anim->ihdr.width;
+    guint const band_height = MIN(ctx->anim->ihdr.height, ctx->band_height);
+
+    if (ctx->band_func != NULL &&
+        (ctx->band == NULL ||
+         gdk_pixbuf_get_width(ctx->band) != (gint)band_width ||
+         gdk_pixbuf_get_height(ctx->band) != (gint)band_height)) {
+      g_clear_object(&ctx->band);
+      ctx->band = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, band_width,
+                                 band_height);
+      if (ctx->band == NULL) {
+        *zerr = Z_MEM_ERROR;
+        return FALSE;
       }
     }
 
-    g_free(frame->buf);
-    frame->buf = NULL;
+    if (!ctx->zstream_init) {
+      *zerr = inflateInit(&ctx->zstream);
+      if (*zerr != Z_OK)
+        return FALSE;
+      ctx->zstream_init = TRUE;
+    } else {
+      *zerr = inflateReset(&ctx->zstream);
+      if (*zerr != Z_OK)
+        return FALSE;
+    }
   }
 
-  return TRUE;
-}
+  /* Everything after the last row, zlib checksum included, is ignored. */
+  if (frame->off == frame->size)
+    return TRUE;
 
-static gboolean gdk_pixbuf__apng_image_load_increment(gpointer      context,
-                                                      const guchar* buf,
-                                                      guint         size,
-                                                      GError**      error) {
-  // printf("%s:%d (%s)\n", __FILE__, __LINE__, __func__);
-  int          zerr = Z_OK;
-  ApngContext* ctx  = context;
+  ctx->zstream.next_in  = (Bytef*)buf;
+  ctx->zstream.avail_in = size;
+  if (ctx->band_func != NULL)
+    return apng_decompress_rows(ctx, frame, bpp, stride, zerr);
 
-  ctx->buf = g_realloc(ctx->buf, ctx->size + size);
-  memcpy(ctx->buf + ctx->size, buf, size);
-  ctx->size += size;
+  ctx->zstream.next_out  = ctx->scratch + frame->off;
+  ctx->zstream.avail_out = frame->size - frame->off;
 
-  while (ctx->size >= 8) {
-    gsize offset = 0;
+  while (ctx->zstream.avail_in > 0 && ctx->zstream.avail_out > 0) {
+    *zerr = inflate(&ctx->zstream, Z_NO_FLUSH);
+    if (*zerr == Z_STREAM_END)
+      break;
+    if (*zerr != Z_OK)
+      return FALSE;
+  }
+  frame->off = frame->size - ctx->zstream.avail_out;
 
-    if (ctx->off == 0) {
-      guint64 apng_header;
-      memcpy(&apng_header, ctx->buf + offset, sizeof(apng_header));
-      offset += sizeof(apng_header);
+  if (*zerr == Z_STREAM_END && frame->off != frame->size) {
+    *zerr = Z_DATA_ERROR;
+    return FALSE;
+  }
+  *zerr = Z_OK;
 
-      g_assert(apng_header == GUINT64_TO_BE(0x89504e470d0a1a0a));
-    } else {
-      g_assert(ctx->off >= 8);
-
-      guint32 chunk_size;
-      memcpy(&chunk_size, ctx->buf + offset, 4);
-      offset += 4;
-
-      chunk_size = GUINT32_FROM_BE(chunk_size);
-      if (ctx->size < chunk_size + 12)
-        return TRUE;
-
-      char chunk_type[4];
-      memcpy(&chunk_type[0], ctx->buf + offset, 4);
-      offset += 4;
-
-      if (strncmp(chunk_type, "IHDR", 4) == 0) {
-        g_assert(chunk_size == 13);
-        g_assert(sizeof(ctx->anim->ihdr) == 13);
-
-        memcpy(&ctx->anim->ihdr, ctx->buf + offset, sizeof(ctx->anim->ihdr));
-        offset += sizeof(ctx->anim->ihdr);
-        ctx->anim->ihdr.width  = GUINT32_FROM_BE(ctx->anim->ihdr.width);
-        ctx->anim->ihdr.height = GUINT32_FROM_BE(ctx->anim->ihdr.height);
-
-        // printf(
-        //   "IHDR\n"
-        //   "  width: %d\n"
-        //   "  height: %d\n"
-        //   "  bit_depth: %d\n"
-        //   "  colour_type: %d\n"
-        //   "  compression_method: %d\n"
-        //   "  filter_method: %d\n"
-        //   "  interlace_method: %d\n",
-        //   ctx->anim->ihdr.width, ctx->anim->ihdr.height,
-        //   ctx->anim->ihdr.bit_depth, ctx->anim->ihdr.colour_type,
-        //   ctx->anim->ihdr.compression_method, ctx->anim->ihdr.filter_method,
-        //   ctx->anim->ihdr.interlace_method);
-        g_assert(ctx->anim->ihdr.bit_depth == 8);
-        // g_assert(ctx->anim->ihdr.colour_type == 3);
-        g_assert(ctx->anim->ihdr.compression_method == 0);
-        g_assert(ctx->anim->ihdr.filter_method == 0);
-        g_assert(ctx->anim->ihdr.interlace_method == 0);
-
-        if (ctx->size_func)
-          (*ctx->size_func)(&ctx->anim->ihdr.width, &ctx->anim->ihdr.height,
-                            ctx->user_data);
-
-      } else if (strncmp(chunk_type, "acTL", 4) == 0) {
-        g_assert(chunk_size == 8);
-        g_assert(sizeof(ctx->anim->actl) == 8);
-
-        g_assert(ctx->frame == NULL);
-        g_assert(ctx->anim->frames == NULL);
-
-        memcpy(&ctx->anim->actl, ctx->buf + offset, sizeof(ctx->anim->actl));
-        offset += sizeof(ctx->anim->actl);
-        ctx->anim->actl.num_frames =
-            GUINT32_FROM_BE(ctx->anim->actl.num_frames);
-        ctx->anim->actl.num_plays = GUINT32_FROM_BE(ctx->anim->actl.num_plays);
-
-        // printf(
-        //   "acTL\n"
-        //   "  num_frames: %d\n"
-        //   "  num_plays: %d\n",
-        //   ctx->anim->actl.num_frames, ctx->anim->actl.num_plays);
-
-      } else if (strncmp(chunk_type, "PLTE", 4) == 0) {
-        g_assert(chunk_size % 3 == 0);
-        g_assert(chunk_size / 3 <= 256);
-        g_assert(chunk_size / 3 > 1);
-        g_assert(ctx->anim->ihdr.colour_type == 3);
-
-        ctx->plte.size = chunk_size / 3;
-        for (gsize i = 0; i < ctx->plte.size; ++i) {
-          guint8 r = ctx->buf[offset + 0];
-          guint8 g = ctx->buf[offset + 1];
-          guint8 b = ctx->buf[offset + 2];
-          guint8 a = 0xff;
-
-          ctx->plte.rgba[i] = (r << 0) | (g << 8) | (b << 16) | (a << 24);
-          offset += 3;
-        }
-
-        // printf("PLTE\n");
-        // for (gsize i = 0; i < ctx->plte.size; ++i)
-        //   printf("  %08x\n", ctx->plte.rgba[i]);
-
-      } else if (strncmp(chunk_type, "tRNS", 4) == 0) {
-        g_assert(ctx->anim->ihdr.colour_type == 0 ||
-                 ctx->anim->ihdr.colour_type == 2 ||
-                 ctx->anim->ihdr.colour_type == 3);
-
-        if (ctx->anim->ihdr.colour_type == 0)
-          g_assert(chunk_size == 2);
-        if (ctx->anim->ihdr.colour_type == 2)
-          g_assert(chunk_size == 6);
-        if (ctx->anim->ihdr.colour_type == 3) {
-          g_assert(ctx->plte.size > 0);
-          g_assert(chunk_size <= ctx->plte.size);
-
-          for (gsize i = 0; i < chunk_size; ++i) {
-            ctx->plte.rgba[i] &= ~0xff000000;
-            ctx->plte.rgba[i] |= (ctx->buf[offset++] << 24);
-          }
-
-          // printf("tRNS\n");
-          // for (gsize i = 0; i < chunk_size; ++i)
-          //   printf("  %08x\n", ctx->plte.rgba[i]);
-        }
-
-      } else if (strncmp(chunk_type, "fcTL", 4) == 0) {
-        g_assert(chunk_size == 26);
-        g_assert(sizeof(ctx->frame->fctl) == 26);
-
-        g_assert(ctx->frame == NULL);
-
-        ctx->frame = g_new0(GdkPixbufApngFrame, 1);
-        if (ctx->frame == NULL) {
-          g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                              GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
-                              "Not enough memory to load a frame in APNG file");
-          goto error;
-        }
-
-        memcpy(&ctx->frame->fctl, ctx->buf + offset, sizeof(ctx->frame->fctl));
-        offset += sizeof(ctx->frame->fctl);
-        ctx->frame->fctl.sequence_number =
-            GUINT32_FROM_BE(ctx->frame->fctl.sequence_number);
-        ctx->frame->fctl.width    = GUINT32_FROM_BE(ctx->frame->fctl.width);
-        ctx->frame->fctl.height   = GUINT32_FROM_BE(ctx->frame->fctl.height);
-        ctx->frame->fctl.x_offset = GUINT32_FROM_BE(ctx->frame->fctl.x_offset);
-        ctx->frame->fctl.y_offset = GUINT32_FROM_BE(ctx->frame->fctl.y_offset);
-        ctx->frame->fctl.delay_num =
-            GUINT16_FROM_BE(ctx->frame->fctl.delay_num);
-        ctx->frame->fctl.delay_den =
-            GUINT16_FROM_BE(ctx->frame->fctl.delay_den);
-
-        // printf(
-        //   "fcTL\n"
-        //   "  sequence_number: %d\n"
-        //   "  width: %d\n"
-        //   "  height: %d\n"
-        //   "  x_offset: %d\n"
-        //   "  y_offset: %d\n"
-        //   "  delay_num: %d\n"
-        //   "  delay_den: %d\n"
-        //   "  dispose_op: %d\n"
-        //   "  blend_op: %d\n",
-        //   ctx->frame->fctl.sequence_number,
-        //   ctx->frame->fctl.width,
-        //   ctx->frame->fctl.height,
-        //   ctx->frame->fctl.x_offset,
-        //   ctx->frame->fctl.y_offset,
-        //   ctx->frame->fctl.delay_num,
-        //   ctx->frame->fctl.delay_den,
-        //   ctx->frame->fctl.dispose_op,
-        //   ctx->frame->fctl.blend_op);
-
-        // g_assert(ctx->frame->sequence_number == ctx->anim->n_frames);
-        ctx->frame->pixbuf =
-            gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, ctx->frame->fctl.width,
-                           ctx->frame->fctl.height);
-        if (ctx->frame->pixbuf == NULL) {
-          g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                              GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
-                              "Not enough memory to load a frame in APNG file");
-          goto error;
-        }
-
-      } else if (strncmp(chunk_type, "IDAT", 4) == 0) {
-        g_assert(ctx->frame != NULL);
-        g_assert(ctx->anim->frames == NULL);
-        if (ctx->anim->ihdr.colour_type == 3)
-          g_assert(ctx->plte.size > 0);
-
-        g_assert(ctx->anim->ihdr.colour_type == 3 ||
-                 ctx->anim->ihdr.colour_type == 6);
-        if (ctx->anim->ihdr.colour_type == 3) {
-          if (apng_decompress_3(ctx, ctx->frame, ctx->buf + offset, chunk_size,
-                                &zerr) == TRUE)
-            offset += chunk_size;
-          else if (zerr != Z_OK)
-            goto zerror;
-        } else if (ctx->anim->ihdr.colour_type == 6) {
-          if (apng_decompress_6(ctx, ctx->frame, ctx->buf + offset, chunk_size,
-                                &zerr) == TRUE)
-            offset += chunk_size;
-          else if (zerr != Z_OK)
-            goto zerror;
-        }
-
-        if (ctx->frame->off == ctx->frame->size) {
-          ctx->anim->n_frames++;
-          ctx->anim->frames = g_list_append(ctx->anim->frames, ctx->frame);
-
-          if (ctx->prepare_func)
-            (*ctx->prepare_func)(ctx->frame->pixbuf,
-                                 GDK_PIXBUF_ANIMATION(ctx->anim),
-                                 ctx->user_data);
-
-          // if (ctx->update_func != NULL)
-          //   (ctx->update_func)(ctx->frame->pixbuf, ctx->frame->x_offset,
-          //                      ctx->frame->y_offset, ctx->frame->width,
-          //                      ctx->frame->height, ctx->user_data);
-
-          gdk_pixbuf_apng_anim_frame_composite(ctx->anim, ctx->frame);
-
-          if (ctx->frame->composited == NULL) {
-            ctx->frame = NULL;
-            g_set_error_literal(
-                error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
-                "Not enough memory to composite a frame in APNG file");
-            goto error;
-          }
-          ctx->frame = NULL;
-        }
-
-      } else if (strncmp(chunk_type, "fdAT", 4) == 0) {
-        g_assert(ctx->frame != NULL);
-        g_assert(ctx->anim->frames != NULL);
-
-        if (ctx->anim->ihdr.colour_type == 3)
-          g_assert(ctx->plte.size > 0);
-
-        guint32 sequence_number;
-        memcpy(&sequence_number, ctx->buf + offset, sizeof(sequence_number));
-        offset += sizeof(sequence_number);
-        sequence_number = GUINT32_FROM_BE(sequence_number);
-        chunk_size -= sizeof(sequence_number);
-
-        g_assert(ctx->anim->ihdr.colour_type == 3 ||
-                 ctx->anim->ihdr.colour_type == 6);
-        if (ctx->anim->ihdr.colour_type == 3) {
-          if (apng_decompress_3(ctx, ctx->frame, ctx->buf + offset, chunk_size,
-                                &zerr) == TRUE)
-            offset += chunk_size;
-          else if (zerr != Z_OK)
-            goto zerror;
-        } else if (ctx->anim->ihdr.colour_type == 6) {
-          if (apng_decompress_6(ctx, ctx->frame, ctx->buf + offset, chunk_size,
-                                &zerr) == TRUE)
-            offset += chunk_size;
-          else if (zerr != Z_OK)
-            goto zerror;
-        }
-
-        if (ctx->frame->off == ctx->frame->size) {
-          ctx->anim->n_frames++;
-          ctx->anim->frames = g_list_append(ctx->anim->frames, ctx->frame);
-
-          // if (ctx->update_func != NULL)
-          //   (ctx->update_func)(ctx->frame->pixbuf, ctx->frame->x_offset,
-          //                      ctx->frame->y_offset, ctx->frame->width,
-          //                      ctx->frame->height, ctx->user_data);
-
-          gdk_pixbuf_apng_anim_frame_composite(ctx->anim, ctx->frame);
-
-          if (ctx->frame->composited == NULL) {
-            ctx->frame = NULL;
-            g_set_error_literal(
-                error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
-                "Not enough memory to composite a frame in APNG file");
-            goto error;
-          }
-          ctx->frame = NULL;
-        }
-
-      } else {
-        offset += chunk_size;
-
-        // printf("%c%c%c%c\n", chunk_type[0], chunk_type[1], chunk_type[2],
-        // chunk_type[3]);
-      }
+  return TRUE;
+}
 
-      guint32 chunk_crc;
-      memcpy(&chunk_crc, ctx->buf + offset, 4);
-      offset += 4;
+/* Unfilters the inflated rows of a frame into its pixbuf, allocated only
+ * now that we know whether the frame needs an alpha channel.
+ */
+static gboolean apng_frame_convert(ApngContext* ctx, GdkPixbufApngFrame* frame,
+                                   int* zerr) {
+  gsize const height = frame->fctl.height;
+  gsize const width  = frame->fctl.width;
+  gsize const bpp    = ctx->anim->ihdr.colour_type == 2   ? 3
+                       : ctx->anim->ihdr.colour_type == 6 ? 4
+                                                          : 1;
+  gsize const stride = width * bpp + 1;
+  guint8*     prev   = NULL;
+  guint8*     pixels;
+  gsize       rowstride;
+
+  frame->opaque = TRUE;
+  for (gsize y = 0; y < height; ++y) {
+    guint8* row = ctx->scratch + y * stride;
+    if (!apng_unfilter_row(row + 1, prev, row[0], bpp, stride - 1)) {
+      *zerr = Z_DATA_ERROR;
+      return FALSE;
     }
+    if (frame->opaque)
+      frame->opaque = apng_row_is_opaque(ctx, row + 1, width);
+    prev = row + 1;
+  }
 
-    memmove(ctx->buf, ctx->buf + offset, ctx->size - offset);
-    ctx->size -= offset;
-    ctx->off += offset;
+  /* Streamed frames are dropped once composited, keeping them for reuse
+   * would fill the pool with every frame size seen.
+   */
+  if (ctx->frame_func != NULL)
+    frame->pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, !frame->opaque, 8,
+                                   width, height);
+  else
+    frame->pixbuf = gdk_pixbuf_apng_pool_new_pixbuf(
+        ctx->anim->pool, !frame->opaque, width, height);
+  if (frame->pixbuf == NULL) {
+    *zerr = Z_MEM_ERROR;
+    return FALSE;
   }
 
+  pixels    = gdk_pixbuf_get_pixels(frame->pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride(frame->pixbuf);
+  for (gsize y = 0; y < height; ++y)
+    apng_convert_row(ctx, pixels + y * rowstride,
+                     ctx->scratch + y * stride + 1, width, frame->opaque);
+
   return TRUE;
+}
 
-zerror:
+static void apng_set_zerror(GError** error, int zerr) {
   if (zerr == Z_MEM_ERROR)
     g_set_error_literal(error, GDK_PIXBUF_ERROR,
                         GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
@@ -504,23 +512,1105 @@ zerror:
     g_set_error_literal(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
                         "Unknown error while decompressing a frame in APNG "
                         "file");
+}
 
-error:
-  if (ctx->frame != NULL) {
-    g_clear_object(&ctx->frame->pixbuf);
-    g_clear_object(&ctx->frame->composited);
-    g_clear_object(&ctx->frame->revert);
+/* Streaming mode, the compositor only keeps the frame until the next one
+ * has been composited.
+ */
+static gboolean apng_frame_stream(ApngContext* ctx, GError** error) {
+  GdkPixbufApngFrame* frame = ctx->frame;
+  GdkPixbuf*          canvas;
+
+  ctx->frame = NULL;
+  canvas     = gdk_pixbuf_apng_compositor_push(ctx->compositor, ctx->anim,
+                                               frame);
+  if (canvas == NULL) {
+    gdk_pixbuf_apng_frame_unref(frame);
+    g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                        GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                        "Not enough memory to composite a frame in APNG file");
+    return FALSE;
   }
-  g_free(ctx->frame);
+
+  (*ctx->frame_func)(canvas, gdk_pixbuf_apng_frame_get_delay_us(frame) / 1000,
+                     ctx->frame_data);
+  gdk_pixbuf_apng_frame_unref(frame);
+
+  return TRUE;
+}
+
+static gboolean apng_frame_complete(ApngContext* ctx, GError** error) {
+  GdkPixbufApngFrame* frame = ctx->frame;
+
+  if (ctx->frame_func != NULL)
+    return apng_frame_stream(ctx, error);
+
+  /* Strip mode, every row was handed over already. */
+  if (ctx->band_func != NULL) {
+    g_clear_pointer(&ctx->frame, gdk_pixbuf_apng_frame_unref);
+    ctx->anim->n_decoded++;
+    return TRUE;
+  }
+
+  /* The animation owns the frame from now on. */
   ctx->frame = NULL;
+  gdk_pixbuf_apng_anim_add_frame(ctx->anim, frame);
+
+  /* The frame may have been held back, or merged and freed already. */
+  if (!ctx->prepared && ctx->anim->n_frames > 0) {
+    ctx->prepared = TRUE;
+    frame         = gdk_pixbuf_apng_anim_get_frame(ctx->anim, 0);
+    if (ctx->prepare_func)
+      (*ctx->prepare_func)(frame->pixbuf, GDK_PIXBUF_ANIMATION(ctx->anim),
+                           ctx->user_data);
+  }
+
+  // if (ctx->update_func != NULL)
+  //   (ctx->update_func)(frame->pixbuf, frame->x_offset,
+  //                      frame->y_offset, frame->width,
+  //                      frame->height, ctx->user_data);
+
+  return TRUE;
+}
+
+/* Frames are only converted and handed over once their last chunk checked
+ * out, a corrupt one never gets a pixel buffer.
+ */
+static gboolean apng_end_data_chunk(ApngContext* ctx, GError** error) {
+  GdkPixbufApngFrame* frame = ctx->frame;
+  int                 zerr;
+
+  if (frame == NULL || frame->size == 0 || frame->off != frame->size)
+    return TRUE;
+
+  if (ctx->band_func == NULL && !apng_frame_convert(ctx, frame, &zerr)) {
+    apng_set_zerror(error, zerr);
+    return FALSE;
+  }
+
+  return apng_frame_complete(ctx, error);
+}
+
+/* Whether the caller registered a callback for this chunk type. */
+static gboolean apng_chunk_is_wanted(ApngContext* ctx, guint32 chunk_type) {
+  for (gsize i = 0; i < ctx->n_chunk_types; ++i)
+    if (ctx->chunk_types[i] == chunk_type)
+      return TRUE;
+
+  return FALSE;
+}
+
+/* Banded streams hand rows over as soon as they are decompressed. To never
+ * hand over rows of a corrupt chunk, image data chunks are then buffered
+ * whole until their CRC checked out.
+ */
+static gboolean apng_data_is_held(ApngContext* ctx) {
+  return ctx->band_func != NULL && ctx->verify_crc;
+}
+
+/* Called once the chunk length and type are known, decides whether the
+ * chunk data is buffered, streamed to the decoder, or dropped.
+ */
+static gboolean apng_begin_chunk(ApngContext* ctx, GError** error) {
+  gsize buffered = 0;
+
+  if (ctx->chunk_size > G_MAXINT32) {
+    g_set_error_literal(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                        "Invalid chunk length in APNG file");
+    return FALSE;
+  }
+  ctx->chunk_left = ctx->chunk_size;
+
+  if ((ctx->chunk_type == APNG_CHUNK_IDAT ||
+       ctx->chunk_type == APNG_CHUNK_fdAT) &&
+      ctx->frame != NULL && ctx->frame->data_offset == 0)
+    ctx->frame->data_offset = ctx->chunk_offset;
+
+  switch (ctx->chunk_type) {
+  case APNG_CHUNK_IHDR:
+  case APNG_CHUNK_acTL:
+  case APNG_CHUNK_PLTE:
+  case APNG_CHUNK_tRNS:
+  case APNG_CHUNK_fcTL:
+    if (ctx->chunk_size > APNG_MAX_HEADER_CHUNK_SIZE) {
+      g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                          GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                          "Invalid chunk length in APNG file");
+      return FALSE;
+    }
+    buffered   = ctx->chunk_size + 4;
+    ctx->state = APNG_STATE_CHUNK_DATA;
+    break;
+  case APNG_CHUNK_IDAT:
+    /* An IDAT without fcTL is a default image that isn't part of the
+     * animation.
+     */
+    if (ctx->frame == NULL) {
+      ctx->state = APNG_STATE_CHUNK_SKIP;
+    } else if (apng_data_is_held(ctx)) {
+      buffered   = ctx->chunk_size + 4;
+      ctx->state = APNG_STATE_CHUNK_DATA;
+    } else {
+      ctx->state = APNG_STATE_CHUNK_STREAM;
+    }
+    break;
+  case APNG_CHUNK_fdAT:
+    if (ctx->chunk_size < 4) {
+      g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                          GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                          "Invalid fdAT chunk in APNG file");
+      return FALSE;
+    }
+    if (apng_data_is_held(ctx)) {
+      buffered   = ctx->chunk_size + 4;
+      ctx->state = APNG_STATE_CHUNK_DATA;
+    } else {
+      buffered   = 4;
+      ctx->state = APNG_STATE_CHUNK_SEQUENCE;
+    }
+    break;
+  case APNG_CHUNK_gAMA:
+  case APNG_CHUNK_cHRM:
+  case APNG_CHUNK_sRGB:
+  case APNG_CHUNK_iCCP:
+    /* Colour chunks only count before PLTE and the image data. */
+    if ((!ctx->colour.prepared &&
+         ctx->chunk_size <= APNG_MAX_ICCP_CHUNK_SIZE) ||
+        apng_chunk_is_wanted(ctx, ctx->chunk_type)) {
+      buffered   = ctx->chunk_size + 4;
+      ctx->state = APNG_STATE_CHUNK_DATA;
+    } else {
+      ctx->state = APNG_STATE_CHUNK_SKIP;
+    }
+    break;
+  default:
+    if (apng_chunk_is_wanted(ctx, ctx->chunk_type)) {
+      buffered   = ctx->chunk_size + 4;
+      ctx->state = APNG_STATE_CHUNK_DATA;
+    } else {
+      ctx->state = APNG_STATE_CHUNK_SKIP;
+    }
+    break;
+  }
+
+  if (ctx->buf_size < buffered) {
+    guchar* buf = g_try_realloc(ctx->buf, buffered);
+    if (buf == NULL) {
+      g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                          GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                          "Not enough memory to load APNG file");
+      return FALSE;
+    }
+    ctx->buf      = buf;
+    ctx->buf_size = buffered;
+  }
+
+  return TRUE;
+}
+
+static gboolean apng_check_time(ApngContext* ctx, GError** error) {
+  gint64 elapsed;
+
+  if (ctx->limits.max_time_us == 0)
+    return TRUE;
+
+  elapsed = ctx->decode_time_us + g_get_monotonic_time() - ctx->decode_start_us;
+  if (elapsed <= ctx->limits.max_time_us)
+    return TRUE;
+
+  g_set_error_literal(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                      "APNG file took too long to decode");
+  return FALSE;
+}
+
+/* Checks the fcTL of a new frame against the canvas and the limits. */
+static gboolean apng_check_frame(ApngContext*              ctx,
+                                 const GdkPixbufApngFrame* frame,
+                                 GError**                  error) {
+  const ApngChunk_IHDR* ihdr  = &ctx->anim->ihdr;
+  const ApngChunk_fcTL* fctl  = &frame->fctl;
+  guint64               bytes = (guint64)fctl->width * fctl->height * 4;
+
+  if (fctl->width == 0 || fctl->height == 0 || fctl->width > ihdr->width ||
+      fctl->height > ihdr->height ||
+      fctl->x_offset > ihdr->width - fctl->width ||
+      fctl->y_offset > ihdr->height - fctl->height ||
+      fctl->dispose_op > APNG_DISPOSE_OP_PREVIOUS ||
+      fctl->blend_op > APNG_BLEND_OP_OVER) {
+    g_set_error_literal(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                        "Invalid fcTL chunk in APNG file");
+    return FALSE;
+  }
+
+  if (ctx->limits.max_frames > 0 &&
+      ctx->anim->n_decoded >= ctx->limits.max_frames) {
+    g_set_error_literal(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                        "APNG file has too many frames");
+    return FALSE;
+  }
+
+  if (ctx->limits.max_decoded_bytes > 0 &&
+      ctx->decoded_bytes + bytes > ctx->limits.max_decoded_bytes) {
+    g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                        GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                        "APNG file decodes to too much data");
+    return FALSE;
+  }
+  ctx->decoded_bytes += bytes;
+
+  return TRUE;
+}
+
+/* Records a colour chunk. Inflated iCCP profiles count as decoded data,
+ * a profile past what is left of max_decoded_bytes fails the load.
+ */
+static gboolean apng_parse_colour(ApngContext* ctx, gsize chunk_size,
+                                  GError** error) {
+  gsize max_icc_size = APNG_MAX_ICC_PROFILE_SIZE;
+  gsize inflated;
+
+  /* A byte past what is left, to tell the profiles that don't fit. */
+  if (ctx->limits.max_decoded_bytes > 0)
+    max_icc_size = MIN(ctx->limits.max_decoded_bytes - ctx->decoded_bytes,
+                       APNG_MAX_ICC_PROFILE_SIZE) + 1;
+
+  inflated = gdk_pixbuf_apng_colour_parse(&ctx->colour, ctx->chunk_type,
+                                          ctx->buf, chunk_size, max_icc_size);
+  if (ctx->limits.max_decoded_bytes > 0 &&
+      ctx->decoded_bytes + inflated > ctx->limits.max_decoded_bytes) {
+    g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                        GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                        "APNG file decodes to too much data");
+    return FALSE;
+  }
+  ctx->decoded_bytes += inflated;
+
+  return apng_check_time(ctx, error);
+}
+
+/* Hands a buffered chunk to the chunk_func the caller registered. */
+static void apng_call_chunk_func(ApngContext* ctx) {
+  gchar name[5];
 
+  name[0] = ctx->chunk_type >> 24;
+  name[1] = ctx->chunk_type >> 16;
+  name[2] = ctx->chunk_type >> 8;
+  name[3] = ctx->chunk_type;
+  name[4] = '\0';
+  (*ctx->chunk_func)(name, ctx->buf, ctx->chunk_size, ctx->chunk_data);
+}
+
+/* Handles a fully buffered chunk, the data is in ctx->buf. */
+static gboolean apng_process_data(ApngContext* ctx, const guchar* buf,
+                                  guint size, GError** error);
+
+static gboolean apng_process_chunk(ApngContext* ctx, GError** error) {
+  gsize   offset     = 0;
+  guint32 chunk_size = ctx->chunk_size;
+  guint64 canvas_bytes;
+
+  switch (ctx->chunk_type) {
+  case APNG_CHUNK_IHDR:
+    g_assert(sizeof(ctx->anim->ihdr) == 13);
+
+    if (chunk_size != 13 || ctx->anim->ihdr.width != 0) {
+      g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                          GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                          "Invalid IHDR chunk in APNG file");
+      return FALSE;
+    }
+
+    memcpy(&ctx->anim->ihdr, ctx->buf + offset, sizeof(ctx->anim->ihdr));
+    offset += sizeof(ctx->anim->ihdr);
+    ctx->anim->ihdr.width  = GUINT32_FROM_BE(ctx->anim->ihdr.width);
+    ctx->anim->ihdr.height = GUINT32_FROM_BE(ctx->anim->ihdr.height);
+
+    // printf(
+    //   "IHDR\n"
+    //   "  width: %d\n"
+    //   "  height: %d\n"
+    //   "  bit_depth: %d\n"
+    //   "  colour_type: %d\n"
+    //   "  compression_method: %d\n"
+    //   "  filter_method: %d\n"
+    //   "  interlace_method: %d\n",
+    //   ctx->anim->ihdr.width, ctx->anim->ihdr.height,
+    //   ctx->anim->ihdr.bit_depth, ctx->anim->ihdr.colour_type,
+    //   ctx->anim->ihdr.compression_method, ctx->anim->ihdr.filter_method,
+    //   ctx->anim->ihdr.interlace_method);
+    if (ctx->anim->ihdr.width == 0 || ctx->anim->ihdr.height == 0 ||
+        ctx->anim->ihdr.width > G_MAXINT32 ||
+        ctx->anim->ihdr.height > G_MAXINT32 ||
+        ctx->anim->ihdr.compression_method != 0 ||
+        ctx->anim->ihdr.filter_method != 0) {
+      g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                          GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                          "Invalid IHDR chunk in APNG file");
+      return FALSE;
+    }
+    if (ctx->anim->ihdr.bit_depth != 8 ||
+        (ctx->anim->ihdr.colour_type != 2 &&
+         ctx->anim->ihdr.colour_type != 3 &&
+         ctx->anim->ihdr.colour_type != 6) ||
+        ctx->anim->ihdr.interlace_method != 0) {
+      g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                          GDK_PIXBUF_ERROR_UNKNOWN_TYPE,
+                          "Unsupported pixel format in APNG file");
+      return FALSE;
+    }
+
+    if (ctx->size_func) {
+      gint width  = ctx->anim->ihdr.width;
+      gint height = ctx->anim->ihdr.height;
+
+      (*ctx->size_func)(&width, &height, ctx->user_data);
+
+      /* gdk_pixbuf_get_file_info requests a 0x0 image once it knows the
+       * size, the rest of the file doesn't need to be parsed.
+       */
+      if (width == 0 || height == 0) {
+        ctx->header_only = TRUE;
+        ctx->state       = APNG_STATE_DONE;
+        break;
+      }
+    }
+
+    if (ctx->limits.max_pixels > 0 &&
+        (guint64)ctx->anim->ihdr.width * ctx->anim->ihdr.height >
+            ctx->limits.max_pixels) {
+      g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                          GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                          "APNG image is too large");
+      return FALSE;
+    }
+
+    /* At least two RGBA canvases are kept for reuse, and no more for
+     * streams, whose memory use only depends on the canvas size.
+     */
+    canvas_bytes =
+        MIN((guint64)ctx->anim->ihdr.width * ctx->anim->ihdr.height,
+            G_MAXSIZE / 8) *
+        8;
+    gdk_pixbuf_apng_pool_set_limits(
+        ctx->anim->pool, APNG_POOL_MAX_BLOCKS,
+        ctx->frame_func != NULL ? canvas_bytes
+                                : MAX(APNG_POOL_MAX_BYTES, canvas_bytes));
+    break;
+  case APNG_CHUNK_acTL:
+    g_assert(sizeof(ctx->anim->actl) == 8);
+
+    if (chunk_size != 8 || ctx->frame != NULL || ctx->anim->n_decoded != 0 ||
+        ctx->anim->actl.num_frames != 0) {
+      g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                          GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                          "Invalid acTL chunk in APNG file");
+      return FALSE;
+    }
+
+    memcpy(&ctx->anim->actl, ctx->buf + offset, sizeof(ctx->anim->actl));
+    offset += sizeof(ctx->anim->actl);
+    ctx->anim->actl.num_frames =
+        GUINT32_FROM_BE(ctx->anim->actl.num_frames);
+    ctx->anim->actl.num_plays = GUINT32_FROM_BE(ctx->anim->actl.num_plays);
+
+    if (ctx->anim->actl.num_frames == 0) {
+      g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                          GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                          "Invalid acTL chunk in APNG file");
+      return FALSE;
+    }
+    if (ctx->limits.max_frames > 0 &&
+        ctx->anim->actl.num_frames > ctx->limits.max_frames) {
+      g_set_error_literal(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                          "APNG file has too many frames");
+      return FALSE;
+    }
+
+    // printf(
+    //   "acTL\n"
+    //   "  num_frames: %d\n"
+    //   "  num_plays: %d\n",
+    //   ctx->anim->actl.num_frames, ctx->anim->actl.num_plays);
+    break;
+  case APNG_CHUNK_PLTE:
+    /* A suggested palette for a true colour image isn't needed. */
+    if (ctx->anim->ihdr.colour_type != 3)
+      break;
+
+    if (chunk_size % 3 != 0 || chunk_size == 0 || chunk_size / 3 > 256 ||
+        ctx->plte.size > 0) {
+      g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                          GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                          "Invalid PLTE chunk in APNG file");
+      return FALSE;
+    }
+
+    gdk_pixbuf_apng_colour_prepare(&ctx->colour);
+
+    ctx->plte.size   = chunk_size / 3;
+    ctx->plte.opaque = TRUE;
+    for (gsize i = 0; i < ctx->plte.size; ++i) {
+      guint8 rgb[3];
+      guint8 a = 0xff;
+
+      memcpy(rgb, ctx->buf + offset, sizeof(rgb));
+      gdk_pixbuf_apng_colour_apply(&ctx->colour, rgb, 1, sizeof(rgb));
+      ctx->plte.rgba[i] = (rgb[0] << 0) | (rgb[1] << 8) | (rgb[2] << 16) |
+                          ((guint32)a << 24);
+      offset += 3;
+    }
+
+    // printf("PLTE\n");
+    // for (gsize i = 0; i < ctx->plte.size; ++i)
+    //   printf("  %08x\n", ctx->plte.rgba[i]);
+    break;
+  case APNG_CHUNK_tRNS:
+    if ((ctx->anim->ihdr.colour_type == 2 && chunk_size != 6) ||
+        (ctx->anim->ihdr.colour_type == 3 &&
+         (ctx->plte.size == 0 || chunk_size > ctx->plte.size)) ||
+        ctx->anim->ihdr.colour_type == 6) {
+      g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                          GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                          "Invalid tRNS chunk in APNG file");
+      return FALSE;
+    }
+
+    if (ctx->anim->ihdr.colour_type == 2) {
+      /* 8-bit samples, the high bytes are always zero. */
+      ctx->trns.present = TRUE;
+      ctx->trns.rgb[0]  = ctx->buf[offset + 1];
+      ctx->trns.rgb[1]  = ctx->buf[offset + 3];
+      ctx->trns.rgb[2]  = ctx->buf[offset + 5];
+      offset += chunk_size;
+    }
+    if (ctx->anim->ihdr.colour_type == 3) {
+      for (gsize i = 0; i < chunk_size; ++i) {
+        ctx->plte.rgba[i] &= ~0xff000000;
+        ctx->plte.rgba[i] |= ((guint32)ctx->buf[offset] << 24);
+        if (ctx->buf[offset++] != 0xff)
+          ctx->plte.opaque = FALSE;
+      }
+
+      // printf("tRNS\n");
+      // for (gsize i = 0; i < chunk_size; ++i)
+      //   printf("  %08x\n", ctx->plte.rgba[i]);
+    }
+    break;
+  case APNG_CHUNK_fcTL:
+    g_assert(sizeof(ctx->frame->fctl) == 26);
+
+    if (chunk_size != 26 || ctx->frame != NULL) {
+      g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                          GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                          "Invalid fcTL chunk in APNG file");
+      return FALSE;
+    }
+
+    ctx->frame = gdk_pixbuf_apng_frame_new();
+    if (ctx->frame == NULL) {
+      g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                          GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                          "Not enough memory to load a frame in APNG file");
+      return FALSE;
+    }
+
+    ctx->frame->fctl_offset = ctx->chunk_offset;
+    memcpy(&ctx->frame->fctl, ctx->buf + offset, sizeof(ctx->frame->fctl));
+    offset += sizeof(ctx->frame->fctl);
+    ctx->frame->fctl.sequence_number =
+        GUINT32_FROM_BE(ctx->frame->fctl.sequence_number);
+    ctx->frame->fctl.width    = GUINT32_FROM_BE(ctx->frame->fctl.width);
+    ctx->frame->fctl.height   = GUINT32_FROM_BE(ctx->frame->fctl.height);
+    ctx->frame->fctl.x_offset = GUINT32_FROM_BE(ctx->frame->fctl.x_offset);
+    ctx->frame->fctl.y_offset = GUINT32_FROM_BE(ctx->frame->fctl.y_offset);
+    ctx->frame->fctl.delay_num =
+        GUINT16_FROM_BE(ctx->frame->fctl.delay_num);
+    ctx->frame->fctl.delay_den =
+        GUINT16_FROM_BE(ctx->frame->fctl.delay_den);
+
+    // printf(
+    //   "fcTL\n"
+    //   "  sequence_number: %d\n"
+    //   "  width: %d\n"
+    //   "  height: %d\n"
+    //   "  x_offset: %d\n"
+    //   "  y_offset: %d\n"
+    //   "  delay_num: %d\n"
+    //   "  delay_den: %d\n"
+    //   "  dispose_op: %d\n"
+    //   "  blend_op: %d\n",
+    //   ctx->frame->fctl.sequence_number,
+    //   ctx->frame->fctl.width,
+    //   ctx->frame->fctl.height,
+    //   ctx->frame->fctl.x_offset,
+    //   ctx->frame->fctl.y_offset,
+    //   ctx->frame->fctl.delay_num,
+    //   ctx->frame->fctl.delay_den,
+    //   ctx->frame->fctl.dispose_op,
+    //   ctx->frame->fctl.blend_op);
+
+    // g_assert(ctx->frame->sequence_number == ctx->anim->n_frames);
+
+    if (!apng_check_frame(ctx, ctx->frame, error))
+      return FALSE;
+    break;
+  case APNG_CHUNK_gAMA:
+  case APNG_CHUNK_cHRM:
+  case APNG_CHUNK_sRGB:
+  case APNG_CHUNK_iCCP:
+    if (!ctx->colour.prepared && !apng_parse_colour(ctx, chunk_size, error))
+      return FALSE;
+    if (apng_chunk_is_wanted(ctx, ctx->chunk_type))
+      apng_call_chunk_func(ctx);
+    break;
+  case APNG_CHUNK_fdAT:
+    /* Held back image data, the sequence number comes first. */
+    offset += 4;
+    /* fallthrough */
+  case APNG_CHUNK_IDAT:
+    if (!apng_process_data(ctx, ctx->buf + offset, chunk_size - offset,
+                           error) ||
+        !apng_end_data_chunk(ctx, error))
+      return FALSE;
+    break;
+  default:
+    apng_call_chunk_func(ctx);
+    break;
+  }
+
+  return TRUE;
+}
+
+/* Feeds IDAT or fdAT payload bytes to the decoder as they arrive. */
+static gboolean apng_process_data(ApngContext* ctx, const guchar* buf,
+                                  guint size, GError** error) {
+  int zerr = Z_OK;
+
+  if (ctx->frame == NULL)
+    return TRUE;
+
+  if (ctx->anim->ihdr.colour_type == 3 && ctx->plte.size == 0) {
+    g_set_error_literal(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                        "Missing PLTE chunk in APNG file");
+    return FALSE;
+  }
+
+  g_assert(ctx->anim->ihdr.colour_type == 2 ||
+           ctx->anim->ihdr.colour_type == 3 ||
+           ctx->anim->ihdr.colour_type == 6);
+  if (apng_decompress(ctx, ctx->frame, buf, size, &zerr) != TRUE) {
+    apng_set_zerror(error, zerr);
+    return FALSE;
+  }
+
+  if (!apng_check_time(ctx, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Checks the CRC stored after the chunk against the one computed while the
+ * chunk went through the parser.
+ */
+static gboolean apng_check_crc(ApngContext* ctx, const guchar* crc,
+                               GError** error) {
+  guint32 chunk_crc;
+
+  if (!ctx->verify_crc)
+    return TRUE;
+
+  memcpy(&chunk_crc, crc, sizeof(chunk_crc));
+  if (GUINT32_FROM_BE(chunk_crc) == ctx->chunk_crc)
+    return TRUE;
+
+  g_set_error_literal(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                      "Invalid chunk CRC in APNG file");
   return FALSE;
 }
 
+static void apng_update_crc(ApngContext* ctx, const guchar* buf, guint size) {
+  if (ctx->verify_crc)
+    ctx->chunk_crc = crc32(ctx->chunk_crc, buf, size);
+}
+
+/* Accumulates input into ctx->buf until it holds `need` bytes. */
+static gboolean apng_buffer(ApngContext* ctx, const guchar** buf, guint* size,
+                            gsize need) {
+  gsize count = MIN(need - ctx->size, *size);
+
+  memcpy(ctx->buf + ctx->size, *buf, count);
+  ctx->size += count;
+  ctx->off += count;
+  *buf += count;
+  *size -= count;
+
+  return ctx->size == need;
+}
+
+/* Drops up to ctx->chunk_left input bytes, returns how many were used. */
+static guint apng_consume(ApngContext* ctx, const guchar** buf, guint* size) {
+  guint count = MIN(ctx->chunk_left, *size);
+
+  ctx->chunk_left -= count;
+  ctx->off += count;
+  *buf += count;
+  *size -= count;
+
+  return count;
+}
+
+static gboolean apng_load(ApngContext* ctx, const guchar* buf, guint size,
+                          GError** error) {
+  ctx->decode_start_us = g_get_monotonic_time();
+
+  while (size > 0) {
+    switch (ctx->state) {
+    case APNG_STATE_SIGNATURE: {
+      guint64 apng_header;
+      if (!apng_buffer(ctx, &buf, &size, sizeof(apng_header)))
+        break;
+
+      memcpy(&apng_header, ctx->buf, sizeof(apng_header));
+      if (apng_header != GUINT64_TO_BE(0x89504e470d0a1a0a)) {
+        g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                            GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                            "Invalid signature in APNG file");
+        goto error;
+      }
+
+      ctx->size  = 0;
+      ctx->state = APNG_STATE_CHUNK_HEADER;
+      break;
+    }
+    case APNG_STATE_CHUNK_HEADER: {
+      guint32 chunk_header[2];
+      if (!apng_buffer(ctx, &buf, &size, sizeof(chunk_header)))
+        break;
+
+      memcpy(chunk_header, ctx->buf, sizeof(chunk_header));
+      ctx->chunk_size   = GUINT32_FROM_BE(chunk_header[0]);
+      ctx->chunk_type   = GUINT32_FROM_BE(chunk_header[1]);
+      ctx->chunk_offset = ctx->off - sizeof(chunk_header);
+      ctx->chunk_crc    = 0;
+      apng_update_crc(ctx, ctx->buf + 4, 4);
+
+      ctx->size = 0;
+      if (!apng_check_time(ctx, error) || !apng_begin_chunk(ctx, error))
+        goto error;
+      break;
+    }
+    case APNG_STATE_CHUNK_DATA:
+      /* The CRC is buffered along, the chunk is only interpreted once it
+       * is known to be intact.
+       */
+      if (!apng_buffer(ctx, &buf, &size, ctx->chunk_size + 4))
+        break;
+
+      apng_update_crc(ctx, ctx->buf, ctx->chunk_size);
+      if (!apng_check_crc(ctx, ctx->buf + ctx->chunk_size, error))
+        goto error;
+
+      ctx->size  = 0;
+      ctx->state = APNG_STATE_CHUNK_HEADER;
+      if (!apng_process_chunk(ctx, error))
+        goto error;
+      break;
+    case APNG_STATE_CHUNK_SEQUENCE: {
+      guint32 sequence_number;
+      if (!apng_buffer(ctx, &buf, &size, sizeof(sequence_number)))
+        break;
+
+      memcpy(&sequence_number, ctx->buf, sizeof(sequence_number));
+      sequence_number = GUINT32_FROM_BE(sequence_number);
+      apng_update_crc(ctx, ctx->buf, sizeof(sequence_number));
+
+      ctx->size       = 0;
+      ctx->chunk_left = ctx->chunk_size - sizeof(sequence_number);
+      ctx->state      = APNG_STATE_CHUNK_STREAM;
+      break;
+    }
+    case APNG_STATE_CHUNK_STREAM: {
+      const guchar* data  = buf;
+      guint         count = apng_consume(ctx, &buf, &size);
+
+      apng_update_crc(ctx, data, count);
+      if (!apng_process_data(ctx, data, count, error))
+        goto error;
+      if (ctx->chunk_left == 0)
+        ctx->state = APNG_STATE_CHUNK_CRC;
+      break;
+    }
+    case APNG_STATE_CHUNK_SKIP: {
+      const guchar* data  = buf;
+      guint         count = apng_consume(ctx, &buf, &size);
+
+      apng_update_crc(ctx, data, count);
+      if (ctx->chunk_left == 0)
+        ctx->state = APNG_STATE_CHUNK_CRC;
+      break;
+    }
+    case APNG_STATE_CHUNK_CRC:
+      if (!apng_buffer(ctx, &buf, &size, sizeof(guint32)))
+        break;
+
+      if (!apng_check_crc(ctx, ctx->buf, error))
+        goto error;
+
+      ctx->size  = 0;
+      ctx->state = APNG_STATE_CHUNK_HEADER;
+      if (!apng_end_data_chunk(ctx, error))
+        goto error;
+      break;
+    case APNG_STATE_DONE:
+      ctx->off += size;
+      size = 0;
+      break;
+    }
+  }
+
+  ctx->decode_time_us += g_get_monotonic_time() - ctx->decode_start_us;
+
+  return TRUE;
+
+error:
+  ctx->decode_time_us += g_get_monotonic_time() - ctx->decode_start_us;
+  g_clear_pointer(&ctx->frame, gdk_pixbuf_apng_frame_unref);
+
+  return FALSE;
+}
+
+/* Decodes the input held back so far. */
+static gboolean apng_cache_flush(ApngContext* ctx, GError** error) {
+  GByteArray* data = ctx->cache_data;
+  gboolean    retval;
+
+  ctx->cache_data = NULL;
+  retval          = apng_load(ctx, data->data, data->len, error);
+  g_byte_array_unref(data);
+
+  return retval;
+}
+
+/* The first bytes are held back until their hash is known. If it matches a
+ * cached animation, the rest is held back too in case the whole hash
+ * doesn't match, else everything is decoded as usual.
+ */
+static gboolean apng_cache_write(ApngContext* ctx, const guchar* buf,
+                                 guint size, GError** error) {
+  if (ctx->cache_prefix == NULL) {
+    gsize      count = MIN(size, APNG_CACHE_PREFIX_SIZE - ctx->cache_size);
+    GChecksum* prefix;
+
+    g_checksum_update(ctx->cache_hash, buf, count);
+    g_byte_array_append(ctx->cache_data, buf, count);
+    ctx->cache_size += count;
+    buf += count;
+    size -= count;
+    if (ctx->cache_size < APNG_CACHE_PREFIX_SIZE)
+      return TRUE;
+
+    prefix            = g_checksum_copy(ctx->cache_hash);
+    ctx->cache_prefix = g_strdup(g_checksum_get_string(prefix));
+    g_checksum_free(prefix);
+
+    if (!gdk_pixbuf_apng_cache_has_prefix(ctx->cache_prefix) &&
+        !apng_cache_flush(ctx, error))
+      return FALSE;
+  }
+
+  g_checksum_update(ctx->cache_hash, buf, size);
+  if (ctx->cache_data != NULL) {
+    g_byte_array_append(ctx->cache_data, buf, size);
+    return TRUE;
+  }
+
+  return apng_load(ctx, buf, size, error);
+}
+
+/* All the input arrived, shares the cached animation if there is one, or
+ * decodes whatever was held back.
+ */
+static gboolean apng_cache_finish(ApngContext* ctx, GError** error) {
+  GdkPixbufApngAnim*  anim;
+  GdkPixbufApngFrame* frame;
+
+  if (ctx->cache_data == NULL)
+    return TRUE;
+
+  anim = gdk_pixbuf_apng_cache_lookup(g_checksum_get_string(ctx->cache_hash));
+  if (anim == NULL)
+    return apng_cache_flush(ctx, error);
+
+  g_clear_pointer(&ctx->cache_data, g_byte_array_unref);
+  g_object_unref(ctx->anim);
+  ctx->anim      = anim;
+  ctx->cache_hit = TRUE;
+
+  if (ctx->size_func) {
+    gint width  = anim->ihdr.width;
+    gint height = anim->ihdr.height;
+
+    (*ctx->size_func)(&width, &height, ctx->user_data);
+    if (width == 0 || height == 0) {
+      ctx->header_only = TRUE;
+      return TRUE;
+    }
+  }
+
+  frame         = gdk_pixbuf_apng_anim_get_frame(anim, 0);
+  ctx->prepared = TRUE;
+  if (ctx->prepare_func)
+    (*ctx->prepare_func)(frame->pixbuf, GDK_PIXBUF_ANIMATION(anim),
+                         ctx->user_data);
+
+  return TRUE;
+}
+
+static gboolean gdk_pixbuf__apng_image_load_increment(gpointer      context,
+                                                      const guchar* buf,
+                                                      guint         size,
+                                                      GError**      error) {
+  // printf("%s:%d (%s)\n", __FILE__, __LINE__, __func__);
+  ApngContext* ctx = context;
+
+  if (ctx->cache_hash != NULL)
+    return apng_cache_write(ctx, buf, size, error);
+
+  return apng_load(ctx, buf, size, error);
+}
+
+GdkPixbufApngStream* gdk_pixbuf_apng_stream_new(GdkPixbufApngFrameFunc func,
+                                                gpointer user_data,
+                                                GError** error) {
+  ApngContext* ctx;
+
+  g_return_val_if_fail(func != NULL, NULL);
+
+  ctx = gdk_pixbuf__apng_image_begin_load(NULL, NULL, NULL, NULL, error);
+  if (ctx == NULL)
+    return NULL;
+
+  /* Nothing is kept to be shared. */
+  g_clear_pointer(&ctx->cache_hash, g_checksum_free);
+  g_clear_pointer(&ctx->cache_data, g_byte_array_unref);
+
+  ctx->frame_func = func;
+  ctx->frame_data = user_data;
+  ctx->compositor = g_new0(GdkPixbufApngCompositor, 1);
+
+  return ctx;
+}
+
+GdkPixbufApngStream* gdk_pixbuf_apng_stream_new_banded(
+    GdkPixbufApngBandFunc func, guint band_height, gpointer user_data,
+    GError** error) {
+  ApngContext* ctx;
+
+  g_return_val_if_fail(func != NULL, NULL);
+  g_return_val_if_fail(band_height > 0, NULL);
+
+  ctx = gdk_pixbuf__apng_image_begin_load(NULL, NULL, NULL, NULL, error);
+  if (ctx == NULL)
+    return NULL;
+
+  g_clear_pointer(&ctx->cache_hash, g_checksum_free);
+  g_clear_pointer(&ctx->cache_data, g_byte_array_unref);
+
+  ctx->band_func   = func;
+  ctx->band_data   = user_data;
+  ctx->band_height = band_height;
+
+  return ctx;
+}
+
+gboolean gdk_pixbuf_apng_stream_write(GdkPixbufApngStream* stream,
+                                      const guchar* buf, gsize size,
+                                      GError** error) {
+  g_return_val_if_fail(stream != NULL, FALSE);
+
+  /* load_increment takes at most G_MAXUINT bytes at a time. */
+  while (size > 0) {
+    guint count = MIN(size, G_MAXUINT);
+
+    if (!gdk_pixbuf__apng_image_load_increment(stream, buf, count, error))
+      return FALSE;
+    buf += count;
+    size -= count;
+  }
+
+  return TRUE;
+}
+
+gboolean gdk_pixbuf_apng_stream_reset(GdkPixbufApngStream* stream,
+                                      GError**             error) {
+  ApngContext*       ctx = stream;
+  GdkPixbufApngAnim* anim;
+  gboolean           retval;
+
+  g_return_val_if_fail(stream != NULL, FALSE);
+
+  retval = apng_check_complete(ctx, error);
+
+  /* The input buffers, zlib stream, band and pool are kept. The pool stays
+   * within the limits set for the previous canvas until the next IHDR.
+   */
+  anim = g_object_new(GDK_TYPE_PIXBUF_APNG_ANIM, NULL);
+  gdk_pixbuf_apng_pool_unref(anim->pool);
+  anim->pool = gdk_pixbuf_apng_pool_ref(ctx->anim->pool);
+  g_clear_pointer(&ctx->frame, gdk_pixbuf_apng_frame_unref);
+  if (ctx->compositor != NULL)
+    gdk_pixbuf_apng_compositor_clear(ctx->compositor);
+  g_object_unref(ctx->anim);
+  ctx->anim = anim;
+
+  gdk_pixbuf_apng_colour_clear(&ctx->colour);
+  memset(&ctx->colour, 0, sizeof(ctx->colour));
+  memset(&ctx->plte, 0, sizeof(ctx->plte));
+  memset(&ctx->trns, 0, sizeof(ctx->trns));
+
+  ctx->state          = APNG_STATE_SIGNATURE;
+  ctx->header_only    = FALSE;
+  ctx->prepared       = FALSE;
+  ctx->size           = 0;
+  ctx->off            = 0;
+  ctx->decoded_bytes  = 0;
+  ctx->decode_time_us = 0;
+
+  return retval;
+}
+
+gboolean gdk_pixbuf_apng_stream_close(GdkPixbufApngStream* stream,
+                                      GError**             error) {
+  g_return_val_if_fail(stream != NULL, FALSE);
+
+  return gdk_pixbuf__apng_image_stop_load(stream, error);
+}
+
 static GdkPixbufAnimation*
 gdk_pixbuf__apng_image_load_animation(FILE* file, GError** error) {
   // printf("%s:%d (%s)\n", __FILE__, __LINE__, __func__);
-  return g_object_new(GDK_TYPE_PIXBUF_APNG_ANIM, NULL);
+  ApngContext*       ctx;
+  GdkPixbufApngAnim* anim     = NULL;
+  gchar*             identity = NULL;
+  gchar*             key      = NULL;
+  guchar             buf[65536];
+  gsize              count;
+  struct stat        st;
+
+  /* The same file, unchanged, is found without reading it. Times go down
+   * to the nanosecond, and the change time catches rewrites that restore
+   * the modification time.
+   */
+  if (gdk_pixbuf_apng_cache_is_enabled() && fstat(fileno(file), &st) == 0) {
+    identity = g_strdup_printf(
+        "file:%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT
+        ":%" G_GINT64_FORMAT ".%09ld:%" G_GINT64_FORMAT ".%09ld",
+        (guint64)st.st_dev, (guint64)st.st_ino, (guint64)st.st_size,
+        (gint64)st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+        (gint64)st.st_ctim.tv_sec, st.st_ctim.tv_nsec);
+
+    anim = gdk_pixbuf_apng_cache_lookup(identity);
+    if (anim != NULL)
+      goto out;
+  }
+
+  ctx = gdk_pixbuf__apng_image_begin_load(NULL, NULL, NULL, NULL, error);
+  if (ctx == NULL)
+    goto out;
+
+  while ((count = fread(buf, 1, sizeof(buf), file)) > 0)
+    if (!gdk_pixbuf__apng_image_load_increment(ctx, buf, count, error))
+      goto error;
+
+  if (ferror(file)) {
+    g_set_error_literal(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                        "Failed to read APNG file");
+    goto error;
+  }
+
+  /* The cache may replace the animation of the context. */
+  if (ctx->cache_hash != NULL) {
+    if (!apng_cache_finish(ctx, error))
+      goto error;
+    key = g_strdup(g_checksum_get_string(ctx->cache_hash));
+  }
+
+  anim = g_object_ref(ctx->anim);
+  if (!gdk_pixbuf__apng_image_stop_load(ctx, error))
+    g_clear_object(&anim);
+
+  /* No key when the cache got disabled while loading. */
+  if (anim != NULL && identity != NULL && key != NULL)
+    gdk_pixbuf_apng_cache_alias(identity, key);
+  goto out;
+
+error:
+  gdk_pixbuf__apng_image_stop_load(ctx, NULL);
+
+out:
+  g_free(identity);
+  g_free(key);
+
+  return anim != NULL ? GDK_PIXBUF_ANIMATION(anim) : NULL;
+}
+
+static gboolean apng_save_options(gchar** keys, gchar** values,
+                                  gint* compression, GError** error) {
+  *compression = -1;
+
+  for (gsize i = 0; keys != NULL && keys[i] != NULL; ++i) {
+    if (strcmp(keys[i], "compression") == 0) {
+      gchar* end;
+      glong  level = strtol(values[i], &end, 10);
+
+      if (*end != '\0' || end == values[i] || level < 0 || level > 9) {
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_BAD_OPTION,
+                    "APNG compression level must be a value between 0 and "
+                    "9; value '%s' is invalid",
+                    values[i]);
+        return FALSE;
+      }
+      *compression = level;
+    } else {
+      g_warning("Unrecognized parameter (%s) passed to APNG saver.",
+                keys[i]);
+    }
+  }
+
+  return TRUE;
+}
+
+static gboolean
+gdk_pixbuf__apng_image_save_to_callback(GdkPixbufSaveFunc save_func,
+                                        gpointer user_data, GdkPixbuf* pixbuf,
+                                        gchar** keys, gchar** values,
+                                        GError** error) {
+  gint const delay = 0;
+  gint       compression;
+
+  if (!apng_save_options(keys, values, &compression, error))
+    return FALSE;
+
+  return gdk_pixbuf_apng_save_to_callback(save_func, user_data, &pixbuf,
+                                          &delay, 1, 0, compression, error);
+}
+
+static gboolean apng_save_to_file(const gchar* buf, gsize count,
+                                  GError** error, gpointer data) {
+  if (fwrite(buf, 1, count, data) != count) {
+    g_set_error_literal(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                        "Couldn't write to APNG file");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean gdk_pixbuf__apng_image_save(FILE* file, GdkPixbuf* pixbuf,
+                                            gchar** keys, gchar** values,
+                                            GError** error) {
+  return gdk_pixbuf__apng_image_save_to_callback(apng_save_to_file, file,
+                                                 pixbuf, keys, values, error);
 }
 
 #ifndef INCLUDE_apng
@@ -530,10 +1620,12 @@ gdk_pixbuf__apng_image_load_animation(FILE* file, GError** error) {
 #endif
 
 MODULE_ENTRY(fill_vtable)(GdkPixbufModule* module) {
-  module->begin_load     = gdk_pixbuf__apng_image_begin_load;
-  module->stop_load      = gdk_pixbuf__apng_image_stop_load;
-  module->load_increment = gdk_pixbuf__apng_image_load_increment;
-  module->load_animation = gdk_pixbuf__apng_image_load_animation;
+  module->begin_load       = gdk_pixbuf__apng_image_begin_load;
+  module->stop_load        = gdk_pixbuf__apng_image_stop_load;
+  module->load_increment   = gdk_pixbuf__apng_image_load_increment;
+  module->load_animation   = gdk_pixbuf__apng_image_load_animation;
+  module->save             = gdk_pixbuf__apng_image_save;
+  module->save_to_callback = gdk_pixbuf__apng_image_save_to_callback;
 }
 
 MODULE_ENTRY(fill_info)(GdkPixbufFormat* info) {
@@ -549,6 +1641,7 @@ MODULE_ENTRY(fill_info)(GdkPixbufFormat* info) {
   info->description = "APNG image format";
   info->mime_types  = (gchar**)mime_types;
   info->extensions  = (gchar**)extensions;
-  info->flags       = GDK_PIXBUF_FORMAT_THREADSAFE;
+  info->flags       = GDK_PIXBUF_FORMAT_WRITABLE |
+                      GDK_PIXBUF_FORMAT_THREADSAFE;
   info->license     = "UNLICENSE";
 }
@@ -5,6 +5,31 @@
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #undef GDK_PIXBUF_ENABLE_BACKEND
 
+#include <stdio.h>
+#include <zlib.h>
+
+#include "io-apng-colour.h"
+
+#define APNG_FOURCC(a, b, c, d)                                                \
+  (((guint32)(a) << 24) | ((guint32)(b) << 16) | ((guint32)(c) << 8) |         \
+   (guint32)(d))
+
+#define APNG_CHUNK_IHDR APNG_FOURCC('I', 'H', 'D', 'R')
+#define APNG_CHUNK_acTL APNG_FOURCC('a', 'c', 'T', 'L')
+#define APNG_CHUNK_PLTE APNG_FOURCC('P', 'L', 'T', 'E')
+#define APNG_CHUNK_tRNS APNG_FOURCC('t', 'R', 'N', 'S')
+#define APNG_CHUNK_fcTL APNG_FOURCC('f', 'c', 'T', 'L')
+#define APNG_CHUNK_IDAT APNG_FOURCC('I', 'D', 'A', 'T')
+#define APNG_CHUNK_fdAT APNG_FOURCC('f', 'd', 'A', 'T')
+#define APNG_CHUNK_IEND APNG_FOURCC('I', 'E', 'N', 'D')
+#define APNG_CHUNK_gAMA APNG_FOURCC('g', 'A', 'M', 'A')
+#define APNG_CHUNK_cHRM APNG_FOURCC('c', 'H', 'R', 'M')
+#define APNG_CHUNK_sRGB APNG_FOURCC('s', 'R', 'G', 'B')
+#define APNG_CHUNK_iCCP APNG_FOURCC('i', 'C', 'C', 'P')
+
+/* Largest chunk the loader interprets itself, a full PLTE. */
+#define APNG_MAX_HEADER_CHUNK_SIZE (256 * 3)
+
 typedef struct __attribute__((packed)) {
   guint32 width;
   guint32 height;
@@ -32,14 +57,116 @@ typedef struct __attribute__((packed)) {
   guint8  blend_op;
 } ApngChunk_fcTL;
 
+/* Frame delay in microseconds, of an fcTL in host byte order. */
+gint64 gdk_pixbuf_apng_fctl_get_delay_us(const ApngChunk_fcTL* fctl);
+
 typedef struct {
-  gsize   size;
-  guint32 rgba[256];
+  gsize    size;
+  gboolean opaque;
+  guint32  rgba[256];
 } ApngChunk_PLTE;
 
-typedef struct _GdkPixbufApngAnim      GdkPixbufApngAnim;
-typedef struct _GdkPixbufApngAnimClass GdkPixbufApngAnimClass;
-typedef struct _GdkPixbufApngFrame     GdkPixbufApngFrame;
+typedef struct {
+  gboolean present;
+  guint8   rgb[3];
+} ApngChunk_tRNS;
+
+typedef enum {
+  APNG_STATE_SIGNATURE,
+  APNG_STATE_CHUNK_HEADER,
+  APNG_STATE_CHUNK_DATA,
+  APNG_STATE_CHUNK_SEQUENCE,
+  APNG_STATE_CHUNK_STREAM,
+  APNG_STATE_CHUNK_SKIP,
+  APNG_STATE_CHUNK_CRC,
+  APNG_STATE_DONE
+} ApngState;
+
+/* Receives the data of ancillary chunks registered with
+ * gdk_pixbuf_apng_set_chunk_func, chunk_type is the 4 letter chunk name.
+ */
+typedef void (*GdkPixbufApngChunkFunc)(const gchar*  chunk_type,
+                                       const guchar* data, gsize size,
+                                       gpointer user_data);
+
+/* Sets the process-wide list of chunk types, NULL terminated, that loaders
+ * started afterwards hand to func instead of skipping them. Every other
+ * unknown chunk is discarded as it arrives, without being buffered.
+ */
+void gdk_pixbuf_apng_set_chunk_func(const gchar* const*    chunk_types,
+                                    GdkPixbufApngChunkFunc func,
+                                    gpointer               user_data);
+
+/* Caps on what a single loader decodes, zero meaning no limit. Loaders
+ * exceeding one fail with a GError instead of allocating or spending more.
+ */
+typedef struct {
+  /* Canvas width times height, checked at IHDR. */
+  guint64 max_pixels;
+  /* Checked against acTL, then against the frames actually found. */
+  guint32 max_frames;
+  /* Sum of the frame sizes at 4 bytes per pixel, checked at each fcTL, and
+   * of the inflated iCCP profiles.
+   */
+  guint64 max_decoded_bytes;
+  /* Time spent decoding, in microseconds, time waiting for input excluded. */
+  gint64 max_time_us;
+} GdkPixbufApngLimits;
+
+/* Sets the process-wide limits of the loaders started afterwards, NULL
+ * lifts them all.
+ */
+void gdk_pixbuf_apng_set_limits(const GdkPixbufApngLimits* limits);
+void gdk_pixbuf_apng_get_limits(GdkPixbufApngLimits* limits);
+
+/* Makes the loaders started afterwards check the CRC of every chunk, and
+ * fail on the first corrupted one. Chunks the loader interprets are checked
+ * before being used, frames before their pixel buffer is allocated. Banded
+ * streams hold each image data chunk back until it checked out, so their
+ * memory use then also depends on the largest IDAT or fdAT chunk.
+ */
+void gdk_pixbuf_apng_set_verify_crc(gboolean verify);
+
+typedef struct {
+  guint32 width;
+  guint32 height;
+  /* From acTL, zero for a plain PNG. */
+  guint32 num_frames;
+  guint32 num_plays;
+  /* Sum of the frame delays, in milliseconds, rounded down once summed. */
+  guint64 duration;
+} GdkPixbufApngInfo;
+
+/* Reads the animation metadata from the chunk headers only, IDAT and fdAT
+ * payloads are seeked over and never decompressed. The file is left
+ * positioned after the IEND chunk.
+ */
+gboolean gdk_pixbuf_apng_probe_file(FILE* file, GdkPixbufApngInfo* info,
+                                    GError** error);
+gboolean gdk_pixbuf_apng_probe_data(const guchar* data, gsize size,
+                                    GdkPixbufApngInfo* info, GError** error);
+
+typedef struct _GdkPixbufApngAnim       GdkPixbufApngAnim;
+typedef struct _GdkPixbufApngAnimClass  GdkPixbufApngAnimClass;
+typedef struct _GdkPixbufApngFrame      GdkPixbufApngFrame;
+typedef struct _GdkPixbufApngCompositor GdkPixbufApngCompositor;
+
+/* Receives each frame of a streamed animation as soon as it is decoded,
+ * composited onto the canvas, and its delay in milliseconds. The canvas is
+ * RGB or RGBA, it belongs to the stream and is only valid during the call.
+ * Zero delay frames are received too, they aren't merged into the next one
+ * as in loaded animations.
+ */
+typedef void (*GdkPixbufApngFrameFunc)(GdkPixbuf* canvas, gint delay,
+                                       gpointer user_data);
+
+/* Strip mode, receives the rows of the area of frame index starting at row
+ * y, as many as band is high. band is RGBA whatever the image format, it
+ * belongs to the stream and is only valid during the call.
+ */
+typedef void (*GdkPixbufApngBandFunc)(guint index, const ApngChunk_fcTL* fctl,
+                                      GdkPixbuf* band, guint y,
+                                      gpointer user_data);
 
 typedef struct {
   GdkPixbufApngAnim*  anim;
@@ -50,11 +177,103 @@ typedef struct {
   GdkPixbufModuleUpdatedFunc  update_func;
   gpointer                    user_data;
 
+  /* Streaming mode, frames are handed to frame_func instead of being added
+   * to the animation.
+   */
+  GdkPixbufApngFrameFunc   frame_func;
+  gpointer                 frame_data;
+  GdkPixbufApngCompositor* compositor;
+
+  /* Strip mode, frame rows are handed to band_func in bands of band_height
+   * rows as soon as they are unfiltered, frames are never held in full.
+   */
+  GdkPixbufApngBandFunc band_func;
+  gpointer              band_data;
+  GdkPixbuf*            band;
+  guint                 band_height;
+
+  /* Decoded animation cache, the input is hashed as it arrives. Input held
+   * back in cache_data isn't decoded yet.
+   */
+  GChecksum*  cache_hash;
+  gchar*      cache_prefix;
+  GByteArray* cache_data;
+  /* Bytes hashed so far, up to APNG_CACHE_PREFIX_SIZE. */
+  gsize       cache_size;
+  gboolean    cache_hit;
+
+  ApngState state;
+  /* The size_func asked for an empty image, only the header was wanted. */
+  gboolean header_only;
+  /* The prepare_func was called, once the first frame got added. */
+  gboolean  prepared;
+  guint32   chunk_type;
+  guint32   chunk_size;
+  guint32   chunk_left;
+  gsize     chunk_offset;
+
+  /* Chunk header, CRC and interpreted chunk data being accumulated. */
   guchar* buf;
-  gsize   off;
+  gsize   buf_size;
   gsize   size;
+  /* Offset of the next input byte in the file. */
+  gsize off;
+
+  guchar*  scratch;
+  gsize    scratch_size;
+  z_stream zstream;
+  gboolean zstream_init;
+
+  guint32*               chunk_types;
+  gsize                  n_chunk_types;
+  GdkPixbufApngChunkFunc chunk_func;
+  gpointer               chunk_data;
+
+  /* Running CRC of the current chunk, checked when verify_crc is set. */
+  gboolean verify_crc;
+  guint32  chunk_crc;
+
+  GdkPixbufApngLimits limits;
+  /* Frame bytes accounted for so far, at 4 bytes per pixel. */
+  guint64 decoded_bytes;
+  /* Time spent in earlier calls, and start of the current one. */
+  gint64 decode_time_us;
+  gint64 decode_start_us;
 
   ApngChunk_PLTE plte;
+  ApngChunk_tRNS trns;
+  /* Applied to the palette, or to each row as it is converted. */
+  ApngColour colour;
 } ApngContext;
 
+/* Decodes an animation without keeping its frames, memory use only depends
+ * on the canvas size: each frame is freed once composited, and at most two
+ * canvases worth of buffers are kept for reuse. Data is fed with
+ * gdk_pixbuf_apng_stream_write, and gdk_pixbuf_apng_stream_close frees the
+ * stream, failing if the data was incomplete.
+ */
+typedef ApngContext GdkPixbufApngStream;
+
+GdkPixbufApngStream* gdk_pixbuf_apng_stream_new(GdkPixbufApngFrameFunc func,
+                                                gpointer user_data,
+                                                GError** error);
+/* Strip mode stream, frames aren't composited and only two rows of the
+ * current frame and one band are kept, whatever the image size. Each frame
+ * is handed to func, area and ops included, band_height rows at a time.
+ */
+GdkPixbufApngStream* gdk_pixbuf_apng_stream_new_banded(
+    GdkPixbufApngBandFunc func, guint band_height, gpointer user_data,
+    GError** error);
+gboolean gdk_pixbuf_apng_stream_write(GdkPixbufApngStream* stream,
+                                      const guchar* buf, gsize size,
+                                      GError** error);
+/* Ends the current data like gdk_pixbuf_apng_stream_close, but leaves the
+ * stream ready for another animation, reusing its buffers, pooled pixel
+ * buffers included.
+ */
+gboolean gdk_pixbuf_apng_stream_reset(GdkPixbufApngStream* stream,
+                                      GError**             error);
+gboolean gdk_pixbuf_apng_stream_close(GdkPixbufApngStream* stream,
+                                      GError**             error);
+
 #endif // IO_APNG_H
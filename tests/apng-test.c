@@ -0,0 +1,2056 @@
+/* Behaviour checks of the loader, run by ctest. The fixtures are built by
+ * the helpers below rather than stored, so that each test shows the chunks
+ * it feeds the loader.
+ */
+#include <glib/gstdio.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "io-apng-animation.h"
+#include "io-apng-cache.h"
+#include "io-apng-save.h"
+
+/* The module entry points, the loader isn't installed for the tests. */
+void fill_vtable(GdkPixbufModule* module);
+
+typedef struct {
+  guint  x, y, width, height;
+  guint  delay;
+  guint8 dispose_op;
+  guint8 blend_op;
+  /* Every pixel of the frame, as 0xRRGGBBAA, alpha ignored for colour type
+   * 2. The palette index for colour type 3.
+   */
+  guint32 colour;
+} TestFrame;
+
+typedef struct {
+  GByteArray* data;
+  guint       width;
+  guint       height;
+  guint32     sequence;
+  /* Largest IDAT or fdAT payload, frame data is split over several chunks
+   * past it.
+   */
+  gsize split;
+  /* Denominator of the frame delays, 1000 unless changed. */
+  guint16 delay_den;
+  guint8  colour_type;
+} TestApng;
+
+static void test_be32(guchar* p, guint32 v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+/* Appends a chunk, CRC included. */
+static void test_chunk(TestApng* apng, const gchar* type, const guchar* data,
+                       gsize size) {
+  guchar  be[4];
+  guint32 crc = crc32(0, (const Bytef*)type, 4);
+
+  if (size > 0)
+    crc = crc32(crc, data, size);
+
+  test_be32(be, size);
+  g_byte_array_append(apng->data, be, 4);
+  g_byte_array_append(apng->data, (const guint8*)type, 4);
+  g_byte_array_append(apng->data, data, size);
+  test_be32(be, crc);
+  g_byte_array_append(apng->data, be, 4);
+}
+
+/* Starts an 8-bit animation of n_frames frames, of colour type 2, 3 or 6.
+ * The PLTE and tRNS chunks are left to the caller.
+ */
+static void test_apng_init_type(TestApng* apng, guint width, guint height,
+                                guint n_frames, guint8 colour_type) {
+  static const guchar signature[] = {0x89, 'P',  'N',  'G',
+                                     '\r', '\n', 0x1a, '\n'};
+  guchar              ihdr[13]    = {0};
+  guchar              actl[8]     = {0};
+
+  apng->data        = g_byte_array_new();
+  apng->width       = width;
+  apng->height      = height;
+  apng->sequence    = 0;
+  apng->split       = 0;
+  apng->delay_den   = 1000;
+  apng->colour_type = colour_type;
+
+  g_byte_array_append(apng->data, signature, sizeof(signature));
+  test_be32(ihdr, width);
+  test_be32(ihdr + 4, height);
+  ihdr[8] = 8;
+  ihdr[9] = colour_type;
+  test_chunk(apng, "IHDR", ihdr, sizeof(ihdr));
+  test_be32(actl, n_frames);
+  test_chunk(apng, "acTL", actl, sizeof(actl));
+}
+
+/* Starts an 8-bit RGBA animation of n_frames frames. */
+static void test_apng_init(TestApng* apng, guint width, guint height,
+                           guint n_frames) {
+  test_apng_init_type(apng, width, height, n_frames, 6);
+}
+
+/* Appends a frame, the first one goes in IDAT chunks. */
+static void test_apng_frame(TestApng* apng, const TestFrame* f) {
+  gsize   bpp      = apng->colour_type == 6   ? 4
+                     : apng->colour_type == 2 ? 3
+                                              : 1;
+  gsize   raw_size = (gsize)(f->width * bpp + 1) * f->height;
+  guchar* raw      = g_malloc0(raw_size);
+  uLongf  size     = compressBound(raw_size);
+  guchar* data     = g_malloc(size + 4);
+  guchar  sample[4];
+  guchar  fctl[26];
+  gsize   split;
+
+  test_be32(sample, f->colour);
+  if (apng->colour_type == 3)
+    sample[0] = f->colour;
+  for (guint y = 0; y < f->height; ++y)
+    for (guint x = 0; x < f->width; ++x)
+      memcpy(raw + y * (f->width * bpp + 1) + 1 + x * bpp, sample, bpp);
+  g_assert_cmpint(compress(data + 4, &size, raw, raw_size), ==, Z_OK);
+
+  test_be32(fctl, apng->sequence++);
+  test_be32(fctl + 4, f->width);
+  test_be32(fctl + 8, f->height);
+  test_be32(fctl + 12, f->x);
+  test_be32(fctl + 16, f->y);
+  fctl[20] = f->delay >> 8;
+  fctl[21] = f->delay;
+  fctl[22] = apng->delay_den >> 8;
+  fctl[23] = apng->delay_den & 0xff;
+  fctl[24] = f->dispose_op;
+  fctl[25] = f->blend_op;
+  test_chunk(apng, "fcTL", fctl, sizeof(fctl));
+
+  split = apng->split > 0 ? apng->split : size;
+  for (gsize off = 0; off < size; off += split) {
+    gsize count = MIN(split, size - off);
+
+    if (apng->sequence == 1) {
+      test_chunk(apng, "IDAT", data + 4 + off, count);
+    } else {
+      /* The sequence number goes right before the payload. */
+      guchar* fdat = g_malloc(count + 4);
+
+      test_be32(fdat, apng->sequence++);
+      memcpy(fdat + 4, data + 4 + off, count);
+      test_chunk(apng, "fdAT", fdat, count + 4);
+      g_free(fdat);
+    }
+  }
+
+  g_free(data);
+  g_free(raw);
+}
+
+static GByteArray* test_apng_finish(TestApng* apng) {
+  test_chunk(apng, "IEND", NULL, 0);
+  return apng->data;
+}
+
+/* Builds an animation of frames on a width x height canvas. */
+static GByteArray* test_apng_new(guint width, guint height,
+                                 const TestFrame* frames, guint n_frames) {
+  TestApng apng;
+
+  test_apng_init(&apng, width, height, n_frames);
+  for (guint i = 0; i < n_frames; ++i)
+    test_apng_frame(&apng, &frames[i]);
+
+  return test_apng_finish(&apng);
+}
+
+static void test_prepared(GdkPixbuf* pixbuf, GdkPixbufAnimation* anim,
+                          gpointer user_data) {
+  GdkPixbufAnimation** result = user_data;
+
+  if (*result == NULL)
+    *result = g_object_ref(anim);
+}
+
+/* Loads data through the module, step bytes at a time. */
+static GdkPixbufApngAnim* test_load(GByteArray* data, gsize step,
+                                    GError** error) {
+  GdkPixbufModule     module = {0};
+  GdkPixbufAnimation* anim   = NULL;
+  gpointer            ctx;
+
+  fill_vtable(&module);
+  ctx = module.begin_load(NULL, test_prepared, NULL, &anim, error);
+  if (ctx == NULL)
+    return NULL;
+
+  for (gsize off = 0; off < data->len; off += step) {
+    if (!module.load_increment(ctx, data->data + off,
+                               MIN(step, data->len - off), error)) {
+      module.stop_load(ctx, NULL);
+      g_clear_object(&anim);
+      return NULL;
+    }
+  }
+  if (!module.stop_load(ctx, error))
+    g_clear_object(&anim);
+
+  return anim != NULL ? GDK_PIXBUF_APNG_ANIM(anim) : NULL;
+}
+
+/* Pixel at x, y as 0xRRGGBBAA. */
+static guint32 test_pixel(GdkPixbuf* pixbuf, gint x, gint y) {
+  const guchar* p = gdk_pixbuf_get_pixels(pixbuf) +
+                    y * gdk_pixbuf_get_rowstride(pixbuf) +
+                    x * gdk_pixbuf_get_n_channels(pixbuf);
+
+  return ((guint32)p[0] << 24) | ((guint32)p[1] << 16) | ((guint32)p[2] << 8) |
+         (gdk_pixbuf_get_has_alpha(pixbuf) ? p[3] : 0xff);
+}
+
+static void test_assert_pixel_near(guint32 pixel, guint32 expected) {
+  for (guint shift = 0; shift < 32; shift += 8) {
+    gint a = (pixel >> shift) & 0xff;
+    gint b = (expected >> shift) & 0xff;
+
+    g_assert_cmpint(ABS(a - b), <=, 3);
+  }
+}
+
+static void test_assert_rect(const GdkPixbufApngRect* rect, gint x, gint y,
+                             gint width, gint height) {
+  g_assert_cmpint(rect->x, ==, x);
+  g_assert_cmpint(rect->y, ==, y);
+  g_assert_cmpint(rect->width, ==, width);
+  g_assert_cmpint(rect->height, ==, height);
+}
+
+static void test_pool_reuse(void) {
+  GdkPixbufApngPool* pool = gdk_pixbuf_apng_pool_new();
+  GdkPixbuf*         pixbuf;
+  guchar*            pixels;
+  guint              n_blocks;
+
+  pixbuf = gdk_pixbuf_apng_pool_new_pixbuf(pool, TRUE, 16, 8);
+  pixels = gdk_pixbuf_get_pixels(pixbuf);
+  g_object_unref(pixbuf);
+  g_assert_cmpuint(gdk_pixbuf_apng_pool_get_retained(pool, &n_blocks), ==,
+                   16 * 8 * 4);
+  g_assert_cmpuint(n_blocks, ==, 1);
+
+  /* Same byte length, whatever the shape. */
+  pixbuf = gdk_pixbuf_apng_pool_new_pixbuf(pool, TRUE, 8, 16);
+  g_assert_true(gdk_pixbuf_get_pixels(pixbuf) == pixels);
+  g_assert_cmpuint(gdk_pixbuf_apng_pool_get_retained(pool, NULL), ==, 0);
+  g_object_unref(pixbuf);
+
+  gdk_pixbuf_apng_pool_unref(pool);
+}
+
+static void test_pool_bounds(void) {
+  GdkPixbufApngPool* pool = gdk_pixbuf_apng_pool_new();
+  GdkPixbuf*         pixbufs[8];
+  guint              n_blocks;
+  gsize              retained;
+
+  gdk_pixbuf_apng_pool_set_limits(pool, 2, 1 << 20);
+  for (guint i = 0; i < G_N_ELEMENTS(pixbufs); ++i)
+    pixbufs[i] = gdk_pixbuf_apng_pool_new_pixbuf(pool, TRUE, 16, 16);
+  for (guint i = 0; i < G_N_ELEMENTS(pixbufs); ++i)
+    g_object_unref(pixbufs[i]);
+  g_assert_cmpuint(gdk_pixbuf_apng_pool_get_retained(pool, &n_blocks), ==,
+                   2 * 16 * 16 * 4);
+  g_assert_cmpuint(n_blocks, ==, 2);
+
+  /* Every size seen is kept until the byte bound is reached, the oldest
+   * ones go first.
+   */
+  gdk_pixbuf_apng_pool_set_limits(pool, 2, 4096);
+  for (gint size = 1; size <= 64; ++size)
+    g_object_unref(gdk_pixbuf_apng_pool_new_pixbuf(pool, TRUE, size, 1));
+  retained = gdk_pixbuf_apng_pool_get_retained(pool, &n_blocks);
+  g_assert_cmpuint(retained, <=, 4096);
+  g_assert_cmpuint(n_blocks, <, 64);
+  pixbufs[0] = gdk_pixbuf_apng_pool_new_pixbuf(pool, TRUE, 64, 1);
+  g_assert_cmpuint(gdk_pixbuf_apng_pool_get_retained(pool, NULL), ==,
+                   retained - 64 * 4);
+  g_object_unref(pixbufs[0]);
+
+  gdk_pixbuf_apng_pool_set_limits(pool, 0, 0);
+  g_assert_cmpuint(gdk_pixbuf_apng_pool_get_retained(pool, &n_blocks), ==, 0);
+  g_assert_cmpuint(n_blocks, ==, 0);
+
+  gdk_pixbuf_apng_pool_unref(pool);
+}
+
+static void test_damage(void) {
+  static const TestFrame frames[] = {
+      {0, 0, 8, 8, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0xff0000ff},
+      {0, 0, 2, 2, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x00ff00ff},
+      {4, 4, 2, 2, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x0000ffff},
+  };
+  GByteArray*            data  = test_apng_new(8, 8, frames, 3);
+  GError*                error = NULL;
+  GdkPixbufApngAnim*     anim  = test_load(data, data->len, &error);
+  GdkPixbufApngAnimIter* iter;
+  GdkPixbufApngRect      damage;
+  GTimeVal               time = {0, 0};
+
+  g_assert_no_error(error);
+  iter = GDK_PIXBUF_APNG_ANIM_ITER(
+      gdk_pixbuf_animation_get_iter(GDK_PIXBUF_ANIMATION(anim), &time));
+
+  g_assert_true(gdk_pixbuf_apng_anim_iter_get_damage(iter, &damage));
+  test_assert_rect(&damage, 0, 0, 8, 8);
+  g_assert_true(gdk_pixbuf_apng_anim_iter_get_damage(iter, &damage));
+  test_assert_rect(&damage, 0, 0, 8, 8);
+
+  /* Frame after frame, only the frame areas change. */
+  time.tv_usec = 100000;
+  gdk_pixbuf_animation_iter_advance(GDK_PIXBUF_ANIMATION_ITER(iter), &time);
+  g_assert_true(gdk_pixbuf_apng_anim_iter_get_damage(iter, &damage));
+  test_assert_rect(&damage, 0, 0, 2, 2);
+  time.tv_usec = 200000;
+  gdk_pixbuf_animation_iter_advance(GDK_PIXBUF_ANIMATION_ITER(iter), &time);
+  g_assert_true(gdk_pixbuf_apng_anim_iter_get_damage(iter, &damage));
+  test_assert_rect(&damage, 4, 4, 2, 2);
+
+  /* Jumping backwards, or over a frame, damages everything. */
+  g_assert_true(gdk_pixbuf_apng_anim_iter_seek_frame(iter, 1));
+  g_assert_true(gdk_pixbuf_apng_anim_iter_get_damage(iter, &damage));
+  test_assert_rect(&damage, 0, 0, 8, 8);
+  g_assert_true(gdk_pixbuf_apng_anim_iter_seek_frame(iter, 0));
+  g_assert_true(gdk_pixbuf_apng_anim_iter_get_damage(iter, &damage));
+  g_assert_true(gdk_pixbuf_apng_anim_iter_seek_time(iter, 250));
+  g_assert_true(gdk_pixbuf_apng_anim_iter_get_damage(iter, &damage));
+  test_assert_rect(&damage, 0, 0, 8, 8);
+
+  /* Wrapping around too. */
+  time.tv_usec = 300000;
+  gdk_pixbuf_animation_iter_advance(GDK_PIXBUF_ANIMATION_ITER(iter), &time);
+  g_assert_true(gdk_pixbuf_apng_anim_iter_get_damage(iter, &damage));
+  test_assert_rect(&damage, 0, 0, 8, 8);
+
+  g_object_unref(iter);
+  g_object_unref(anim);
+  g_byte_array_unref(data);
+}
+
+static void test_chunk_func(const gchar* chunk_type, const guchar* data,
+                            gsize size, gpointer user_data) {
+  GString* chunks = user_data;
+
+  g_string_append_printf(chunks, "%s:%.*s;", chunk_type, (gint)size, data);
+}
+
+/* Canvas of every frame, composited from the first one. */
+static GPtrArray* test_canvases(GdkPixbufApngAnim* anim) {
+  GPtrArray*              canvases   = g_ptr_array_new();
+  GdkPixbufApngCompositor compositor = {NULL};
+
+  g_ptr_array_set_free_func(canvases, g_object_unref);
+
+  for (guint i = 0; i < anim->n_frames; ++i) {
+    GdkPixbuf* canvas = gdk_pixbuf_apng_compositor_seek(
+        &compositor, anim, gdk_pixbuf_apng_anim_get_frame(anim, i));
+
+    g_assert_nonnull(canvas);
+    g_ptr_array_add(canvases, gdk_pixbuf_copy(canvas));
+  }
+  gdk_pixbuf_apng_compositor_clear(&compositor);
+
+  return canvases;
+}
+
+static void test_assert_same_canvases(GPtrArray* a, GPtrArray* b) {
+  g_assert_cmpuint(a->len, ==, b->len);
+  for (guint i = 0; i < a->len; ++i) {
+    GdkPixbuf* pa = g_ptr_array_index(a, i);
+    GdkPixbuf* pb = g_ptr_array_index(b, i);
+
+    g_assert_cmpint(gdk_pixbuf_get_width(pa), ==, gdk_pixbuf_get_width(pb));
+    g_assert_cmpint(gdk_pixbuf_get_height(pa), ==, gdk_pixbuf_get_height(pb));
+    for (gint y = 0; y < gdk_pixbuf_get_height(pa); ++y)
+      for (gint x = 0; x < gdk_pixbuf_get_width(pa); ++x)
+        g_assert_cmphex(test_pixel(pa, x, y), ==, test_pixel(pb, x, y));
+  }
+}
+
+/* Frames that each build on the canvas left by the previous one. */
+static const TestFrame test_steps[] = {
+    {0, 0, 8, 8, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x202020ff},
+    {0, 0, 3, 3, 100, APNG_DISPOSE_OP_BACKGROUND, APNG_BLEND_OP_SOURCE,
+     0xff0000ff},
+    {2, 2, 4, 4, 100, APNG_DISPOSE_OP_PREVIOUS, APNG_BLEND_OP_OVER,
+     0x00ff0080},
+    {5, 1, 3, 6, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x0000ffff},
+    {1, 4, 6, 2, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_OVER, 0xffff0040},
+    {0, 0, 8, 1, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0xffffffff},
+};
+
+static void test_assert_same_pixels(GdkPixbuf* a, GdkPixbuf* b) {
+  g_assert_cmpint(gdk_pixbuf_get_width(a), ==, gdk_pixbuf_get_width(b));
+  g_assert_cmpint(gdk_pixbuf_get_height(a), ==, gdk_pixbuf_get_height(b));
+  for (gint y = 0; y < gdk_pixbuf_get_height(a); ++y)
+    for (gint x = 0; x < gdk_pixbuf_get_width(a); ++x)
+      g_assert_cmphex(test_pixel(a, x, y), ==, test_pixel(b, x, y));
+}
+
+/* Keyframes: the first frame, a covering SOURCE frame, the frame after a
+ * covering BACKGROUND one, and a covering opaque OVER frame. PREVIOUS
+ * frames never are, covering SOURCE ones included.
+ */
+static const TestFrame test_seek_steps[] = {
+    {0, 0, 8, 8, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x000000ff},
+    {2, 2, 4, 4, 150, APNG_DISPOSE_OP_PREVIOUS, APNG_BLEND_OP_OVER,
+     0xff000080},
+    {0, 0, 4, 4, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_OVER, 0x00ff00ff},
+    {0, 0, 8, 8, 100, APNG_DISPOSE_OP_BACKGROUND, APNG_BLEND_OP_SOURCE,
+     0x0000ff80},
+    {4, 4, 4, 4, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_OVER, 0xffff00ff},
+    {0, 0, 8, 8, 50, APNG_DISPOSE_OP_PREVIOUS, APNG_BLEND_OP_SOURCE,
+     0x00ffff40},
+    {0, 0, 2, 2, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0xffffffff},
+    {0, 0, 8, 8, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_OVER, 0x123456ff},
+};
+
+/* Seeking composites from the closest keyframe, backwards across PREVIOUS
+ * frames included, and gives the canvases of sequential compositing.
+ */
+static void test_seek(void) {
+  static const gboolean keyframes[] = {TRUE, FALSE, FALSE, TRUE,
+                                       TRUE, FALSE, FALSE, TRUE};
+  static const gint64   starts[]    = {0, 100, 250, 350, 450, 550, 600, 700};
+  GByteArray*             data  = test_apng_new(8, 8, test_seek_steps,
+                                                G_N_ELEMENTS(test_seek_steps));
+  GError*                 error = NULL;
+  GdkPixbufApngAnim*      anim  = test_load(data, data->len, &error);
+  GTimeVal                time  = {0, 0};
+  GdkPixbufApngFrameInfo  info;
+  GdkPixbufAnimationIter* iter;
+  GdkPixbufApngAnimIter*  apng;
+  GPtrArray*              canvases;
+
+  g_assert_no_error(error);
+  g_assert_cmpuint(anim->n_frames, ==, G_N_ELEMENTS(test_seek_steps));
+
+  for (guint i = 0; i < G_N_ELEMENTS(test_seek_steps); ++i) {
+    const TestFrame* f = &test_seek_steps[i];
+
+    g_assert_true(gdk_pixbuf_apng_anim_get_frame_info(anim, i, &info));
+    test_assert_rect(&info.area, f->x, f->y, f->width, f->height);
+    g_assert_cmpint(info.dispose_op, ==, f->dispose_op);
+    g_assert_cmpint(info.blend_op, ==, f->blend_op);
+    g_assert_cmpint(info.start, ==, starts[i]);
+    g_assert_cmpint(info.delay, ==, f->delay);
+    g_assert_cmpint(info.keyframe, ==, keyframes[i]);
+    g_assert_cmpmem(data->data + info.fctl_offset + 4, 4, "fcTL", 4);
+    g_assert_cmpmem(data->data + info.data_offset + 4, 4,
+                    i == 0 ? "IDAT" : "fdAT", 4);
+  }
+  g_assert_false(gdk_pixbuf_apng_anim_get_frame_info(
+      anim, G_N_ELEMENTS(test_seek_steps), &info));
+
+  canvases = test_canvases(anim);
+  iter = gdk_pixbuf_animation_get_iter(GDK_PIXBUF_ANIMATION(anim), &time);
+  apng = GDK_PIXBUF_APNG_ANIM_ITER(iter);
+
+  /* From every frame to every other one, forwards and backwards. */
+  for (guint i = 0; i < canvases->len; ++i) {
+    for (guint j = 0; j < canvases->len; ++j) {
+      g_assert_true(gdk_pixbuf_apng_anim_iter_seek_frame(apng, i));
+      test_assert_same_pixels(gdk_pixbuf_animation_iter_get_pixbuf(iter),
+                              g_ptr_array_index(canvases, i));
+      g_assert_true(gdk_pixbuf_apng_anim_iter_seek_frame(apng, j));
+      g_assert_cmpuint(apng->current_frame, ==, j);
+      test_assert_same_pixels(gdk_pixbuf_animation_iter_get_pixbuf(iter),
+                              g_ptr_array_index(canvases, j));
+    }
+  }
+
+  /* Backwards in time, from the middle of each frame. */
+  for (guint i = canvases->len; i-- > 0;) {
+    g_assert_true(gdk_pixbuf_apng_anim_iter_seek_time(
+        apng, starts[i] + test_seek_steps[i].delay / 2));
+    g_assert_cmpuint(apng->current_frame, ==, i);
+    test_assert_same_pixels(gdk_pixbuf_animation_iter_get_pixbuf(iter),
+                            g_ptr_array_index(canvases, i));
+  }
+
+  g_object_unref(iter);
+  g_ptr_array_unref(canvases);
+  g_object_unref(anim);
+  g_byte_array_unref(data);
+}
+
+/* A pixbuf the caller kept a reference to stays as it was handed out. */
+static void test_held_pixbuf(void) {
+  GByteArray*        data  = test_apng_new(8, 8, test_steps, 3);
+  GError*            error = NULL;
+  GdkPixbufApngAnim* anim  = test_load(data, data->len, &error);
+
+  g_assert_no_error(error);
+
+  for (guint premultiplied = 0; premultiplied < 2; ++premultiplied) {
+    GdkPixbufAnimationIter* iter;
+    GdkPixbuf*              held;
+    GdkPixbuf*              copy;
+    GTimeVal                time = {0, 0};
+
+    gdk_pixbuf_apng_anim_set_premultiplied(anim, premultiplied);
+    iter = gdk_pixbuf_animation_get_iter(GDK_PIXBUF_ANIMATION(anim), &time);
+
+    for (guint i = 1; i < 3; ++i) {
+      held = g_object_ref(gdk_pixbuf_animation_iter_get_pixbuf(iter));
+      copy = gdk_pixbuf_copy(held);
+
+      time.tv_usec = i * 100000;
+      g_assert_true(gdk_pixbuf_animation_iter_advance(iter, &time));
+      g_assert_true(gdk_pixbuf_animation_iter_get_pixbuf(iter) != held);
+      test_assert_same_pixels(held, copy);
+
+      g_object_unref(copy);
+      g_object_unref(held);
+    }
+
+    g_object_unref(iter);
+  }
+
+  g_object_unref(anim);
+  g_byte_array_unref(data);
+}
+
+typedef struct {
+  GdkPixbufApngAnim* anim;
+  GPtrArray*         canvases;
+  gint               done;
+} TestShared;
+
+/* Reads straight canvases while the main thread toggles the mode. */
+static gpointer test_toggle_thread(gpointer data) {
+  TestShared*             shared = data;
+  GdkPixbufAnimation*     anim   = GDK_PIXBUF_ANIMATION(shared->anim);
+  GTimeVal                time   = {0, 0};
+  GdkPixbufAnimationIter* iter   = gdk_pixbuf_animation_get_iter(anim, &time);
+  GdkPixbufApngAnimIter*  apng   = GDK_PIXBUF_APNG_ANIM_ITER(iter);
+
+  for (guint i = 0; i < 500; ++i) {
+    guint      index    = i % shared->canvases->len;
+    GdkPixbuf* expected = g_ptr_array_index(shared->canvases, index);
+    GdkPixbuf* pixbuf;
+
+    g_assert_true(gdk_pixbuf_apng_anim_iter_seek_frame(apng, index));
+    gdk_pixbuf_apng_anim_iter_get_argb32(apng, NULL, NULL, NULL);
+    pixbuf = gdk_pixbuf_animation_iter_get_pixbuf(iter);
+    g_assert_true(gdk_pixbuf_get_has_alpha(pixbuf));
+    for (gint x = 0; x < gdk_pixbuf_get_width(pixbuf); ++x)
+      test_assert_pixel_near(test_pixel(pixbuf, x, 0),
+                             test_pixel(expected, x, 0));
+  }
+
+  g_object_unref(iter);
+  g_atomic_int_inc(&shared->done);
+
+  return NULL;
+}
+
+static const TestFrame test_alpha_steps[] = {
+    {0, 0, 2, 1, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x80402080},
+    {0, 0, 1, 1, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_OVER, 0x00ff0080},
+    {1, 0, 1, 1, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x204080ff},
+    {1, 0, 1, 1, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_OVER, 0xffffff40},
+};
+
+/* Native endian ARGB32 pixels of the canvas after each frame, worked out
+ * by hand from the straight colours above.
+ */
+static const guint32 test_alpha_argb32[][2] = {
+    {0x80402010, 0x80402010},
+    {0xc0209008, 0x80402010},
+    {0xc0209008, 0xff204080},
+    {0xc0209008, 0xff5870a0},
+};
+
+/* And the same once unpremultiplied, as 0xRRGGBBAA. */
+static const guint32 test_alpha_straight[][2] = {
+    {0x80402080, 0x80402080},
+    {0x2bbf0bc0, 0x80402080},
+    {0x2bbf0bc0, 0x204080ff},
+    {0x2bbf0bc0, 0x5870a0ff},
+};
+
+/* Premultiplies, composites over and unpremultiplies known alpha values. */
+static void test_argb32(void) {
+  GByteArray*             data  = test_apng_new(2, 1, test_alpha_steps,
+                                                G_N_ELEMENTS(test_alpha_steps));
+  GError*                 error = NULL;
+  GdkPixbufApngAnim*      anim  = test_load(data, data->len, &error);
+  GTimeVal                time  = {0, 0};
+  GdkPixbufAnimationIter* iter;
+  GdkPixbufApngAnimIter*  apng;
+  TestShared              shared;
+  GThread*                threads[4];
+
+  g_assert_no_error(error);
+  iter = gdk_pixbuf_animation_get_iter(GDK_PIXBUF_ANIMATION(anim), &time);
+  apng = GDK_PIXBUF_APNG_ANIM_ITER(iter);
+
+  /* Straight canvases have no ARGB32 form. */
+  g_assert_null(gdk_pixbuf_apng_anim_iter_get_argb32(apng, NULL, NULL, NULL));
+
+  gdk_pixbuf_apng_anim_set_premultiplied(anim, TRUE);
+  g_assert_true(gdk_pixbuf_apng_anim_get_premultiplied(anim));
+  for (guint i = 0; i < G_N_ELEMENTS(test_alpha_steps); ++i) {
+    const guchar* argb32;
+    GdkPixbuf*    pixbuf;
+    gint          width, height, stride;
+
+    g_assert_true(gdk_pixbuf_apng_anim_iter_seek_frame(apng, i));
+    argb32 = gdk_pixbuf_apng_anim_iter_get_argb32(apng, &width, &height,
+                                                  &stride);
+    g_assert_nonnull(argb32);
+    g_assert_cmpint(width, ==, 2);
+    g_assert_cmpint(height, ==, 1);
+    g_assert_cmpint(stride, >=, 8);
+    for (guint x = 0; x < 2; ++x)
+      g_assert_cmphex(((const guint32*)argb32)[x], ==,
+                      test_alpha_argb32[i][x]);
+
+    pixbuf = gdk_pixbuf_animation_iter_get_pixbuf(iter);
+    g_assert_true(gdk_pixbuf_get_has_alpha(pixbuf));
+    for (guint x = 0; x < 2; ++x)
+      g_assert_cmphex(test_pixel(pixbuf, x, 0), ==, test_alpha_straight[i][x]);
+  }
+
+  /* Straight compositing rounds once, premultiplied thrice. */
+  gdk_pixbuf_apng_anim_set_premultiplied(anim, FALSE);
+  for (guint i = 0; i < G_N_ELEMENTS(test_alpha_steps); ++i) {
+    GdkPixbuf* pixbuf;
+
+    g_assert_true(gdk_pixbuf_apng_anim_iter_seek_frame(apng, i));
+    g_assert_null(gdk_pixbuf_apng_anim_iter_get_argb32(apng, NULL, NULL,
+                                                       NULL));
+    pixbuf = gdk_pixbuf_animation_iter_get_pixbuf(iter);
+    for (guint x = 0; x < 2; ++x)
+      test_assert_pixel_near(test_pixel(pixbuf, x, 0),
+                             test_alpha_straight[i][x]);
+  }
+  g_object_unref(iter);
+
+  /* Iterators on other threads see either mode, never half of one. */
+  shared.anim     = anim;
+  shared.canvases = test_canvases(anim);
+  shared.done     = 0;
+  for (guint i = 0; i < G_N_ELEMENTS(threads); ++i)
+    threads[i] = g_thread_new("apng-test", test_toggle_thread, &shared);
+  while (g_atomic_int_get(&shared.done) < (gint)G_N_ELEMENTS(threads))
+    gdk_pixbuf_apng_anim_set_premultiplied(
+        anim, !gdk_pixbuf_apng_anim_get_premultiplied(anim));
+  for (guint i = 0; i < G_N_ELEMENTS(threads); ++i)
+    g_thread_join(threads[i]);
+
+  g_ptr_array_unref(shared.canvases);
+  g_object_unref(anim);
+  g_byte_array_unref(data);
+}
+
+/* Steps an iterator of its own back and forth over the shared animation. */
+static gpointer test_iter_thread(gpointer data) {
+  TestShared*             shared = data;
+  GdkPixbufAnimation*     anim   = GDK_PIXBUF_ANIMATION(shared->anim);
+  GTimeVal                time   = {0, 0};
+  GdkPixbufAnimationIter* iter   = gdk_pixbuf_animation_get_iter(anim, &time);
+  GdkPixbufApngAnimIter*  apng   = GDK_PIXBUF_APNG_ANIM_ITER(iter);
+
+  for (guint i = 0; i < 200; ++i) {
+    GdkPixbufApngRect damage;
+    guint             index = (i * 7) % G_N_ELEMENTS(test_steps);
+
+    if (i % 3 == 0) {
+      g_assert_true(gdk_pixbuf_apng_anim_iter_seek_frame(apng, index));
+    } else if (i % 3 == 1) {
+      g_assert_true(gdk_pixbuf_apng_anim_iter_seek_time(apng, index * 100));
+    } else {
+      index = (apng->current_frame + 1) % G_N_ELEMENTS(test_steps);
+      g_time_val_add(&time, 100000);
+      g_assert_true(gdk_pixbuf_animation_iter_advance(iter, &time));
+    }
+
+    g_assert_true(gdk_pixbuf_apng_anim_iter_get_damage(apng, &damage));
+    g_assert_false(gdk_pixbuf_animation_is_static_image(anim));
+    test_assert_same_pixels(gdk_pixbuf_animation_iter_get_pixbuf(iter),
+                            g_ptr_array_index(shared->canvases, index));
+  }
+
+  g_object_unref(iter);
+
+  return NULL;
+}
+
+/* Reads whatever was loaded so far, while the main thread feeds data. */
+static gpointer test_loading_thread(gpointer data) {
+  TestShared*             shared = data;
+  GdkPixbufAnimation*     anim   = GDK_PIXBUF_ANIMATION(shared->anim);
+  GTimeVal                time   = {0, 0};
+  GdkPixbufAnimationIter* iter   = gdk_pixbuf_animation_get_iter(anim, &time);
+  GdkPixbufApngAnimIter*  apng   = GDK_PIXBUF_APNG_ANIM_ITER(iter);
+
+  while (!g_atomic_int_get(&shared->done)) {
+    GdkPixbufApngRect damage;
+
+    g_time_val_add(&time, 50000);
+    gdk_pixbuf_animation_iter_advance(iter, &time);
+    gdk_pixbuf_animation_iter_on_currently_loading_frame(iter);
+    gdk_pixbuf_apng_anim_iter_seek_time(apng, time.tv_usec / 1000);
+    gdk_pixbuf_apng_anim_iter_get_damage(apng, &damage);
+    gdk_pixbuf_animation_iter_get_pixbuf(iter);
+    gdk_pixbuf_animation_is_static_image(anim);
+    gdk_pixbuf_animation_get_static_image(anim);
+  }
+
+  g_object_unref(iter);
+
+  return NULL;
+}
+
+static void test_threads(void) {
+  GByteArray*         data    = test_apng_new(8, 8, test_steps,
+                                              G_N_ELEMENTS(test_steps));
+  GError*             error   = NULL;
+  GThread*            loading = NULL;
+  GdkPixbufModule     module  = {0};
+  GdkPixbufAnimation* anim    = NULL;
+  TestShared          shared;
+  GThread*            threads[4];
+  gpointer            ctx;
+
+  shared.anim     = test_load(data, data->len, &error);
+  shared.canvases = test_canvases(shared.anim);
+  shared.done     = FALSE;
+  g_assert_no_error(error);
+
+  for (guint i = 0; i < G_N_ELEMENTS(threads); ++i)
+    threads[i] = g_thread_new("apng-test", test_iter_thread, &shared);
+  for (guint i = 0; i < G_N_ELEMENTS(threads); ++i)
+    g_thread_join(threads[i]);
+  g_object_unref(shared.anim);
+
+  /* Frames are appended while they are being read. */
+  fill_vtable(&module);
+  ctx = module.begin_load(NULL, test_prepared, NULL, &anim, &error);
+  g_assert_no_error(error);
+  for (gsize off = 0; off < data->len; ++off) {
+    g_assert_true(module.load_increment(ctx, data->data + off, 1, &error));
+    if (anim != NULL && loading == NULL) {
+      shared.anim = GDK_PIXBUF_APNG_ANIM(anim);
+      loading     = g_thread_new("apng-test", test_loading_thread, &shared);
+    }
+  }
+  g_assert_true(module.stop_load(ctx, &error));
+  g_atomic_int_set(&shared.done, TRUE);
+  g_thread_join(loading);
+
+  g_object_unref(anim);
+  g_ptr_array_unref(shared.canvases);
+  g_byte_array_unref(data);
+}
+
+typedef struct {
+  GByteArray* data;
+  GPtrArray*  canvases;
+  gint        n_chunks;
+  gint        done;
+} TestSettings;
+
+static void test_count_chunk(const gchar* chunk_type, const guchar* data,
+                             gsize size, gpointer user_data) {
+  TestSettings* settings = user_data;
+
+  g_assert_cmpstr(chunk_type, ==, "tEXt");
+  g_atomic_int_inc(&settings->n_chunks);
+}
+
+/* Keeps changing the process wide settings while the others load. */
+static gpointer test_settings_thread(gpointer data) {
+  static const gchar* const types[] = {"tEXt", NULL};
+  TestSettings*             settings = data;
+  GdkPixbufApngLimits       limits   = {64, 16, 1 << 20, 0};
+
+  for (guint i = 0; !g_atomic_int_get(&settings->done); ++i) {
+    GdkPixbufApngLimits current;
+
+    if (i % 2 == 0)
+      gdk_pixbuf_apng_set_chunk_func(types, test_count_chunk, settings);
+    else
+      gdk_pixbuf_apng_set_chunk_func(NULL, NULL, NULL);
+    gdk_pixbuf_apng_set_limits(i % 3 == 0 ? &limits : NULL);
+    gdk_pixbuf_apng_set_verify_crc(i % 5 == 0);
+
+    gdk_pixbuf_apng_get_limits(&current);
+    g_assert_true(current.max_pixels == 0 || current.max_pixels == 64);
+  }
+
+  return NULL;
+}
+
+static gpointer test_settings_loader(gpointer data) {
+  TestSettings* settings = data;
+
+  for (guint i = 0; i < 50; ++i) {
+    GError*            error = NULL;
+    GdkPixbufApngAnim* anim  = test_load(settings->data, 37, &error);
+    GPtrArray*         canvases;
+
+    g_assert_no_error(error);
+    canvases = test_canvases(anim);
+    test_assert_same_canvases(canvases, settings->canvases);
+    g_ptr_array_unref(canvases);
+    g_object_unref(anim);
+  }
+
+  return NULL;
+}
+
+/* Loaders take a consistent copy of the settings, whichever they get. */
+static void test_settings(void) {
+  static const guchar text[] = "Comment\0settings";
+  TestSettings        settings = {NULL};
+  GdkPixbufApngAnim*  anim;
+  GError*             error = NULL;
+  TestApng            apng;
+  GThread*            setter;
+  GThread*            threads[4];
+
+  test_apng_init(&apng, 8, 8, G_N_ELEMENTS(test_steps));
+  test_chunk(&apng, "tEXt", text, sizeof(text) - 1);
+  for (guint i = 0; i < G_N_ELEMENTS(test_steps); ++i)
+    test_apng_frame(&apng, &test_steps[i]);
+  settings.data = test_apng_finish(&apng);
+
+  anim = test_load(settings.data, settings.data->len, &error);
+  g_assert_no_error(error);
+  settings.canvases = test_canvases(anim);
+  g_object_unref(anim);
+
+  setter = g_thread_new("apng-test", test_settings_thread, &settings);
+  for (guint i = 0; i < G_N_ELEMENTS(threads); ++i)
+    threads[i] = g_thread_new("apng-test", test_settings_loader, &settings);
+  for (guint i = 0; i < G_N_ELEMENTS(threads); ++i)
+    g_thread_join(threads[i]);
+  g_atomic_int_set(&settings.done, TRUE);
+  g_thread_join(setter);
+
+  g_assert_cmpint(settings.n_chunks, <=, 50 * G_N_ELEMENTS(threads));
+  gdk_pixbuf_apng_set_chunk_func(NULL, NULL, NULL);
+  gdk_pixbuf_apng_set_limits(NULL);
+  gdk_pixbuf_apng_set_verify_crc(FALSE);
+
+  g_ptr_array_unref(settings.canvases);
+  g_byte_array_unref(settings.data);
+}
+
+/* Probes data both from memory and from a file. */
+static gboolean test_probe(GByteArray* data, GdkPixbufApngInfo* info,
+                           GError** error) {
+  GdkPixbufApngInfo file_info;
+  GError*           file_error = NULL;
+  gboolean          file_ok;
+  gboolean          ok;
+  FILE*             file = tmpfile();
+
+  g_assert_nonnull(file);
+  g_assert_cmpuint(fwrite(data->data, 1, data->len, file), ==, data->len);
+  rewind(file);
+  file_ok = gdk_pixbuf_apng_probe_file(file, &file_info, &file_error);
+  if (file_ok)
+    g_assert_cmpint(ftell(file), ==, data->len);
+  fclose(file);
+
+  ok = gdk_pixbuf_apng_probe_data(data->data, data->len, info, error);
+  g_assert_true(ok == file_ok);
+  if (ok)
+    g_assert_cmpmem(info, sizeof(*info), &file_info, sizeof(file_info));
+  else
+    g_assert_error(file_error, (*error)->domain, (*error)->code);
+  g_clear_error(&file_error);
+
+  return ok;
+}
+
+static void test_probe_info(void) {
+  static const TestFrame frame = {0, 0, 4, 4, 1, APNG_DISPOSE_OP_NONE,
+                                  APNG_BLEND_OP_SOURCE, 0x336699ff};
+  GdkPixbufApngInfo  info;
+  GdkPixbufApngAnim* anim;
+  GByteArray*        data;
+  GByteArray*        chunks;
+  GError*            error = NULL;
+  TestApng           apng;
+
+  /* 30 frames of 1/30 s, rounded once summed rather than frame by frame,
+   * which would give 990 ms.
+   */
+  test_apng_init(&apng, 6, 4, 30);
+  apng.delay_den = 30;
+  for (guint i = 0; i < 30; ++i)
+    test_apng_frame(&apng, &frame);
+  data = test_apng_finish(&apng);
+
+  g_assert_true(test_probe(data, &info, &error));
+  g_assert_no_error(error);
+  g_assert_cmpuint(info.width, ==, 6);
+  g_assert_cmpuint(info.height, ==, 4);
+  g_assert_cmpuint(info.num_frames, ==, 30);
+  g_assert_cmpuint(info.num_plays, ==, 0);
+  g_assert_cmpuint(info.duration, ==, 999);
+
+  anim = test_load(data, data->len, &error);
+  g_assert_no_error(error);
+  g_assert_cmpint(anim->duration_us / 1000, ==, info.duration);
+  g_object_unref(anim);
+
+  /* Cut anywhere, the IEND CRC included. */
+  for (gsize cut = 1; cut <= 4; cut += 3) {
+    g_byte_array_set_size(data, data->len - cut);
+    g_assert_false(test_probe(data, &info, &error));
+    g_assert_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE);
+    g_clear_error(&error);
+  }
+  g_byte_array_set_size(data, 60);
+  g_assert_false(test_probe(data, &info, &error));
+  g_assert_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE);
+  g_clear_error(&error);
+
+  /* Anything before IHDR is refused. */
+  test_apng_init(&apng, 6, 4, 1);
+  chunks = apng.data;
+  apng.data = g_byte_array_new();
+  g_byte_array_append(apng.data, chunks->data, 8);
+  g_byte_array_append(apng.data, chunks->data + 8 + 25, chunks->len - 8 - 25);
+  g_byte_array_append(apng.data, chunks->data + 8, 25);
+  test_apng_frame(&apng, &frame);
+  g_byte_array_unref(data);
+  data = test_apng_finish(&apng);
+  g_assert_cmpmem(data->data + 12, 4, "acTL", 4);
+  g_assert_false(test_probe(data, &info, &error));
+  g_assert_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE);
+  g_clear_error(&error);
+
+  g_byte_array_unref(chunks);
+  g_byte_array_unref(data);
+}
+
+/* Loads data under limits, checking the error when expected is not 0. */
+static void test_load_limited(GByteArray*                data,
+                              const GdkPixbufApngLimits* limits,
+                              gint                       expected) {
+  GdkPixbufApngAnim* anim;
+  GError*            error = NULL;
+
+  gdk_pixbuf_apng_set_limits(limits);
+  anim = test_load(data, 64, &error);
+  gdk_pixbuf_apng_set_limits(NULL);
+
+  if (expected == 0) {
+    g_assert_no_error(error);
+    g_object_unref(anim);
+  } else {
+    g_assert_error(error, GDK_PIXBUF_ERROR, expected);
+    g_assert_null(anim);
+    g_error_free(error);
+  }
+}
+
+static void test_limits(void) {
+  static const TestFrame frames[] = {
+      {0, 0, 8, 8, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x000000ff},
+      {0, 0, 8, 4, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x444444ff},
+      {0, 4, 8, 4, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x888888ff},
+      {2, 2, 4, 4, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0xccccccff},
+  };
+  static const TestFrame large = {0, 0, 256, 256, 100, APNG_DISPOSE_OP_NONE,
+                                  APNG_BLEND_OP_SOURCE, 0x336699ff};
+  GByteArray*         data   = test_apng_new(8, 8, frames, 4);
+  GdkPixbufApngLimits limits = {0};
+  guchar*             icc    = g_malloc0(4096);
+  uLongf              size   = compressBound(4096);
+  guchar*             iccp   = g_malloc0(size + 6);
+  TestApng            apng;
+
+  limits.max_pixels = 63;
+  test_load_limited(data, &limits, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY);
+  limits.max_pixels = 64;
+  test_load_limited(data, &limits, 0);
+
+  limits.max_frames = 3;
+  test_load_limited(data, &limits, GDK_PIXBUF_ERROR_FAILED);
+  limits.max_frames = 4;
+  test_load_limited(data, &limits, 0);
+
+  /* 64 + 32 + 32 + 16 pixels, 4 bytes each. */
+  limits.max_decoded_bytes = 575;
+  test_load_limited(data, &limits, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY);
+  limits.max_decoded_bytes = 576;
+  test_load_limited(data, &limits, 0);
+  g_byte_array_unref(data);
+
+  /* Inflated iCCP profiles count too, valid or not. */
+  memcpy(iccp, "zero", 4);
+  g_assert_cmpint(compress(iccp + 6, &size, icc, 4096), ==, Z_OK);
+  test_apng_init(&apng, 8, 8, 4);
+  test_chunk(&apng, "iCCP", iccp, size + 6);
+  for (guint i = 0; i < G_N_ELEMENTS(frames); ++i)
+    test_apng_frame(&apng, &frames[i]);
+  data = test_apng_finish(&apng);
+  test_load_limited(data, &limits, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY);
+  limits.max_decoded_bytes = 576 + 4096 - 1;
+  test_load_limited(data, &limits, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY);
+  limits.max_decoded_bytes = 576 + 4096;
+  test_load_limited(data, &limits, 0);
+  g_byte_array_unref(data);
+
+  /* Decoding a large frame takes more than a microsecond. */
+  data = test_apng_new(256, 256, &large, 1);
+  memset(&limits, 0, sizeof(limits));
+  limits.max_time_us = 1;
+  test_load_limited(data, &limits, GDK_PIXBUF_ERROR_FAILED);
+  limits.max_time_us = 60 * G_USEC_PER_SEC;
+  test_load_limited(data, &limits, 0);
+  g_byte_array_unref(data);
+
+  gdk_pixbuf_apng_get_limits(&limits);
+  g_assert_cmpuint(limits.max_pixels, ==, 0);
+  g_assert_cmpuint(limits.max_frames, ==, 0);
+  g_assert_cmpuint(limits.max_decoded_bytes, ==, 0);
+  g_assert_cmpint(limits.max_time_us, ==, 0);
+
+  g_free(iccp);
+  g_free(icc);
+}
+
+typedef struct {
+  GdkPixbufApngStream* stream;
+  guint                n_frames;
+  gsize                max_retained;
+} TestStream;
+
+static void test_stream_frame(GdkPixbuf* canvas, gint delay,
+                              gpointer user_data) {
+  TestStream* test = user_data;
+  gsize       retained;
+
+  retained = gdk_pixbuf_apng_pool_get_retained(test->stream->anim->pool, NULL);
+  test->max_retained = MAX(test->max_retained, retained);
+  test->n_frames++;
+}
+
+/* Frames of many different sizes don't pile up in the stream pool. */
+static void test_stream_memory(void) {
+  TestFrame   frames[48];
+  GByteArray* data;
+  GError*     error = NULL;
+  TestStream  test  = {NULL, 0, 0};
+
+  for (guint i = 0; i < G_N_ELEMENTS(frames); ++i) {
+    TestFrame frame = {i % 5, i % 3, 12 + i, 24 + i % 7, 10,
+                       i % 3, APNG_BLEND_OP_OVER, 0x10204080 + i};
+
+    frames[i] = frame;
+  }
+  data = test_apng_new(64, 32, frames, G_N_ELEMENTS(frames));
+
+  test.stream = gdk_pixbuf_apng_stream_new(test_stream_frame, &test, &error);
+  g_assert_no_error(error);
+  g_assert_true(
+      gdk_pixbuf_apng_stream_write(test.stream, data->data, data->len, &error));
+  g_assert_no_error(error);
+  g_assert_true(gdk_pixbuf_apng_stream_close(test.stream, &error));
+  g_assert_no_error(error);
+
+  g_assert_cmpuint(test.n_frames, ==, G_N_ELEMENTS(frames));
+  g_assert_cmpuint(test.max_retained, <=, 2 * 64 * 32 * 4);
+
+  g_byte_array_unref(data);
+}
+
+/* A reset stream keeps its pool, within the bounds of the last canvas. */
+static void test_stream_reset(void) {
+  static const TestFrame frames[] = {
+      {0, 0, 16, 16, 10, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE,
+       0x102030ff},
+      {4, 4, 8, 8, 10, APNG_DISPOSE_OP_PREVIOUS, APNG_BLEND_OP_OVER,
+       0x80402080},
+      {2, 2, 12, 12, 10, APNG_DISPOSE_OP_BACKGROUND, APNG_BLEND_OP_OVER,
+       0x40804040},
+  };
+  GdkPixbufApngPool* pool;
+  GByteArray*        data;
+  GError*            error = NULL;
+  TestStream         test  = {NULL, 0, 0};
+
+  data = test_apng_new(16, 16, frames, G_N_ELEMENTS(frames));
+  test.stream = gdk_pixbuf_apng_stream_new(test_stream_frame, &test, &error);
+  g_assert_no_error(error);
+
+  for (guint i = 0; i < 3; ++i) {
+    g_assert_true(gdk_pixbuf_apng_stream_write(test.stream, data->data,
+                                               data->len, &error));
+    g_assert_no_error(error);
+    pool = test.stream->anim->pool;
+    g_assert_true(gdk_pixbuf_apng_stream_reset(test.stream, &error));
+    g_assert_no_error(error);
+
+    g_assert_true(test.stream->anim->pool == pool);
+    g_assert_cmpuint(gdk_pixbuf_apng_pool_get_retained(pool, NULL), >, 0);
+  }
+  g_assert_cmpuint(test.n_frames, ==, 3 * G_N_ELEMENTS(frames));
+  g_assert_cmpuint(test.max_retained, <=, 2 * 16 * 16 * 4);
+
+  gdk_pixbuf_apng_stream_close(test.stream, NULL);
+  g_byte_array_unref(data);
+}
+
+/* Zero delay frames are handed over like any other. */
+static void test_stream_zero_delay(void) {
+  static const TestFrame frames[] = {
+      {0, 0, 8, 8, 0, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x102030ff},
+      {2, 2, 4, 4, 0, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_OVER, 0x80402080},
+      {0, 0, 8, 8, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_OVER, 0x40804040},
+      {1, 1, 2, 2, 0, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0xffffffff},
+  };
+  GByteArray* data  = test_apng_new(8, 8, frames, G_N_ELEMENTS(frames));
+  GError*     error = NULL;
+  TestStream  test  = {NULL, 0, 0};
+
+  test.stream = gdk_pixbuf_apng_stream_new(test_stream_frame, &test, &error);
+  g_assert_no_error(error);
+  g_assert_true(
+      gdk_pixbuf_apng_stream_write(test.stream, data->data, data->len, &error));
+  g_assert_no_error(error);
+  g_assert_true(gdk_pixbuf_apng_stream_close(test.stream, &error));
+  g_assert_no_error(error);
+
+  g_assert_cmpuint(test.n_frames, ==, G_N_ELEMENTS(frames));
+
+  g_byte_array_unref(data);
+}
+
+typedef struct {
+  GPtrArray* canvases;
+  GArray*    delays;
+} TestShown;
+
+/* Keeps the canvases that stay on screen, the last one whatever its delay,
+ * the others when their delay isn't zero.
+ */
+static void test_shown_add(TestShown* shown, GdkPixbuf* canvas, gint delay) {
+  if (shown->delays->len > 0 &&
+      g_array_index(shown->delays, gint, shown->delays->len - 1) == 0) {
+    g_ptr_array_remove_index(shown->canvases, shown->canvases->len - 1);
+    g_array_set_size(shown->delays, shown->delays->len - 1);
+  }
+  g_ptr_array_add(shown->canvases, gdk_pixbuf_copy(canvas));
+  g_array_append_val(shown->delays, delay);
+}
+
+static void test_shown_frame(GdkPixbuf* canvas, gint delay,
+                             gpointer user_data) {
+  test_shown_add(user_data, canvas, delay);
+}
+
+static void test_shown_init(TestShown* shown) {
+  shown->canvases = g_ptr_array_new_with_free_func(g_object_unref);
+  shown->delays   = g_array_new(FALSE, FALSE, sizeof(gint));
+}
+
+static void test_shown_clear(TestShown* shown) {
+  g_ptr_array_unref(shown->canvases);
+  g_array_unref(shown->delays);
+}
+
+/* Loads frames, whose zero delay ones get merged where possible, and checks
+ * the frames left and their canvases against the unmerged ones the stream
+ * hands over.
+ */
+static void test_assert_merged(const TestFrame* frames, guint n_frames,
+                               guint n_merged, gboolean is_static) {
+  GByteArray*          data  = test_apng_new(8, 8, frames, n_frames);
+  GError*              error = NULL;
+  GdkPixbufApngStream* stream;
+  GdkPixbufApngAnim*   anim;
+  GPtrArray*           canvases;
+  TestShown            expected;
+  TestShown            loaded;
+
+  test_shown_init(&expected);
+  stream = gdk_pixbuf_apng_stream_new(test_shown_frame, &expected, &error);
+  g_assert_no_error(error);
+  g_assert_true(
+      gdk_pixbuf_apng_stream_write(stream, data->data, data->len, &error));
+  g_assert_no_error(error);
+  g_assert_true(gdk_pixbuf_apng_stream_close(stream, &error));
+  g_assert_no_error(error);
+
+  /* Byte by byte too, frames arrive while the merge canvas is in use. */
+  for (gsize step = data->len; step > 0; step = step > 1 ? 1 : 0) {
+    anim = test_load(data, step, &error);
+    g_assert_no_error(error);
+    g_assert_cmpuint(anim->n_frames, ==, n_merged);
+    g_assert_cmpuint(anim->n_decoded, ==, n_frames);
+    g_assert_true(gdk_pixbuf_animation_is_static_image(
+                      GDK_PIXBUF_ANIMATION(anim)) == is_static);
+
+    test_shown_init(&loaded);
+    canvases = test_canvases(anim);
+    for (guint i = 0; i < canvases->len; ++i) {
+      GdkPixbufApngFrameInfo info;
+
+      g_assert_true(gdk_pixbuf_apng_anim_get_frame_info(anim, i, &info));
+      test_shown_add(&loaded, g_ptr_array_index(canvases, i), info.delay);
+    }
+    test_assert_same_canvases(loaded.canvases, expected.canvases);
+    g_assert_cmpmem(loaded.delays->data, loaded.delays->len * sizeof(gint),
+                    expected.delays->data,
+                    expected.delays->len * sizeof(gint));
+
+    test_shown_clear(&loaded);
+    g_ptr_array_unref(canvases);
+    g_object_unref(anim);
+  }
+
+  test_shown_clear(&expected);
+  g_byte_array_unref(data);
+}
+
+static void test_merge(void) {
+  /* Runs mixing PREVIOUS and BACKGROUND disposal, blended OVER. */
+  static const TestFrame runs[] = {
+      {0, 0, 8, 8, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE,
+       0x202020ff},
+      {1, 1, 4, 4, 0, APNG_DISPOSE_OP_PREVIOUS, APNG_BLEND_OP_OVER,
+       0xff000080},
+      {2, 2, 2, 2, 0, APNG_DISPOSE_OP_PREVIOUS, APNG_BLEND_OP_OVER,
+       0x00ff0080},
+      {0, 0, 6, 6, 0, APNG_DISPOSE_OP_BACKGROUND, APNG_BLEND_OP_OVER,
+       0x0000ff80},
+      /* Not nested with the area cleared before, kept as is. */
+      {3, 3, 4, 4, 0, APNG_DISPOSE_OP_BACKGROUND, APNG_BLEND_OP_OVER,
+       0xffff0040},
+      {4, 4, 4, 4, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_OVER,
+       0xffffff80},
+      {0, 0, 2, 2, 0, APNG_DISPOSE_OP_PREVIOUS, APNG_BLEND_OP_OVER,
+       0x80808080},
+      /* PREVIOUS then BACKGROUND that doesn't contain it, kept. */
+      {0, 0, 1, 1, 100, APNG_DISPOSE_OP_BACKGROUND, APNG_BLEND_OP_OVER,
+       0x40404040},
+      /* PREVIOUS would also undo the frame before, kept. */
+      {2, 2, 4, 4, 0, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_OVER, 0x00ffff80},
+      {3, 3, 2, 2, 100, APNG_DISPOSE_OP_PREVIOUS, APNG_BLEND_OP_OVER,
+       0xff00ff80},
+      {0, 0, 1, 1, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE,
+       0xffffffff},
+  };
+  /* The last frame has no delay, it is kept, merged with the one before. */
+  static const TestFrame last[] = {
+      {0, 0, 8, 8, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE,
+       0x102030ff},
+      {2, 2, 4, 4, 0, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_OVER, 0xff000080},
+      {1, 1, 2, 2, 0, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE,
+       0x00ff0040},
+  };
+  /* Everything ends up in a single frame. */
+  static const TestFrame single[] = {
+      {0, 0, 8, 8, 0, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x000000ff},
+      {0, 0, 8, 8, 0, APNG_DISPOSE_OP_BACKGROUND, APNG_BLEND_OP_OVER,
+       0xff000080},
+      {1, 1, 6, 6, 0, APNG_DISPOSE_OP_BACKGROUND, APNG_BLEND_OP_OVER,
+       0x00ff0080},
+      {0, 0, 4, 4, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_OVER, 0x0000ffc0},
+  };
+
+  test_assert_merged(runs, G_N_ELEMENTS(runs), 8, FALSE);
+  test_assert_merged(last, G_N_ELEMENTS(last), 2, FALSE);
+  test_assert_merged(single, G_N_ELEMENTS(single), 1, TRUE);
+}
+
+typedef struct {
+  const TestFrame* frames;
+  guint            n_bands;
+  guint            n_rows;
+  const guchar*    pixels;
+} TestBands;
+
+static void test_band(guint index, const ApngChunk_fcTL* fctl, GdkPixbuf* band,
+                      guint y, gpointer user_data) {
+  TestBands*       test  = user_data;
+  const TestFrame* frame = &test->frames[index];
+
+  g_assert_cmpuint(fctl->width, ==, frame->width);
+  g_assert_cmpint(gdk_pixbuf_get_width(band), ==, frame->width);
+  g_assert_cmpint(gdk_pixbuf_get_height(band), ==, MIN(3, frame->height - y));
+  for (gint j = 0; j < gdk_pixbuf_get_height(band); ++j)
+    for (gint i = 0; i < gdk_pixbuf_get_width(band); ++i)
+      g_assert_cmphex(test_pixel(band, i, j), ==, frame->colour);
+
+  /* Every band is a view of the same buffer. */
+  if (test->pixels == NULL)
+    test->pixels = gdk_pixbuf_get_pixels(band);
+  g_assert_true(gdk_pixbuf_get_pixels(band) == test->pixels);
+
+  test->n_bands++;
+  test->n_rows += gdk_pixbuf_get_height(band);
+}
+
+static void test_stream_bands(void) {
+  static const TestFrame frames[] = {
+      {0, 0, 10, 7, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE,
+       0x102030ff},
+      {2, 1, 5, 4, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE,
+       0x405060ff},
+      {9, 6, 1, 1, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE,
+       0x708090ff},
+      {0, 0, 8, 3, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE,
+       0xa0b0c0ff},
+  };
+  GByteArray*          data  = test_apng_new(10, 7, frames, 4);
+  GError*              error = NULL;
+  TestBands            test  = {frames, 0, 0, NULL};
+  GdkPixbufApngStream* stream;
+
+  stream = gdk_pixbuf_apng_stream_new_banded(test_band, 3, &test, &error);
+  g_assert_no_error(error);
+  g_assert_true(gdk_pixbuf_apng_stream_write(stream, data->data, data->len,
+                                             &error));
+  g_assert_no_error(error);
+  g_assert_true(gdk_pixbuf_apng_stream_close(stream, &error));
+  g_assert_no_error(error);
+
+  g_assert_cmpuint(test.n_bands, ==, 3 + 2 + 1 + 1);
+  g_assert_cmpuint(test.n_rows, ==, 7 + 4 + 1 + 3);
+
+  g_byte_array_unref(data);
+}
+
+static void test_band_rows(guint index, const ApngChunk_fcTL* fctl,
+                           GdkPixbuf* band, guint y, gpointer user_data) {
+  guint* n_rows = user_data;
+
+  n_rows[MIN(index, 2)] += gdk_pixbuf_get_height(band);
+}
+
+/* Decodes data through a banded stream, counting the rows of each frame. */
+static gboolean test_decode_bands(GByteArray* data, guint n_rows[3],
+                                  GError** error) {
+  GdkPixbufApngStream* stream;
+
+  n_rows[0] = n_rows[1] = n_rows[2] = 0;
+  stream = gdk_pixbuf_apng_stream_new_banded(test_band_rows, 1, n_rows, error);
+  g_assert_nonnull(stream);
+  if (!gdk_pixbuf_apng_stream_write(stream, data->data, data->len, error)) {
+    gdk_pixbuf_apng_stream_close(stream, NULL);
+    return FALSE;
+  }
+
+  return gdk_pixbuf_apng_stream_close(stream, error);
+}
+
+/* A chunk whose CRC doesn't match fails the load, and none of its rows
+ * reach the caller, only when checking CRCs.
+ */
+static void test_crc(void) {
+  static const TestFrame frames[] = {
+      {0, 0, 8, 8, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0xff0000ff},
+      {0, 0, 8, 8, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x00ff00ff},
+  };
+  GdkPixbufModule     module = {0};
+  GdkPixbufApngFrame* frame;
+  GdkPixbufApngAnim*  anim;
+  GError*             error = NULL;
+  GByteArray*         data;
+  TestApng            apng;
+  gpointer            ctx;
+  gsize               fdat;
+  gsize               size;
+  guint32             length;
+  guint               n_rows[3];
+
+  test_apng_init(&apng, 8, 8, 2);
+  test_apng_frame(&apng, &frames[0]);
+  /* The single fdAT of the second frame, right after its fcTL. */
+  fdat = apng.data->len + 12 + 26;
+  test_apng_frame(&apng, &frames[1]);
+  data = test_apng_finish(&apng);
+  g_assert_cmpmem(data->data + fdat + 4, 4, "fdAT", 4);
+  memcpy(&length, data->data + fdat, 4);
+  data->data[fdat + 8 + GUINT32_FROM_BE(length)] ^= 0x01;
+
+  anim = test_load(data, 5, &error);
+  g_assert_no_error(error);
+  g_assert_cmpuint(anim->n_frames, ==, 2);
+  g_object_unref(anim);
+  g_assert_true(test_decode_bands(data, n_rows, &error));
+  g_assert_no_error(error);
+  g_assert_cmpuint(n_rows[1], ==, 8);
+
+  gdk_pixbuf_apng_set_verify_crc(TRUE);
+
+  g_assert_null(test_load(data, 5, &error));
+  g_assert_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE);
+  g_clear_error(&error);
+
+  g_assert_false(test_decode_bands(data, n_rows, &error));
+  g_assert_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE);
+  g_clear_error(&error);
+  g_assert_cmpuint(n_rows[0], ==, 8);
+  g_assert_cmpuint(n_rows[1], ==, 0);
+
+  /* The frame is inflated, but gets no pixels until its CRC is known. */
+  fill_vtable(&module);
+  ctx = module.begin_load(NULL, NULL, NULL, NULL, &error);
+  g_assert_no_error(error);
+  size = fdat + 8 + GUINT32_FROM_BE(length);
+  g_assert_true(module.load_increment(ctx, data->data, size, &error));
+  g_assert_no_error(error);
+  frame = ((ApngContext*)ctx)->frame;
+  g_assert_nonnull(frame);
+  g_assert_cmpuint(frame->off, ==, frame->size);
+  g_assert_null(frame->pixbuf);
+  g_assert_false(module.load_increment(ctx, data->data + size,
+                                       data->len - size, &error));
+  g_assert_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE);
+  g_clear_error(&error);
+  module.stop_load(ctx, NULL);
+
+  gdk_pixbuf_apng_set_verify_crc(FALSE);
+  g_byte_array_unref(data);
+}
+
+/* Whatever the input is cut into, chunks split frame data included, the
+ * same frames come out, unknown chunks are skipped and registered ones
+ * handed over whole.
+ */
+static void test_state_machine(void) {
+  static const TestFrame frames[] = {
+      {0, 0, 6, 5, 100, APNG_DISPOSE_OP_BACKGROUND, APNG_BLEND_OP_SOURCE,
+       0xff0000ff},
+      {1, 1, 3, 2, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_OVER, 0x0000ff80},
+      {2, 0, 4, 5, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE,
+       0x00ff00ff},
+  };
+  static const gchar* const types[] = {"tEXt", NULL};
+  GPtrArray*                reference = NULL;
+  TestApng                  apng;
+  GByteArray*               data;
+
+  test_apng_init(&apng, 6, 5, G_N_ELEMENTS(frames));
+  apng.split = 7;
+  test_chunk(&apng, "tEXt", (const guchar*)"Title", 5);
+  test_apng_frame(&apng, &frames[0]);
+  test_chunk(&apng, "zzZz", (const guchar*)"skipped", 7);
+  test_apng_frame(&apng, &frames[1]);
+  test_chunk(&apng, "tEXt", (const guchar*)"Author", 6);
+  test_apng_frame(&apng, &frames[2]);
+  data = test_apng_finish(&apng);
+
+  for (gsize step = 1; step <= data->len; step = step * 3 + 1) {
+    GString*           chunks = g_string_new(NULL);
+    GError*            error  = NULL;
+    GdkPixbufApngAnim* anim;
+    GPtrArray*         canvases;
+
+    gdk_pixbuf_apng_set_chunk_func(types, test_chunk_func, chunks);
+    anim = test_load(data, step, &error);
+    gdk_pixbuf_apng_set_chunk_func(NULL, NULL, NULL);
+    g_assert_no_error(error);
+    g_assert_cmpuint(anim->n_frames, ==, G_N_ELEMENTS(frames));
+    g_assert_cmpstr(chunks->str, ==, "tEXt:Title;tEXt:Author;");
+
+    canvases = test_canvases(anim);
+    if (reference == NULL)
+      reference = g_ptr_array_ref(canvases);
+    test_assert_same_canvases(reference, canvases);
+
+    g_ptr_array_unref(canvases);
+    g_object_unref(anim);
+    g_string_free(chunks, TRUE);
+  }
+
+  /* The second frame is blended over the first one, the third replaces
+   * the right part of the canvas.
+   */
+  g_assert_cmphex(test_pixel(g_ptr_array_index(reference, 0), 0, 0), ==,
+                  0xff0000ff);
+  g_assert_cmphex(test_pixel(g_ptr_array_index(reference, 1), 0, 0), ==,
+                  0x00000000);
+  g_assert_cmphex(test_pixel(g_ptr_array_index(reference, 1), 1, 1), ==,
+                  0x0000ff80);
+  g_assert_cmphex(test_pixel(g_ptr_array_index(reference, 2), 1, 1), ==,
+                  0x0000ff80);
+  g_assert_cmphex(test_pixel(g_ptr_array_index(reference, 2), 5, 4), ==,
+                  0x00ff00ff);
+
+  g_ptr_array_unref(reference);
+  g_byte_array_unref(data);
+}
+
+static void test_truncated(void) {
+  static const TestFrame frames[] = {
+      {0, 0, 4, 4, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0xffffffff},
+      {0, 0, 4, 4, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x000000ff},
+  };
+  GByteArray* data = test_apng_new(4, 4, frames, 2);
+
+  /* Cut anywhere, the data is reported as incomplete or corrupt. */
+  for (guint len = 0; len + 12 < data->len; ++len) {
+    GByteArray* part  = g_byte_array_new();
+    GError*     error = NULL;
+
+    g_byte_array_append(part, data->data, len);
+    g_assert_null(test_load(part, 5, &error));
+    g_assert_nonnull(error);
+    g_assert_true(error->domain == GDK_PIXBUF_ERROR);
+    g_error_free(error);
+    g_byte_array_unref(part);
+  }
+
+  g_byte_array_unref(data);
+}
+
+/* The same file is shared without being decoded again. */
+static void test_cache(void) {
+  static const TestFrame frames[] = {
+      {0, 0, 4, 4, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x336699ff},
+      {1, 1, 2, 2, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0xffffffff},
+  };
+  static const TestFrame changed[] = {
+      {0, 0, 4, 4, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x996633ff},
+      {1, 1, 2, 2, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0xffffffff},
+  };
+  GByteArray*             data   = test_apng_new(4, 4, frames, 2);
+  gsize                   size   = data->len;
+  GdkPixbufModule         module = {0};
+  GdkPixbufApngCacheStats stats;
+  GdkPixbufAnimation*     first;
+  GdkPixbufAnimation*     second;
+  GdkPixbufAnimation*     third;
+  GError*                 error = NULL;
+  struct timespec         times[2];
+  struct stat             st;
+  gchar*                  path;
+  FILE*                   file;
+  gint                    fd;
+
+  fd = g_file_open_tmp("apng-test-XXXXXX.png", &path, &error);
+  g_assert_no_error(error);
+  file = fdopen(fd, "w+b");
+  g_assert_nonnull(file);
+  g_assert_cmpuint(fwrite(data->data, 1, data->len, file), ==, data->len);
+
+  fill_vtable(&module);
+  gdk_pixbuf_apng_cache_set_budget(1 << 20);
+
+  rewind(file);
+  first = module.load_animation(file, &error);
+  g_assert_no_error(error);
+  rewind(file);
+  second = module.load_animation(file, &error);
+  g_assert_no_error(error);
+  g_assert_true(first == second);
+
+  gdk_pixbuf_apng_cache_get_stats(&stats);
+  g_assert_cmpuint(stats.misses, ==, 1);
+  g_assert_cmpuint(stats.hits, ==, 1);
+  g_assert_cmpuint(stats.n_entries, ==, 1);
+
+  /* Rewritten in place, same size and modification time. */
+  g_assert_cmpint(fstat(fd, &st), ==, 0);
+  g_byte_array_unref(data);
+  data = test_apng_new(4, 4, changed, 2);
+  g_assert_cmpuint(data->len, ==, size);
+  rewind(file);
+  g_assert_cmpuint(fwrite(data->data, 1, data->len, file), ==, data->len);
+  g_assert_cmpint(fflush(file), ==, 0);
+  times[0] = st.st_atim;
+  times[1] = st.st_mtim;
+  g_assert_cmpint(futimens(fd, times), ==, 0);
+
+  rewind(file);
+  third = module.load_animation(file, &error);
+  g_assert_no_error(error);
+  g_assert_true(third != first);
+  g_assert_cmphex(test_pixel(gdk_pixbuf_animation_get_static_image(third), 0,
+                             0),
+                  ==, 0x996633ff);
+  gdk_pixbuf_apng_cache_get_stats(&stats);
+  g_assert_cmpuint(stats.misses, ==, 2);
+
+  /* Aliases need both names. */
+  g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_CRITICAL, "*alias != NULL*");
+  gdk_pixbuf_apng_cache_alias(NULL, "key");
+  g_test_assert_expected_messages();
+  g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_CRITICAL, "*key != NULL*");
+  gdk_pixbuf_apng_cache_alias("alias", NULL);
+  g_test_assert_expected_messages();
+
+  gdk_pixbuf_apng_cache_clear();
+  gdk_pixbuf_apng_cache_set_budget(0);
+
+  g_object_unref(third);
+  g_object_unref(second);
+  g_object_unref(first);
+  fclose(file);
+  g_unlink(path);
+  g_free(path);
+  g_byte_array_unref(data);
+}
+
+/* Ends apng, started with its colour chunks, with a 0x80c040ff frame and
+ * returns the pixel it decodes to.
+ */
+static guint32 test_colour_pixel(TestApng* apng) {
+  static const TestFrame frame = {0, 0, 1, 1, 100, APNG_DISPOSE_OP_NONE,
+                                  APNG_BLEND_OP_SOURCE, 0x80c040ff};
+  GByteArray*         data;
+  GdkPixbufApngAnim*  anim;
+  GdkPixbufApngFrame* last;
+  GError*             error = NULL;
+  guint32             pixel;
+
+  test_apng_frame(apng, &frame);
+  data = test_apng_finish(apng);
+
+  anim = test_load(data, data->len, &error);
+  g_assert_no_error(error);
+  last  = gdk_pixbuf_apng_anim_get_frame(anim, anim->n_frames - 1);
+  pixel = test_pixel(last->pixbuf, 0, 0);
+
+  g_object_unref(anim);
+  g_byte_array_unref(data);
+
+  return pixel;
+}
+
+/* The payload of an iCCP chunk: a matrix/TRC profile of linear sRGB, with
+ * D50 colorants, zero padded to icc_size bytes before being deflated.
+ */
+static GByteArray* test_iccp_new(gsize icc_size) {
+  static const gchar* const colorants[] = {"rXYZ", "gXYZ", "bXYZ"};
+  static const gchar* const curves[]    = {"rTRC", "gTRC", "bTRC"};
+  static const gdouble      xyz[3][3]   = {{0.4361, 0.2225, 0.0139},
+                                           {0.3851, 0.7169, 0.0971},
+                                           {0.1431, 0.0606, 0.7141}};
+  guchar*                   icc         = g_malloc0(icc_size);
+  uLongf                    size        = compressBound(icc_size);
+  GByteArray*               iccp        = g_byte_array_new();
+
+  /* Header, 6 tags, 3 XYZ tags and a curv tag shared by the channels. */
+  g_assert_cmpuint(icc_size, >=, 276);
+  test_be32(icc, 276);
+  memcpy(icc + 16, "RGB XYZ ", 8);
+  memcpy(icc + 36, "acsp", 4);
+  test_be32(icc + 128, 6);
+  for (guint c = 0; c < 3; ++c) {
+    guchar* tag = icc + 204 + 20 * c;
+
+    memcpy(icc + 132 + 12 * c, colorants[c], 4);
+    test_be32(icc + 136 + 12 * c, 204 + 20 * c);
+    test_be32(icc + 140 + 12 * c, 20);
+    memcpy(tag, "XYZ ", 4);
+    for (guint i = 0; i < 3; ++i)
+      test_be32(tag + 8 + 4 * i, lround(xyz[c][i] * 65536));
+
+    memcpy(icc + 168 + 12 * c, curves[c], 4);
+    test_be32(icc + 172 + 12 * c, 264);
+    test_be32(icc + 176 + 12 * c, 12);
+  }
+  /* No entries, the identity curve. */
+  memcpy(icc + 264, "curv", 4);
+
+  g_byte_array_append(iccp, (const guint8*)"test\0", 6);
+  g_byte_array_set_size(iccp, 6 + size);
+  g_assert_cmpint(compress(iccp->data + 6, &size, icc, icc_size), ==, Z_OK);
+  g_byte_array_set_size(iccp, 6 + size);
+  g_free(icc);
+
+  return iccp;
+}
+
+/* The pixel test_colour_pixel decodes with an iCCP chunk of payload iccp,
+ * after an sRGB chunk the profile takes precedence over when usable.
+ */
+static guint32 test_iccp_pixel(GByteArray* iccp) {
+  guchar   srgb = 0;
+  TestApng apng;
+
+  test_apng_init(&apng, 1, 1, 1);
+  test_chunk(&apng, "sRGB", &srgb, 1);
+  test_chunk(&apng, "iCCP", iccp->data, iccp->len);
+  g_byte_array_unref(iccp);
+
+  return test_colour_pixel(&apng);
+}
+
+/* Samples are converted to sRGB as the colour chunks describe them. */
+static void test_colour(void) {
+  static const guint32 srgb_chrm[] = {31270, 32900, 64000, 33000,
+                                      30000, 60000, 15000, 6000};
+  guchar               linear[4];
+  guchar               approx[4];
+  guchar               chrm[32];
+  guchar               srgb = 0;
+  GByteArray*          iccp;
+  TestApng             apng;
+
+  test_be32(linear, 100000);
+  test_be32(approx, 45455);
+
+  test_apng_init(&apng, 1, 1, 1);
+  g_assert_cmphex(test_colour_pixel(&apng), ==, 0x80c040ff);
+
+  test_apng_init(&apng, 1, 1, 1);
+  test_chunk(&apng, "sRGB", &srgb, 1);
+  g_assert_cmphex(test_colour_pixel(&apng), ==, 0x80c040ff);
+
+  /* Linear samples come out lighter, alpha is left alone. */
+  test_apng_init(&apng, 1, 1, 1);
+  test_chunk(&apng, "gAMA", linear, 4);
+  test_assert_pixel_near(test_colour_pixel(&apng), 0xbce18aff);
+
+  /* The gamma sRGB approximates changes next to nothing. */
+  test_apng_init(&apng, 1, 1, 1);
+  test_chunk(&apng, "gAMA", approx, 4);
+  test_assert_pixel_near(test_colour_pixel(&apng), 0x80c040ff);
+
+  /* sRGB takes precedence over gAMA. */
+  test_apng_init(&apng, 1, 1, 1);
+  test_chunk(&apng, "gAMA", linear, 4);
+  test_chunk(&apng, "sRGB", &srgb, 1);
+  g_assert_cmphex(test_colour_pixel(&apng), ==, 0x80c040ff);
+
+  /* Colour chunks after the image data are ignored. */
+  test_apng_init(&apng, 1, 1, 2);
+  test_apng_frame(&apng, &(TestFrame){0, 0, 1, 1, 100, APNG_DISPOSE_OP_NONE,
+                                      APNG_BLEND_OP_SOURCE, 0x000000ff});
+  test_chunk(&apng, "gAMA", linear, 4);
+  g_assert_cmphex(test_colour_pixel(&apng), ==, 0x80c040ff);
+
+  /* sRGB primaries change nothing, red and green swapped swap the
+   * channels. An invalid chunk is ignored.
+   */
+  for (guint i = 0; i < 8; ++i)
+    test_be32(chrm + 4 * i, srgb_chrm[i]);
+  test_apng_init(&apng, 1, 1, 1);
+  test_chunk(&apng, "cHRM", chrm, sizeof(chrm));
+  test_chunk(&apng, "gAMA", linear, 4);
+  test_assert_pixel_near(test_colour_pixel(&apng), 0xbce18aff);
+  test_be32(chrm + 8, srgb_chrm[4]);
+  test_be32(chrm + 12, srgb_chrm[5]);
+  test_be32(chrm + 16, srgb_chrm[2]);
+  test_be32(chrm + 20, srgb_chrm[3]);
+  test_apng_init(&apng, 1, 1, 1);
+  test_chunk(&apng, "cHRM", chrm, sizeof(chrm));
+  test_assert_pixel_near(test_colour_pixel(&apng), 0xc08040ff);
+  test_apng_init(&apng, 1, 1, 1);
+  test_chunk(&apng, "cHRM", chrm, sizeof(chrm) - 1);
+  g_assert_cmphex(test_colour_pixel(&apng), ==, 0x80c040ff);
+
+  /* A usable profile takes precedence over sRGB. */
+  test_assert_pixel_near(test_iccp_pixel(test_iccp_new(276)), 0xbce18aff);
+  test_assert_pixel_near(
+      test_iccp_pixel(test_iccp_new(APNG_MAX_ICC_PROFILE_SIZE)), 0xbce18aff);
+
+  /* Unusable ones are ignored: corrupt zlib header, checksum or stream
+   * end, and chunks or profiles past the size caps.
+   */
+  iccp = test_iccp_new(276);
+  iccp->data[6] ^= 0x0f;
+  g_assert_cmphex(test_iccp_pixel(iccp), ==, 0x80c040ff);
+  iccp = test_iccp_new(276);
+  iccp->data[iccp->len - 1] ^= 0xff;
+  g_assert_cmphex(test_iccp_pixel(iccp), ==, 0x80c040ff);
+  iccp = test_iccp_new(276);
+  g_byte_array_set_size(iccp, iccp->len - 8);
+  g_assert_cmphex(test_iccp_pixel(iccp), ==, 0x80c040ff);
+  iccp = test_iccp_new(276);
+  g_byte_array_set_size(iccp, APNG_MAX_ICCP_CHUNK_SIZE + 1);
+  g_assert_cmphex(test_iccp_pixel(iccp), ==, 0x80c040ff);
+  iccp = test_iccp_new(APNG_MAX_ICC_PROFILE_SIZE + 1);
+  g_assert_cmphex(test_iccp_pixel(iccp), ==, 0x80c040ff);
+}
+
+/* Appends frames to apng and returns the canvas after each of them. */
+static GPtrArray* test_type_canvases(TestApng* apng, const TestFrame* frames,
+                                     guint n_frames, GdkPixbufApngAnim** anim) {
+  GByteArray* data;
+  GError*     error = NULL;
+  GPtrArray*  canvases;
+
+  for (guint i = 0; i < n_frames; ++i)
+    test_apng_frame(apng, &frames[i]);
+  data = test_apng_finish(apng);
+
+  *anim = test_load(data, data->len, &error);
+  g_assert_no_error(error);
+  g_assert_cmpuint((*anim)->n_frames, ==, n_frames);
+  canvases = test_canvases(*anim);
+  g_byte_array_unref(data);
+
+  return canvases;
+}
+
+/* Frame i is stored with alpha or as 3 channels, every pixel being pixel. */
+static void test_assert_storage(GdkPixbufApngAnim* anim, guint i,
+                                gboolean has_alpha, guint32 pixel) {
+  GdkPixbuf* pixbuf = gdk_pixbuf_apng_anim_get_frame(anim, i)->pixbuf;
+
+  g_assert_cmpint(gdk_pixbuf_get_has_alpha(pixbuf), ==, has_alpha);
+  g_assert_cmpint(gdk_pixbuf_get_n_channels(pixbuf), ==, has_alpha ? 4 : 3);
+  for (gint y = 0; y < gdk_pixbuf_get_height(pixbuf); ++y)
+    for (gint x = 0; x < gdk_pixbuf_get_width(pixbuf); ++x)
+      g_assert_cmphex(test_pixel(pixbuf, x, y), ==, pixel);
+}
+
+/* Canvas i has alpha or not, its pixels being pixels, row by row. */
+static void test_assert_canvas(GPtrArray* canvases, guint i,
+                               gboolean has_alpha, const guint32* pixels) {
+  GdkPixbuf* canvas = g_ptr_array_index(canvases, i);
+  gint       width  = gdk_pixbuf_get_width(canvas);
+
+  g_assert_cmpint(gdk_pixbuf_get_has_alpha(canvas), ==, has_alpha);
+  for (gint y = 0; y < gdk_pixbuf_get_height(canvas); ++y)
+    for (gint x = 0; x < width; ++x)
+      test_assert_pixel_near(test_pixel(canvas, x, y), pixels[y * width + x]);
+}
+
+/* Frames and canvases only carry alpha when a pixel needs it, whatever the
+ * colour type.
+ */
+static void test_colour_types(void) {
+  static const TestFrame rgb[] = {
+      {0, 0, 2, 1, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x102030ff},
+      {1, 0, 1, 1, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_OVER, 0x405060ff},
+  };
+  static const TestFrame rgba[] = {
+      {0, 0, 2, 1, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x10203080},
+      {0, 0, 1, 1, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_OVER, 0x405060ff},
+  };
+  static const TestFrame background[] = {
+      {0, 0, 2, 2, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x405060ff},
+      {0, 0, 1, 1, 100, APNG_DISPOSE_OP_BACKGROUND, APNG_BLEND_OP_OVER,
+       0x708090ff},
+      {1, 0, 1, 1, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_OVER, 0x708090ff},
+  };
+  static const TestFrame source[] = {
+      {0, 0, 2, 2, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x405060ff},
+      {1, 1, 1, 1, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0x102030ff},
+  };
+  static const TestFrame indexed[] = {
+      {0, 0, 2, 1, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_SOURCE, 0},
+      {1, 0, 1, 1, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_OVER, 1},
+      {0, 0, 1, 1, 100, APNG_DISPOSE_OP_NONE, APNG_BLEND_OP_OVER, 2},
+  };
+  static const guchar plte[] = {0x11, 0x22, 0x33, 0x44, 0x55,
+                                0x66, 0x77, 0x88, 0x99};
+  static const guchar trns_rgb[] = {0, 0x10, 0, 0x20, 0, 0x30};
+  static const guchar trns_plte[] = {0xff, 0x80};
+  GdkPixbufApngAnim*  anim;
+  GPtrArray*          canvases;
+  TestApng            apng;
+
+  /* Opaque RGB stays 3 channels, OVER copies. */
+  test_apng_init_type(&apng, 2, 1, G_N_ELEMENTS(rgb), 2);
+  canvases = test_type_canvases(&apng, rgb, G_N_ELEMENTS(rgb), &anim);
+  test_assert_storage(anim, 0, FALSE, 0x102030ff);
+  test_assert_storage(anim, 1, FALSE, 0x405060ff);
+  test_assert_canvas(canvases, 0, FALSE, (guint32[]){0x102030ff, 0x102030ff});
+  test_assert_canvas(canvases, 1, FALSE, (guint32[]){0x102030ff, 0x405060ff});
+  g_ptr_array_unref(canvases);
+  g_object_unref(anim);
+
+  /* An opaque RGBA frame is stored as 3 channels, copied over alpha. */
+  test_apng_init(&apng, 2, 1, G_N_ELEMENTS(rgba));
+  canvases = test_type_canvases(&apng, rgba, G_N_ELEMENTS(rgba), &anim);
+  test_assert_storage(anim, 0, TRUE, 0x10203080);
+  test_assert_storage(anim, 1, FALSE, 0x405060ff);
+  test_assert_canvas(canvases, 1, TRUE, (guint32[]){0x405060ff, 0x10203080});
+  g_ptr_array_unref(canvases);
+  g_object_unref(anim);
+
+  /* tRNS frames without its colour are opaque. Clearing to the background
+   * adds alpha to the canvas.
+   */
+  test_apng_init_type(&apng, 2, 2, G_N_ELEMENTS(background), 2);
+  test_chunk(&apng, "tRNS", trns_rgb, sizeof(trns_rgb));
+  canvases = test_type_canvases(&apng, background, G_N_ELEMENTS(background),
+                                &anim);
+  test_assert_storage(anim, 0, FALSE, 0x405060ff);
+  test_assert_storage(anim, 1, FALSE, 0x708090ff);
+  test_assert_canvas(canvases, 1, FALSE,
+                     (guint32[]){0x708090ff, 0x405060ff, 0x405060ff,
+                                 0x405060ff});
+  test_assert_canvas(canvases, 2, TRUE,
+                     (guint32[]){0x00000000, 0x708090ff, 0x405060ff,
+                                 0x405060ff});
+  g_ptr_array_unref(canvases);
+  g_object_unref(anim);
+
+  /* The tRNS colour is transparent, its source frame adds alpha. */
+  test_apng_init_type(&apng, 2, 2, G_N_ELEMENTS(source), 2);
+  test_chunk(&apng, "tRNS", trns_rgb, sizeof(trns_rgb));
+  canvases = test_type_canvases(&apng, source, G_N_ELEMENTS(source), &anim);
+  test_assert_storage(anim, 1, TRUE, 0x10203000);
+  test_assert_canvas(canvases, 0, FALSE,
+                     (guint32[]){0x405060ff, 0x405060ff, 0x405060ff,
+                                 0x405060ff});
+  test_assert_canvas(canvases, 1, TRUE,
+                     (guint32[]){0x405060ff, 0x405060ff, 0x405060ff,
+                                 0x10203000});
+  g_ptr_array_unref(canvases);
+  g_object_unref(anim);
+
+  /* Opaque palette. */
+  test_apng_init_type(&apng, 2, 1, G_N_ELEMENTS(indexed), 3);
+  test_chunk(&apng, "PLTE", plte, sizeof(plte));
+  canvases = test_type_canvases(&apng, indexed, G_N_ELEMENTS(indexed), &anim);
+  test_assert_storage(anim, 0, FALSE, 0x112233ff);
+  test_assert_storage(anim, 1, FALSE, 0x445566ff);
+  test_assert_storage(anim, 2, FALSE, 0x778899ff);
+  test_assert_canvas(canvases, 2, FALSE, (guint32[]){0x778899ff, 0x445566ff});
+  g_ptr_array_unref(canvases);
+  g_object_unref(anim);
+
+  /* Only frames using a translucent entry of the palette get alpha, the
+   * canvas doesn't as they are blended over it.
+   */
+  test_apng_init_type(&apng, 2, 1, G_N_ELEMENTS(indexed), 3);
+  test_chunk(&apng, "PLTE", plte, sizeof(plte));
+  test_chunk(&apng, "tRNS", trns_plte, sizeof(trns_plte));
+  canvases = test_type_canvases(&apng, indexed, G_N_ELEMENTS(indexed), &anim);
+  test_assert_storage(anim, 0, FALSE, 0x112233ff);
+  test_assert_storage(anim, 1, TRUE, 0x44556680);
+  test_assert_storage(anim, 2, FALSE, 0x778899ff);
+  test_assert_canvas(canvases, 1, FALSE, (guint32[]){0x112233ff, 0x2b3c4dff});
+  test_assert_canvas(canvases, 2, FALSE, (guint32[]){0x778899ff, 0x2b3c4dff});
+  g_ptr_array_unref(canvases);
+  g_object_unref(anim);
+}
+
+static gboolean test_save_func(const gchar* buf, gsize count, GError** error,
+                               gpointer data) {
+  g_byte_array_append(data, (const guint8*)buf, count);
+  return TRUE;
+}
+
+/* Frame i of the round trip: a gradient, moving over a transparent corner
+ * that becomes opaque again.
+ */
+static GdkPixbuf* test_roundtrip_frame(guint i) {
+  GdkPixbuf* pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, 9, 7);
+
+  for (gint y = 0; y < 7; ++y) {
+    for (gint x = 0; x < 9; ++x) {
+      guchar* p = gdk_pixbuf_get_pixels(pixbuf) +
+                  y * gdk_pixbuf_get_rowstride(pixbuf) + x * 4;
+
+      p[0] = x * 29 + y * 3;
+      p[1] = y * 37;
+      p[2] = x >= (gint)i && x < (gint)i + 3 ? 0xff : 0x10;
+      p[3] = x < 2 && y < 2 && i % 3 == 1 ? 0 : (x == 8 ? 0x80 : 0xff);
+    }
+  }
+
+  return pixbuf;
+}
+
+/* Saved frames come back unchanged, whatever the encoder chose to store. */
+static void test_roundtrip(void) {
+  static const gint  delays[] = {40, 60, 20, 100, 100, 30};
+  GdkPixbuf*         frames[G_N_ELEMENTS(delays)];
+  GByteArray*        data  = g_byte_array_new();
+  GError*            error = NULL;
+  GdkPixbufApngAnim* anim;
+  GPtrArray*         canvases;
+  gint64             start_us = 0;
+  guint              j        = 0;
+
+  for (guint i = 0; i < G_N_ELEMENTS(frames); ++i)
+    frames[i] = test_roundtrip_frame(i);
+  /* Identical consecutive frames are merged. */
+  g_object_unref(frames[4]);
+  frames[4] = g_object_ref(frames[3]);
+
+  g_assert_true(gdk_pixbuf_apng_save_to_callback(
+      test_save_func, data, frames, delays, G_N_ELEMENTS(frames), 0, -1,
+      &error));
+  g_assert_no_error(error);
+
+  anim = test_load(data, data->len, &error);
+  g_assert_no_error(error);
+  g_assert_cmpuint(anim->n_frames, ==, G_N_ELEMENTS(frames) - 1);
+  canvases = test_canvases(anim);
+
+  for (guint i = 0; i < G_N_ELEMENTS(frames); ++i) {
+    GdkPixbuf* canvas;
+
+    while (j + 1 < anim->n_frames &&
+           gdk_pixbuf_apng_anim_get_frame(anim, j + 1)->start_us <= start_us)
+      ++j;
+    canvas = g_ptr_array_index(canvases, j);
+
+    for (gint y = 0; y < 7; ++y) {
+      for (gint x = 0; x < 9; ++x) {
+        guint32 expected = test_pixel(frames[i], x, y);
+        guint32 pixel    = test_pixel(canvas, x, y);
+
+        /* Colour doesn't matter under full transparency. */
+        if ((expected & 0xff) == 0)
+          g_assert_cmphex(pixel & 0xff, ==, 0);
+        else
+          g_assert_cmphex(pixel, ==, expected);
+      }
+    }
+    start_us += delays[i] * 1000;
+  }
+  g_assert_cmpint(anim->duration_us, ==, start_us);
+
+  for (guint i = 0; i < G_N_ELEMENTS(frames); ++i)
+    g_object_unref(frames[i]);
+  g_ptr_array_unref(canvases);
+  g_object_unref(anim);
+  g_byte_array_unref(data);
+}
+
+int main(int argc, char** argv) {
+  g_test_init(&argc, &argv, NULL);
+
+  g_test_add_func("/pool/reuse", test_pool_reuse);
+  g_test_add_func("/pool/bounds", test_pool_bounds);
+  g_test_add_func("/iter/damage", test_damage);
+  g_test_add_func("/iter/held-pixbuf", test_held_pixbuf);
+  g_test_add_func("/iter/seek", test_seek);
+  g_test_add_func("/iter/threads", test_threads);
+  g_test_add_func("/iter/merge", test_merge);
+  g_test_add_func("/iter/argb32", test_argb32);
+  g_test_add_func("/load/state-machine", test_state_machine);
+  g_test_add_func("/load/truncated", test_truncated);
+  g_test_add_func("/load/probe", test_probe_info);
+  g_test_add_func("/load/limits", test_limits);
+  g_test_add_func("/load/settings", test_settings);
+  g_test_add_func("/load/crc", test_crc);
+  g_test_add_func("/stream/memory", test_stream_memory);
+  g_test_add_func("/stream/reset", test_stream_reset);
+  g_test_add_func("/stream/zero-delay", test_stream_zero_delay);
+  g_test_add_func("/stream/bands", test_stream_bands);
+  g_test_add_func("/cache/file", test_cache);
+  g_test_add_func("/colour/chunks", test_colour);
+  g_test_add_func("/colour/types", test_colour_types);
+  g_test_add_func("/save/roundtrip", test_roundtrip);
+
+  return g_test_run();
+}
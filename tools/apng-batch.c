@@ -0,0 +1,661 @@
+/* Decodes every APNG file of a directory tree on a set of worker threads,
+ * optionally writing the composited frames or a contact sheet per file, and
+ * reports the aggregate throughput and the slowest inputs.
+ *
+ * In shared mode every worker loads every file through the module and the
+ * animation cache instead, and steps an iterator of its own over the same
+ * animation, checking that all of them see the same canvases.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "io-apng-animation.h"
+#include "io-apng-cache.h"
+#include "io-apng-save.h"
+#include "io-apng.h"
+
+#define APNG_BATCH_READ_SIZE (256 * 1024)
+
+/* Decoded frames the cache keeps in shared mode. */
+#define APNG_BATCH_CACHE_BUDGET (256 << 20)
+
+/* Frames past this many are left out of the contact sheets. */
+#define APNG_BATCH_MAX_SHEET_FRAMES 100
+
+typedef struct {
+  gchar* path;
+  /* Relative to the directory it was found in, names the outputs. */
+  const gchar* name;
+
+  gboolean ok;
+  gchar*   error;
+  gsize    size;
+  guint    n_frames;
+  gint64   time_us;
+
+  /* Shared mode, checksum of each canvas as seen by the first worker. */
+  GArray* checksums;
+} ApngBatchFile;
+
+typedef struct {
+  GPtrArray* files;
+  gint       next;
+
+  const gchar* frames_dir;
+  const gchar* sheets_dir;
+  gint         thumb_size;
+
+  GdkPixbufModule module;
+  /* Guards the file results, written by every worker in shared mode. */
+  GMutex lock;
+  /* Text chunks handed to the chunk callback. */
+  gint n_text_chunks;
+} ApngBatch;
+
+/* Each worker decodes its files through the same stream and read buffer. */
+typedef struct {
+  ApngBatch*           batch;
+  GdkPixbufApngStream* stream;
+  guchar*              buf;
+
+  ApngBatchFile* file;
+  GPtrArray*     thumbs;
+  GError*        write_error;
+} ApngBatchWorker;
+
+static gint     opt_jobs       = 0;
+static gchar*   opt_frames_dir = NULL;
+static gchar*   opt_sheets_dir = NULL;
+static gint     opt_thumb_size = 128;
+static gint     opt_slowest    = 10;
+static gboolean opt_verify_crc = FALSE;
+static gboolean opt_shared     = FALSE;
+static gchar**  opt_paths      = NULL;
+
+static GOptionEntry apng_batch_options[] = {
+    {"jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs,
+     "Number of worker threads, one per processor by default", "N"},
+    {"frames", 'f', 0, G_OPTION_ARG_FILENAME, &opt_frames_dir,
+     "Write every composited frame as a PNG file under DIR", "DIR"},
+    {"sheets", 's', 0, G_OPTION_ARG_FILENAME, &opt_sheets_dir,
+     "Write a contact sheet of each file under DIR", "DIR"},
+    {"thumb-size", 't', 0, G_OPTION_ARG_INT, &opt_thumb_size,
+     "Size of the contact sheet cells, 128 by default", "PIXELS"},
+    {"slowest", 'n', 0, G_OPTION_ARG_INT, &opt_slowest,
+     "Number of slowest inputs to report, 10 by default", "N"},
+    {"verify-crc", 0, 0, G_OPTION_ARG_NONE, &opt_verify_crc,
+     "Fail on chunks with an invalid CRC", NULL},
+    {"shared", 0, 0, G_OPTION_ARG_NONE, &opt_shared,
+     "Load every file on every worker through the cache, and step the "
+     "animations from all of them at once",
+     NULL},
+    {G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_paths, NULL,
+     "PATH..."},
+    {NULL}};
+
+/* The module entry points, normally looked up by gdk-pixbuf. */
+void fill_vtable(GdkPixbufModule* module);
+
+static void apng_batch_file_free(gpointer data) {
+  ApngBatchFile* file = data;
+
+  if (file->checksums != NULL)
+    g_array_unref(file->checksums);
+  g_free(file->path);
+  g_free(file->error);
+  g_free(file);
+}
+
+static gboolean apng_batch_is_apng(const gchar* name) {
+  return g_str_has_suffix(name, ".png") || g_str_has_suffix(name, ".PNG") ||
+         g_str_has_suffix(name, ".apng") || g_str_has_suffix(name, ".APNG");
+}
+
+static void apng_batch_add_file(ApngBatch* batch, const gchar* path,
+                                gsize name_offset) {
+  ApngBatchFile* file = g_new0(ApngBatchFile, 1);
+
+  file->path = g_strdup(path);
+  file->name = file->path + name_offset;
+  g_ptr_array_add(batch->files, file);
+}
+
+/* Adds the APNG files under dir, symbolic links to directories are not
+ * followed.
+ */
+static void apng_batch_scan(ApngBatch* batch, const gchar* dir,
+                            gsize name_offset) {
+  GDir*        handle;
+  const gchar* name;
+  GError*      error = NULL;
+
+  handle = g_dir_open(dir, 0, &error);
+  if (handle == NULL) {
+    g_printerr("%s\n", error->message);
+    g_error_free(error);
+    return;
+  }
+
+  while ((name = g_dir_read_name(handle)) != NULL) {
+    gchar* path = g_build_filename(dir, name, NULL);
+
+    if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+      if (!g_file_test(path, G_FILE_TEST_IS_SYMLINK))
+        apng_batch_scan(batch, path, name_offset);
+    } else if (apng_batch_is_apng(name)) {
+      apng_batch_add_file(batch, path, name_offset);
+    }
+    g_free(path);
+  }
+
+  g_dir_close(handle);
+}
+
+static gint apng_batch_compare_path(gconstpointer a, gconstpointer b) {
+  const ApngBatchFile* fa = *(ApngBatchFile* const*)a;
+  const ApngBatchFile* fb = *(ApngBatchFile* const*)b;
+
+  return strcmp(fa->path, fb->path);
+}
+
+static gint apng_batch_compare_time(gconstpointer a, gconstpointer b) {
+  const ApngBatchFile* fa = *(ApngBatchFile* const*)a;
+  const ApngBatchFile* fb = *(ApngBatchFile* const*)b;
+
+  return (fa->time_us < fb->time_us) - (fa->time_us > fb->time_us);
+}
+
+static gboolean apng_batch_write(const gchar* buf, gsize count,
+                                 GError** error, gpointer data) {
+  if (fwrite(buf, 1, count, data) == count)
+    return TRUE;
+
+  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+              "Failed to write: %s", g_strerror(errno));
+  return FALSE;
+}
+
+/* Writes pixbuf as a single frame PNG file, creating its directory. */
+static gboolean apng_batch_save(GdkPixbuf* pixbuf, const gchar* path,
+                                GError** error) {
+  gchar*   dir = g_path_get_dirname(path);
+  FILE*    file;
+  gint     delay = 0;
+  gboolean ok;
+
+  g_mkdir_with_parents(dir, 0755);
+  g_free(dir);
+
+  file = fopen(path, "wb");
+  if (file == NULL) {
+    g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Failed to open '%s': %s", path, g_strerror(errno));
+    return FALSE;
+  }
+
+  ok = gdk_pixbuf_apng_save_to_callback(apng_batch_write, file, &pixbuf,
+                                        &delay, 1, 0, -1, error);
+  if (fclose(file) != 0 && ok) {
+    g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Failed to write '%s': %s", path, g_strerror(errno));
+    ok = FALSE;
+  }
+
+  return ok;
+}
+
+/* Scales canvas down to fit a contact sheet cell. */
+static GdkPixbuf* apng_batch_thumbnail(GdkPixbuf* canvas, gint size) {
+  gint       width  = gdk_pixbuf_get_width(canvas);
+  gint       height = gdk_pixbuf_get_height(canvas);
+  gdouble    scale  = MIN(1.0, (gdouble)size / MAX(width, height));
+  GdkPixbuf* thumb;
+
+  width  = MAX(1, (gint)(width * scale));
+  height = MAX(1, (gint)(height * scale));
+  thumb  = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, width, height);
+  if (thumb == NULL)
+    return NULL;
+
+  gdk_pixbuf_fill(thumb, 0);
+  gdk_pixbuf_composite(canvas, thumb, 0, 0, width, height, 0, 0,
+                       (gdouble)width / gdk_pixbuf_get_width(canvas),
+                       (gdouble)height / gdk_pixbuf_get_height(canvas),
+                       GDK_INTERP_BILINEAR, 255);
+
+  return thumb;
+}
+
+static gboolean apng_batch_save_sheet(ApngBatchWorker* worker,
+                                      GError**         error) {
+  GPtrArray* thumbs = worker->thumbs;
+  gint       size   = worker->batch->thumb_size;
+  gint       columns;
+  gint       rows;
+  GdkPixbuf* sheet;
+  gchar*     path;
+  gboolean   ok;
+
+  if (thumbs->len == 0)
+    return TRUE;
+
+  columns = (gint)ceil(sqrt(thumbs->len));
+  rows    = (thumbs->len + columns - 1) / columns;
+  sheet   = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, columns * size,
+                           rows * size);
+  if (sheet == NULL) {
+    g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                        GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                        "Not enough memory for the contact sheet");
+    return FALSE;
+  }
+
+  gdk_pixbuf_fill(sheet, 0);
+  for (guint i = 0; i < thumbs->len; ++i) {
+    GdkPixbuf* thumb = g_ptr_array_index(thumbs, i);
+
+    gdk_pixbuf_copy_area(thumb, 0, 0, gdk_pixbuf_get_width(thumb),
+                         gdk_pixbuf_get_height(thumb), sheet,
+                         (i % columns) * size, (i / columns) * size);
+  }
+
+  path = g_strdup_printf("%s/%s.png", worker->batch->sheets_dir,
+                         worker->file->name);
+  ok   = apng_batch_save(sheet, path, error);
+  g_free(path);
+  g_object_unref(sheet);
+
+  return ok;
+}
+
+static void apng_batch_frame(GdkPixbuf* canvas, gint delay,
+                             gpointer user_data) {
+  ApngBatchWorker* worker = user_data;
+  ApngBatch*       batch  = worker->batch;
+  guint            index  = worker->file->n_frames++;
+
+  /* The first output error fails the file, later frames aren't written. */
+  if (worker->write_error != NULL)
+    return;
+
+  if (batch->frames_dir != NULL) {
+    gchar* path = g_strdup_printf("%s/%s.%04u.png", batch->frames_dir,
+                                  worker->file->name, index);
+
+    apng_batch_save(canvas, path, &worker->write_error);
+    g_free(path);
+  }
+
+  if (batch->sheets_dir != NULL &&
+      worker->thumbs->len < APNG_BATCH_MAX_SHEET_FRAMES) {
+    GdkPixbuf* thumb = apng_batch_thumbnail(canvas, batch->thumb_size);
+
+    if (thumb != NULL)
+      g_ptr_array_add(worker->thumbs, thumb);
+  }
+}
+
+static gboolean apng_batch_decode(ApngBatchWorker* worker, GError** error) {
+  ApngBatchFile* file = worker->file;
+  FILE*          input;
+  gsize          count;
+  gboolean       ok = TRUE;
+
+  input = fopen(file->path, "rb");
+  if (input == NULL) {
+    g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Failed to open: %s", g_strerror(errno));
+    return FALSE;
+  }
+
+  while (ok &&
+         (count = fread(worker->buf, 1, APNG_BATCH_READ_SIZE, input)) > 0) {
+    file->size += count;
+    ok = gdk_pixbuf_apng_stream_write(worker->stream, worker->buf, count,
+                                      error);
+  }
+  if (ok && ferror(input)) {
+    g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "Failed to read");
+    ok = FALSE;
+  }
+  fclose(input);
+
+  /* The stream is reset whatever happened, ready for the next file. */
+  if (!gdk_pixbuf_apng_stream_reset(worker->stream, ok ? error : NULL))
+    ok = FALSE;
+
+  if (ok && worker->write_error != NULL) {
+    g_propagate_error(error, g_steal_pointer(&worker->write_error));
+    ok = FALSE;
+  }
+  if (ok && worker->batch->sheets_dir != NULL)
+    ok = apng_batch_save_sheet(worker, error);
+
+  return ok;
+}
+
+/* Counted in shared mode, to go through the chunk callback. */
+static const gchar* const apng_batch_text_chunks[] = {"tEXt", "iTXt", "zTXt",
+                                                      NULL};
+
+static void apng_batch_chunk(const gchar* chunk_type, const guchar* data,
+                             gsize size, gpointer user_data) {
+  ApngBatch* batch = user_data;
+
+  g_atomic_int_inc(&batch->n_text_chunks);
+}
+
+static guint32 apng_batch_checksum(GdkPixbuf* pixbuf) {
+  const guchar* pixels    = gdk_pixbuf_get_pixels(pixbuf);
+  gint          rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+  gint          width     = gdk_pixbuf_get_width(pixbuf) *
+                   gdk_pixbuf_get_n_channels(pixbuf);
+  guint32       crc       = crc32(0, NULL, 0);
+
+  for (gint y = 0; y < gdk_pixbuf_get_height(pixbuf); ++y)
+    crc = crc32(crc, pixels + y * rowstride, width);
+
+  return crc;
+}
+
+/* Steps an iterator forward over every frame with seek_frame, then back
+ * with seek_time, appending the checksum of each canvas to checksums.
+ */
+static gboolean apng_batch_step(GdkPixbufAnimation* anim, GArray* checksums,
+                                guint* n_frames, GError** error) {
+  GdkPixbufApngAnim*      apng = GDK_PIXBUF_APNG_ANIM(anim);
+  GdkPixbufAnimationIter* iter;
+  GdkPixbufApngAnimIter*  apng_iter;
+  GdkPixbufApngFrameInfo  info;
+  GdkPixbufApngRect       damage;
+  GTimeVal                time = {0, 0};
+  gboolean                ok   = TRUE;
+
+  if (gdk_pixbuf_animation_get_static_image(anim) == NULL) {
+    g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                        GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                        "Failed to composite the static image");
+    return FALSE;
+  }
+  gdk_pixbuf_animation_is_static_image(anim);
+
+  iter      = gdk_pixbuf_animation_get_iter(anim, &time);
+  apng_iter = GDK_PIXBUF_APNG_ANIM_ITER(iter);
+
+  for (*n_frames = 0;
+       ok && gdk_pixbuf_apng_anim_get_frame_info(apng, *n_frames, &info);
+       ++*n_frames) {
+    GdkPixbuf* canvas;
+    guint32    checksum;
+
+    gdk_pixbuf_apng_anim_iter_seek_frame(apng_iter, *n_frames);
+    gdk_pixbuf_apng_anim_iter_get_damage(apng_iter, &damage);
+    canvas = gdk_pixbuf_animation_iter_get_pixbuf(iter);
+    ok     = canvas != NULL;
+    if (ok) {
+      checksum = apng_batch_checksum(canvas);
+      g_array_append_val(checksums, checksum);
+    }
+  }
+
+  /* Going backwards restarts from keyframes, the canvases don't change. */
+  for (guint i = *n_frames; ok && i-- > 0;) {
+    GdkPixbuf* canvas;
+    guint32    checksum;
+
+    gdk_pixbuf_apng_anim_get_frame_info(apng, i, &info);
+    gdk_pixbuf_apng_anim_iter_seek_time(apng_iter, info.start);
+    if (apng_iter->current_frame != i)
+      continue;
+
+    canvas = gdk_pixbuf_animation_iter_get_pixbuf(iter);
+    ok     = canvas != NULL;
+    if (ok) {
+      checksum = apng_batch_checksum(canvas);
+      g_array_append_val(checksums, checksum);
+    }
+  }
+  g_object_unref(iter);
+
+  if (!ok)
+    g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                        GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                        "Failed to composite a frame");
+
+  return ok;
+}
+
+/* Shared mode, loads the file through the module and the cache, and checks
+ * the canvases against the ones the other workers saw.
+ */
+static gboolean apng_batch_load_shared(ApngBatch* batch, ApngBatchFile* file,
+                                       GError** error) {
+  GdkPixbufAnimation* anim;
+  GArray*             checksums;
+  FILE*               input;
+  gsize               size;
+  guint               n_frames;
+  gboolean            ok;
+
+  input = fopen(file->path, "rb");
+  if (input == NULL) {
+    g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Failed to open: %s", g_strerror(errno));
+    return FALSE;
+  }
+  anim = (*batch->module.load_animation)(input, error);
+  fseek(input, 0, SEEK_END);
+  size = ftell(input);
+  fclose(input);
+  if (anim == NULL)
+    return FALSE;
+
+  checksums = g_array_new(FALSE, FALSE, sizeof(guint32));
+  ok        = apng_batch_step(anim, checksums, &n_frames, error);
+  g_object_unref(anim);
+
+  g_mutex_lock(&batch->lock);
+  if (ok && file->checksums == NULL) {
+    file->checksums = g_array_ref(checksums);
+    file->size      = size;
+    file->n_frames  = n_frames;
+  } else if (ok && (file->checksums->len != checksums->len ||
+                    memcmp(file->checksums->data, checksums->data,
+                           checksums->len * sizeof(guint32)) != 0)) {
+    g_set_error_literal(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                        "Workers composited different canvases");
+    ok = FALSE;
+  }
+  g_mutex_unlock(&batch->lock);
+  g_array_unref(checksums);
+
+  return ok;
+}
+
+/* Shared mode, every worker goes through every file in the same order. */
+static gpointer apng_batch_shared_worker(gpointer data) {
+  ApngBatch* batch = data;
+  GError*    error = NULL;
+
+  for (guint i = 0; i < batch->files->len; ++i) {
+    ApngBatchFile* file  = g_ptr_array_index(batch->files, i);
+    gint64         start = g_get_monotonic_time();
+    gboolean       ok    = apng_batch_load_shared(batch, file, &error);
+    gint64         time  = g_get_monotonic_time() - start;
+
+    g_mutex_lock(&batch->lock);
+    file->time_us = MAX(file->time_us, time);
+    if (!ok && file->error == NULL)
+      file->error = g_strdup(error->message);
+    file->ok = file->error == NULL;
+    g_mutex_unlock(&batch->lock);
+    g_clear_error(&error);
+  }
+
+  return NULL;
+}
+
+static gpointer apng_batch_worker(gpointer data) {
+  ApngBatchWorker worker = {data};
+  ApngBatch*      batch  = data;
+  GError*         error  = NULL;
+  gint            i;
+
+  worker.stream =
+      gdk_pixbuf_apng_stream_new(apng_batch_frame, &worker, &error);
+  if (worker.stream == NULL) {
+    g_printerr("%s\n", error->message);
+    g_error_free(error);
+    return NULL;
+  }
+  worker.buf    = g_malloc(APNG_BATCH_READ_SIZE);
+  worker.thumbs = g_ptr_array_new_with_free_func(g_object_unref);
+
+  while ((i = g_atomic_int_add(&batch->next, 1)) < (gint)batch->files->len) {
+    gint64 start = g_get_monotonic_time();
+
+    worker.file          = g_ptr_array_index(batch->files, i);
+    worker.file->ok      = apng_batch_decode(&worker, &error);
+    worker.file->time_us = g_get_monotonic_time() - start;
+    if (error != NULL) {
+      worker.file->error = g_strdup(error->message);
+      g_clear_error(&error);
+    }
+
+    g_clear_error(&worker.write_error);
+    g_ptr_array_set_size(worker.thumbs, 0);
+  }
+
+  gdk_pixbuf_apng_stream_close(worker.stream, NULL);
+  g_ptr_array_unref(worker.thumbs);
+  g_free(worker.buf);
+
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  GOptionContext* context;
+  ApngBatch       batch = {0};
+  GThread**       threads;
+  GPtrArray*      slowest;
+  GError*         error    = NULL;
+  guint64         n_bytes  = 0;
+  guint64         n_frames = 0;
+  guint           n_failed = 0;
+  gint64          start;
+  gdouble         elapsed;
+
+  context = g_option_context_new("PATH... - decode APNG files in parallel");
+  g_option_context_add_main_entries(context, apng_batch_options, NULL);
+  if (!g_option_context_parse(context, &argc, &argv, &error)) {
+    g_printerr("%s\n", error->message);
+    return 2;
+  }
+  g_option_context_free(context);
+
+  if (opt_paths == NULL || opt_thumb_size <= 0) {
+    g_printerr("Usage: %s [OPTION...] PATH...\n", g_get_prgname());
+    return 2;
+  }
+  if (opt_shared && (opt_frames_dir != NULL || opt_sheets_dir != NULL)) {
+    g_printerr("--shared writes neither frames nor sheets\n");
+    return 2;
+  }
+  if (opt_jobs <= 0)
+    opt_jobs = g_get_num_processors();
+  gdk_pixbuf_apng_set_verify_crc(opt_verify_crc);
+  if (opt_shared) {
+    fill_vtable(&batch.module);
+    gdk_pixbuf_apng_cache_set_budget(APNG_BATCH_CACHE_BUDGET);
+    gdk_pixbuf_apng_set_chunk_func(apng_batch_text_chunks, apng_batch_chunk,
+                                   &batch);
+  }
+
+  batch.files      = g_ptr_array_new_with_free_func(apng_batch_file_free);
+  batch.frames_dir = opt_frames_dir;
+  batch.sheets_dir = opt_sheets_dir;
+  batch.thumb_size = opt_thumb_size;
+  g_mutex_init(&batch.lock);
+  for (gchar** path = opt_paths; *path != NULL; ++path) {
+    if (g_file_test(*path, G_FILE_TEST_IS_DIR)) {
+      gsize length = strlen(*path);
+
+      /* Names start after the separator g_build_filename puts, if any. */
+      while (length > 1 && G_IS_DIR_SEPARATOR((*path)[length - 1]))
+        length--;
+      apng_batch_scan(&batch, *path,
+                      G_IS_DIR_SEPARATOR((*path)[length - 1]) ? length
+                                                              : length + 1);
+    } else {
+      gchar* name = g_path_get_basename(*path);
+
+      apng_batch_add_file(&batch, *path, strlen(*path) - strlen(name));
+      g_free(name);
+    }
+  }
+  g_ptr_array_sort(batch.files, apng_batch_compare_path);
+
+  start   = g_get_monotonic_time();
+  threads = g_new(GThread*, opt_jobs);
+  for (gint i = 0; i < opt_jobs; ++i)
+    threads[i] = g_thread_new(
+        "apng-batch",
+        opt_shared ? apng_batch_shared_worker : apng_batch_worker, &batch);
+  for (gint i = 0; i < opt_jobs; ++i)
+    g_thread_join(threads[i]);
+  elapsed = MAX(g_get_monotonic_time() - start, 1) / 1e6;
+  g_free(threads);
+
+  slowest = g_ptr_array_new();
+  for (guint i = 0; i < batch.files->len; ++i) {
+    ApngBatchFile* file = g_ptr_array_index(batch.files, i);
+
+    n_bytes += file->size;
+    n_frames += file->n_frames;
+    if (!file->ok) {
+      n_failed++;
+      g_printerr("%s: %s\n", file->path,
+                 file->error != NULL ? file->error : "Failed to decode");
+    }
+    g_ptr_array_add(slowest, file);
+  }
+  g_ptr_array_sort(slowest, apng_batch_compare_time);
+
+  printf("%u files, %u failed, %" G_GUINT64_FORMAT " frames, %.1f MB in "
+         "%.2f s with %d threads\n",
+         batch.files->len, n_failed, n_frames, n_bytes / 1e6, elapsed,
+         opt_jobs);
+  printf("%.1f files/s, %.1f MB/s\n", batch.files->len / elapsed,
+         n_bytes / 1e6 / elapsed);
+  if (slowest->len > 0 && opt_slowest > 0) {
+    printf("slowest:\n");
+    for (guint i = 0; i < MIN(slowest->len, (guint)opt_slowest); ++i) {
+      ApngBatchFile* file = g_ptr_array_index(slowest, i);
+
+      printf("  %10.2f ms  %s\n", file->time_us / 1e3, file->path);
+    }
+  }
+  if (opt_shared) {
+    GdkPixbufApngCacheStats stats;
+
+    gdk_pixbuf_apng_cache_get_stats(&stats);
+    printf("cache: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT
+           " misses, %u entries, %.1f MB\n",
+           stats.hits, stats.misses, stats.n_entries, stats.size / 1e6);
+    printf("%d text chunks\n", g_atomic_int_get(&batch.n_text_chunks));
+    gdk_pixbuf_apng_cache_clear();
+  }
+
+  g_ptr_array_unref(slowest);
+  g_ptr_array_unref(batch.files);
+  g_mutex_clear(&batch.lock);
+  g_strfreev(opt_paths);
+  g_free(opt_frames_dir);
+  g_free(opt_sheets_dir);
+
+  return n_failed > 0 ? 1 : 0;
+}